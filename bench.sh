@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Headless benchmark: runs the clients against a software-rendering weston on a private socket,
+# with a virtual (vivid) capture device or a file source, and prints one JSON object per run on stdout.
+#
+# Needs: weston (with the headless backend), and for minimal_nv12 the vivid kernel module or /dev/udmabuf.
+# Works without a GPU: weston renders with pixman, and EGL clients fall back to llvmpipe.
+#
+# Environment:
+#   BENCH_FRAMES   Nr of frames per run (default 600).
+#   BENCH_DEVICE   Capture device to use instead of looking for vivid.
+#                  Without either, a generated file is played back (needs /dev/udmabuf).
+#   WESTON         The weston binary (default: weston).
+#
+
+FRAMES=${BENCH_FRAMES:-600}
+WESTON=${WESTON:-weston}
+SOCKET=bench-$$
+TIMEOUT=$((FRAMES / 10 + 30))
+
+if [ -z "$XDG_RUNTIME_DIR" ]; then
+	XDG_RUNTIME_DIR=$(mktemp -d)
+	export XDG_RUNTIME_DIR
+fi
+export LIBGL_ALWAYS_SOFTWARE=1
+
+# Start a headless compositor on its own socket, so that we never touch the desktop session.
+$WESTON --backend=headless --renderer=pixman --socket=$SOCKET --idle-time=0 >weston-$SOCKET.log 2>&1 &
+WESTON_PID=$!
+trap 'kill $WESTON_PID 2>/dev/null; rm -f weston-$SOCKET.log' EXIT
+
+i=0
+while [ ! -S "$XDG_RUNTIME_DIR/$SOCKET" ]; do
+	i=$((i + 1))
+	if [ $i -gt 50 ] || ! kill -0 $WESTON_PID 2>/dev/null; then
+		echo "bench: weston did not start:" >&2
+		cat weston-$SOCKET.log >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+export WAYLAND_DISPLAY=$SOCKET
+
+# Runs a client, and passes on its JSON line. A failed run still gets a line, so that regressions show.
+run() {
+	name=$1
+	shift
+	out=$(timeout $TIMEOUT "$@" 2>>bench-$SOCKET.log | grep '^{')
+	if [ -n "$out" ]; then
+		echo "$out"
+	else
+		echo "{\"program\":\"$name\",\"error\":\"no result\"}"
+	fi
+}
+
+run minimal_wayland_client ./minimal_wayland_client -c $FRAMES
+run minimal_wayland_client ./minimal_wayland_client -f -c $FRAMES
+run minimal_wayland_client ./minimal_wayland_client -r -c $FRAMES
+
+# Find a vivid capture device, loading the module if we are allowed to.
+DEVICE=$BENCH_DEVICE
+if [ -z "$DEVICE" ]; then
+	[ -d /sys/module/vivid ] || modprobe vivid 2>/dev/null || sudo -n modprobe vivid 2>/dev/null
+	for dev in /sys/class/video4linux/video*; do
+		if grep -q vivid "$dev/name" 2>/dev/null; then
+			DEVICE=/dev/$(basename $dev)
+			break
+		fi
+	done
+fi
+if [ -n "$DEVICE" ]; then
+	run minimal_nv12 ./minimal_nv12 -c $FRAMES $DEVICE NV12
+	run minimal_nv12 ./minimal_nv12 -t -c $FRAMES $DEVICE NV12
+else
+	# Play back a generated (grey) NV12 clip instead, at a fixed rate.
+	CLIP=bench-$SOCKET.nv12
+	head -c $((1280 * 720 * 3 / 2 * 30)) /dev/zero | tr '\0' '\200' > $CLIP
+	run minimal_nv12 ./minimal_nv12 -s 1280x720@60 -c $FRAMES $CLIP NV12
+	run minimal_nv12 ./minimal_nv12 -s 1280x720@60 -t -c $FRAMES $CLIP NV12
+	rm -f $CLIP
+fi
+
+# The CPU conversion kernels need no compositor, or device.
+run pixel_bench ./pixel_bench
+
+rm -f bench-$SOCKET.log
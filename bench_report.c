@@ -0,0 +1,59 @@
+//
+// Machine-readable benchmark results: one JSON object per run, on a line of its own.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "bench_report.h"
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+void bench_report_start(struct bench_report* report, const char* program, const char* mode)
+{
+	memset(report, 0, sizeof(*report));
+	report->program = program;
+	report->mode = mode;
+	report->start_ns = now_ns();
+}
+
+
+void bench_report_print(const struct bench_report* report, FILE* f)
+{
+	const double seconds = (now_ns() - report->start_ns) / 1e9;
+
+	// CPU time of the whole process, user plus system, including any capture thread.
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	const double cpu_ms =
+		(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3 +
+		(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e3;
+
+	fprintf
+	(
+		f,
+		"{\"program\":\"%s\",\"mode\":\"%s\",\"frames\":%d,\"seconds\":%.3f,\"fps\":%.2f,\"cpu_ms_per_frame\":%.3f,\"dropped\":%d,\"resizes\":%d,\"reallocs\":%d,\"reallocs_per_s\":%.2f,\"startup_ms\":%.2f}\n",
+		report->program,
+		report->mode,
+		report->frames,
+		seconds,
+		seconds > 0 ? report->frames / seconds : 0.0,
+		report->frames ? cpu_ms / report->frames : 0.0,
+		report->dropped,
+		report->resizes,
+		report->reallocs,
+		seconds > 0 ? report->reallocs / seconds : 0.0,
+		report->startup_ms
+	);
+	fflush(f);
+}
@@ -0,0 +1,31 @@
+//
+// Machine-readable benchmark results: one JSON object per run, on a line of its own.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#ifndef BENCH_REPORT_H
+#define BENCH_REPORT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct bench_report
+{
+	const char*	program;
+	const char*	mode;		// What was measured, e.g. "timer" or "dmabuf".
+	uint64_t	start_ns;	// CLOCK_MONOTONIC, when the first frame was about to be made.
+	int		frames;		// Frames shown.
+	int		dropped;	// Frames lost on the way.
+	int		resizes;	// Window sizes applied (after coalescing configures).
+	int		reallocs;	// Times the EGL window had to reallocate its buffers.
+	double		startup_ms;	// From the start of the process to the first committed frame.
+};
+
+extern void bench_report_start(struct bench_report* report, const char* program, const char* mode);
+
+// Writes: {"program":..,"mode":..,"frames":..,"seconds":..,"fps":..,"cpu_ms_per_frame":..,"dropped":..,
+//          "resizes":..,"reallocs":..,"reallocs_per_s":..,"startup_ms":..}
+extern void bench_report_print(const struct bench_report* report, FILE* f);
+
+#endif
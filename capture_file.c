@@ -0,0 +1,167 @@
+//
+// A synthetic capture source: plays raw frames from a file at a fixed rate, looping at the end.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#define _GNU_SOURCE	// For memfd_create()
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include <linux/udmabuf.h>
+
+#include "capture_file.h"
+
+
+int capture_file_open(struct capture_file* cf, const char* path, size_t frame_size, int fps)
+{
+	memset(cf, 0, sizeof(*cf));
+	cf->timer_fd = -1;
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < frame_size)
+	{
+		fprintf(stderr, "%s does not hold a single frame of %zu bytes.\n", path, frame_size);
+		close(fd);
+		return -1;
+	}
+	cf->size = st.st_size;
+	cf->data = mmap(0, cf->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cf->data == MAP_FAILED)
+	{
+		fprintf(stderr, "Cannot map %s: %s\n", path, strerror(errno));
+		cf->data = 0;
+		return -1;
+	}
+	cf->frame_size = frame_size;
+	cf->num_frames = cf->size / frame_size;
+	fprintf(stderr, "Playing %d frames from %s at %d fps.\n", cf->num_frames, path, fps);
+
+	cf->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (cf->timer_fd < 0)
+		return -1;
+	// Periods of a second or more do not fit in tv_nsec.
+	const long long period = 1000000000LL / (fps > 0 ? fps : 30);
+	const struct timespec interval = { .tv_sec = period / 1000000000LL, .tv_nsec = period % 1000000000LL };
+	const struct itimerspec spec = { .it_interval = interval, .it_value = interval };
+	if (timerfd_settime(cf->timer_fd, 0, &spec, NULL) < 0)
+	{
+		fprintf(stderr, "timerfd_settime() failed: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+
+int capture_file_alloc(struct capture_file* cf, int count, int* dma_fds)
+{
+	if (count > CAPTURE_FILE_MAX_BUFFERS)
+		count = CAPTURE_FILE_MAX_BUFFERS;
+	const int udmabuf = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if (udmabuf < 0)
+	{
+		fprintf(stderr, "Cannot open /dev/udmabuf: %s\n", strerror(errno));
+		return -1;
+	}
+	const size_t page = sysconf(_SC_PAGESIZE);
+	cf->buffer_size = (cf->frame_size + page - 1) / page * page;
+	for (int b=0; b<count; ++b)
+	{
+		// udmabuf wants a memfd that can no longer shrink.
+		const int memfd = memfd_create("capture_file", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		if (memfd < 0 || ftruncate(memfd, cf->buffer_size) < 0 || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0)
+		{
+			fprintf(stderr, "Cannot make a memfd for buffer %d: %s\n", b, strerror(errno));
+			if (memfd >= 0)
+				close(memfd);
+			close(udmabuf);
+			return -1;
+		}
+		struct udmabuf_create create;
+		memset(&create, 0, sizeof(create));
+		create.memfd = memfd;
+		create.flags = UDMABUF_FLAGS_CLOEXEC;
+		create.offset = 0;
+		create.size = cf->buffer_size;
+		dma_fds[b] = ioctl(udmabuf, UDMABUF_CREATE, &create);
+		cf->maps[b] = mmap(0, cf->buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+		close(memfd);
+		if (dma_fds[b] < 0 || cf->maps[b] == MAP_FAILED)
+		{
+			fprintf(stderr, "Cannot make a dmabuf for buffer %d: %s\n", b, strerror(errno));
+			cf->maps[b] = 0;
+			close(udmabuf);
+			return -1;
+		}
+		cf->queued[b] = 1;
+		cf->num_buffers = b+1;
+	}
+	close(udmabuf);
+	return cf->num_buffers;
+}
+
+
+void capture_file_free(struct capture_file* cf)
+{
+	for (int b=0; b<cf->num_buffers; ++b)
+		if (cf->maps[b])
+			munmap(cf->maps[b], cf->buffer_size);
+	memset(cf->maps, 0, sizeof(cf->maps));
+	cf->num_buffers = 0;
+}
+
+
+int capture_file_dequeue(struct capture_file* cf, uint32_t* sequence)
+{
+	uint64_t due;
+	if (read(cf->timer_fd, &due, sizeof(due)) != sizeof(due))
+		return -1;
+
+	// When we fall behind, skip frames to stay in real time, just like a camera would.
+	cf->sequence += due;
+	cf->next_frame = (cf->next_frame + due - 1) % cf->num_frames;
+	int index = -1;
+	for (int b=0; b<cf->num_buffers && index<0; ++b)
+		if (cf->queued[b])
+			index = b;
+	if (index >= 0)
+	{
+		memcpy(cf->maps[index], cf->data + (size_t)cf->next_frame * cf->frame_size, cf->frame_size);
+		cf->queued[index] = 0;
+		*sequence = cf->sequence - 1;
+	}
+	cf->next_frame = (cf->next_frame + 1) % cf->num_frames;
+	return index;
+}
+
+
+void capture_file_queue(struct capture_file* cf, int index)
+{
+	cf->queued[index] = 1;
+}
+
+
+void capture_file_close(struct capture_file* cf)
+{
+	capture_file_free(cf);
+	if (cf->data)
+		munmap((void*)cf->data, cf->size);
+	cf->data = 0;
+	if (cf->timer_fd >= 0)
+		close(cf->timer_fd);
+	cf->timer_fd = -1;
+}
@@ -0,0 +1,48 @@
+//
+// A synthetic capture source: plays raw frames from a file at a fixed rate, looping at the end.
+// Frames are copied into memfd-backed buffers, that are handed out as dmabufs via /dev/udmabuf.
+// Like a V4L2 device, buffers are either queued (free to be filled) or dequeued (holding a frame).
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#ifndef CAPTURE_FILE_H
+#define CAPTURE_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_FILE_MAX_BUFFERS	32
+
+struct capture_file
+{
+	int		timer_fd;	// Readable when the next frame is due.
+	const uint8_t*	data;		// The mapped file.
+	size_t		size;
+	size_t		frame_size;
+	int		num_frames;
+	int		next_frame;	// Frame nr in the file that is played next.
+	uint32_t	sequence;	// Frame nr of the stream, counting the frames we had no buffer for.
+	int		num_buffers;
+	size_t		buffer_size;	// Frame size, rounded up to whole pages.
+	uint8_t*	maps[CAPTURE_FILE_MAX_BUFFERS];
+	int		queued[CAPTURE_FILE_MAX_BUFFERS];
+};
+
+// Map the file, and start the frame timer. Returns -1 on failure.
+extern int capture_file_open(struct capture_file* cf, const char* path, size_t frame_size, int fps);
+
+// Make count buffers, all queued. Their dmabuf fds go into dma_fds, and belong to the caller.
+extern int capture_file_alloc(struct capture_file* cf, int count, int* dma_fds);
+
+// Unmap the buffers. The dmabufs live on for as long as someone holds their fd.
+extern void capture_file_free(struct capture_file* cf);
+
+// Take a buffer with the frame that is due, or -1 if no frame is due, or no buffer is queued.
+extern int capture_file_dequeue(struct capture_file* cf, uint32_t* sequence);
+
+extern void capture_file_queue(struct capture_file* cf, int index);
+
+extern void capture_file_close(struct capture_file* cf);
+
+#endif
@@ -0,0 +1,90 @@
+//
+// Damage tracking: which rectangles of a surface changed, this frame and in the frames before.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#include <string.h>
+
+#include "damage.h"
+
+
+void damage_region_clear(struct damage_region* region)
+{
+	region->num_rects = 0;
+}
+
+
+static struct damage_rect bounding_box(struct damage_rect a, struct damage_rect b)
+{
+	const int32_t x0 = a.x < b.x ? a.x : b.x;
+	const int32_t y0 = a.y < b.y ? a.y : b.y;
+	const int32_t x1 = a.x+a.w > b.x+b.w ? a.x+a.w : b.x+b.w;
+	const int32_t y1 = a.y+a.h > b.y+b.h ? a.y+a.h : b.y+b.h;
+	const struct damage_rect box = { x0, y0, x1-x0, y1-y0 };
+	return box;
+}
+
+
+void damage_region_add(struct damage_region* region, struct damage_rect rect, int32_t width, int32_t height)
+{
+	// Clip to the surface.
+	if (rect.x < 0) { rect.w += rect.x; rect.x = 0; }
+	if (rect.y < 0) { rect.h += rect.y; rect.y = 0; }
+	if (rect.x + rect.w > width)  rect.w = width  - rect.x;
+	if (rect.y + rect.h > height) rect.h = height - rect.y;
+	if (rect.w <= 0 || rect.h <= 0)
+		return;
+
+	// Overlapping rectangles are fine: those pixels just get painted twice.
+	for (int i=0; i<region->num_rects; ++i)
+	{
+		const struct damage_rect* r = region->rects + i;
+		if (rect.x >= r->x && rect.y >= r->y && rect.x+rect.w <= r->x+r->w && rect.y+rect.h <= r->y+r->h)
+			return;	// Already covered.
+	}
+	if (region->num_rects == DAMAGE_MAX_RECTS)
+	{
+		struct damage_rect box = rect;
+		for (int i=0; i<region->num_rects; ++i)
+			box = bounding_box(box, region->rects[i]);
+		region->rects[0] = box;
+		region->num_rects = 1;
+		return;
+	}
+	region->rects[region->num_rects++] = rect;
+}
+
+
+void damage_region_add_region(struct damage_region* region, const struct damage_region* other, int32_t width, int32_t height)
+{
+	for (int i=0; i<other->num_rects; ++i)
+		damage_region_add(region, other->rects[i], width, height);
+}
+
+
+void damage_tracker_reset(struct damage_tracker* tracker)
+{
+	memset(tracker, 0, sizeof(*tracker));
+}
+
+
+int damage_tracker_repaint(const struct damage_tracker* tracker, int age, const struct damage_region* current, struct damage_region* repaint, int32_t width, int32_t height)
+{
+	// Age 0 means undefined contents. Age 1 means it holds the last frame, age 2 the one before, and so on.
+	// We only know about frames pushed since the last reset: a buffer older than that predates it, whatever its age.
+	if (age <= 0 || age > DAMAGE_HISTORY || age > tracker->frame)
+		return 0;
+	damage_region_clear(repaint);
+	damage_region_add_region(repaint, current, width, height);
+	for (int k=1; k<age; ++k)
+		damage_region_add_region(repaint, tracker->history + (tracker->frame - k) % DAMAGE_HISTORY, width, height);
+	return 1;
+}
+
+
+void damage_tracker_push(struct damage_tracker* tracker, const struct damage_region* current)
+{
+	tracker->history[tracker->frame % DAMAGE_HISTORY] = *current;
+	tracker->frame++;
+}
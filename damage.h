@@ -0,0 +1,51 @@
+//
+// Damage tracking: which rectangles of a surface changed, this frame and in the frames before.
+// With the age of the back buffer (EGL_EXT_buffer_age), this tells what must be repainted to bring it up to date.
+// Rectangles use GL window coordinates: origin at the bottom-left, as glScissor() and eglSwapBuffersWithDamage() want.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#ifndef DAMAGE_H
+#define DAMAGE_H
+
+#include <stdint.h>
+
+#define DAMAGE_MAX_RECTS	16	// Beyond this, a region collapses into its bounding box.
+#define DAMAGE_HISTORY		4	// Older buffers than this get repainted fully.
+
+struct damage_rect
+{
+	int32_t	x, y, w, h;
+};
+
+struct damage_region
+{
+	int			num_rects;
+	struct damage_rect	rects[DAMAGE_MAX_RECTS];
+};
+
+struct damage_tracker
+{
+	int			frame;				// Nr of frames pushed.
+	struct damage_region	history[DAMAGE_HISTORY];	// Damage of the last frames, by frame nr.
+};
+
+extern void damage_region_clear(struct damage_region* region);
+
+// Add a rectangle, clipped to [0,0,width,height). Empty rectangles are ignored.
+extern void damage_region_add(struct damage_region* region, struct damage_rect rect, int32_t width, int32_t height);
+
+extern void damage_region_add_region(struct damage_region* region, const struct damage_region* other, int32_t width, int32_t height);
+
+// Forget all history: the next frame is a full repaint.
+extern void damage_tracker_reset(struct damage_tracker* tracker);
+
+// What to repaint in a back buffer of the given age, to show this frame's damage.
+// Returns 0 if that is unknown, and the whole buffer must be repainted.
+extern int damage_tracker_repaint(const struct damage_tracker* tracker, int age, const struct damage_region* current, struct damage_region* repaint, int32_t width, int32_t height);
+
+// Remember the damage of the frame just drawn.
+extern void damage_tracker_push(struct damage_tracker* tracker, const struct damage_region* current);
+
+#endif
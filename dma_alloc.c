@@ -0,0 +1,94 @@
+//
+// Allocating dmabufs ourselves, from a DMA heap or udmabuf.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#define _GNU_SOURCE	// For memfd_create()
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/dma-heap.h>
+#include <linux/udmabuf.h>
+
+#include "dma_alloc.h"
+
+#define HEAP_PATH	"/dev/dma_heap/system"
+
+
+int dma_alloc_open(struct dma_alloc* alloc)
+{
+	alloc->udmabuf_fd = -1;
+	alloc->heap_fd = open(HEAP_PATH, O_RDONLY | O_CLOEXEC);
+	if (alloc->heap_fd >= 0)
+	{
+		alloc->name = "the system DMA heap";
+		return 0;
+	}
+	alloc->udmabuf_fd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if (alloc->udmabuf_fd >= 0)
+	{
+		alloc->name = "udmabuf";
+		return 0;
+	}
+	fprintf(stderr, "Cannot open %s or /dev/udmabuf: %s\n", HEAP_PATH, strerror(errno));
+	return -1;
+}
+
+
+int dma_alloc_buffer(struct dma_alloc* alloc, size_t size)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+	size = (size + page - 1) / page * page;
+
+	if (alloc->heap_fd >= 0)
+	{
+		struct dma_heap_allocation_data data;
+		memset(&data, 0, sizeof(data));
+		data.len = size;
+		data.fd_flags = O_RDWR | O_CLOEXEC;
+		if (ioctl(alloc->heap_fd, DMA_HEAP_IOCTL_ALLOC, &data) < 0)
+		{
+			fprintf(stderr, "Cannot allocate %zu bytes from %s: %s\n", size, HEAP_PATH, strerror(errno));
+			return -1;
+		}
+		return data.fd;
+	}
+
+	// udmabuf wants a memfd that can no longer shrink.
+	const int memfd = memfd_create("dma_alloc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0 || ftruncate(memfd, size) < 0 || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0)
+	{
+		fprintf(stderr, "Cannot make a memfd of %zu bytes: %s\n", size, strerror(errno));
+		if (memfd >= 0)
+			close(memfd);
+		return -1;
+	}
+	struct udmabuf_create create;
+	memset(&create, 0, sizeof(create));
+	create.memfd = memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.size = size;
+	const int fd = ioctl(alloc->udmabuf_fd, UDMABUF_CREATE, &create);
+	if (fd < 0)
+		fprintf(stderr, "Cannot make a udmabuf of %zu bytes: %s\n", size, strerror(errno));
+	close(memfd);
+	return fd;
+}
+
+
+void dma_alloc_close(struct dma_alloc* alloc)
+{
+	if (alloc->heap_fd >= 0)
+		close(alloc->heap_fd);
+	if (alloc->udmabuf_fd >= 0)
+		close(alloc->udmabuf_fd);
+	alloc->heap_fd = -1;
+	alloc->udmabuf_fd = -1;
+}
@@ -0,0 +1,29 @@
+//
+// Allocating dmabufs ourselves, for capture devices to fill (V4L2_MEMORY_DMABUF), instead of exporting the driver's.
+// They come from the system DMA heap if there is one, else from memfds via udmabuf.
+// One allocator can serve several devices.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#ifndef DMA_ALLOC_H
+#define DMA_ALLOC_H
+
+#include <stddef.h>
+
+struct dma_alloc
+{
+	int		heap_fd;
+	int		udmabuf_fd;
+	const char*	name;		// Where the buffers come from.
+};
+
+// Returns -1 if there is neither a DMA heap nor udmabuf.
+extern int dma_alloc_open(struct dma_alloc* alloc);
+
+// A new dmabuf of at least size bytes (rounded up to whole pages), or -1 on failure.
+extern int dma_alloc_buffer(struct dma_alloc* alloc, size_t size);
+
+extern void dma_alloc_close(struct dma_alloc* alloc);
+
+#endif
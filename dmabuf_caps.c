@@ -0,0 +1,141 @@
+//
+// A table of the (format, modifier) pairs that a compositor accepts for dmabuf buffers.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "dmabuf_caps.h"
+
+
+static uint32_t slot_for(uint32_t format)
+{
+	// Fibonacci hashing: fourccs are ASCII, so the low bits alone hash poorly.
+	return (format * 2654435761u) >> 24 & (DMABUF_CAPS_SLOTS-1);
+}
+
+
+static struct dmabuf_caps_entry* find_slot(const struct dmabuf_caps* caps, uint32_t format)
+{
+	uint32_t s = slot_for(format);
+	for (int probe=0; probe<DMABUF_CAPS_SLOTS; ++probe)
+	{
+		const struct dmabuf_caps_entry* entry = caps->slots + s;
+		if (entry->format == format || entry->format == 0)
+			return (struct dmabuf_caps_entry*) entry;
+		s = (s+1) & (DMABUF_CAPS_SLOTS-1);
+	}
+	return 0;
+}
+
+
+void dmabuf_caps_add(struct dmabuf_caps* caps, uint32_t format, uint64_t modifier, uint32_t flags)
+{
+	assert(format);
+	struct dmabuf_caps_entry* entry = find_slot(caps, format);
+	if (!entry)
+		return; // Table is full.
+	if (entry->format == 0)
+	{
+		entry->format = format;
+		caps->num_formats++;
+	}
+
+	// Insert, keeping the modifiers sorted.
+	int i = 0;
+	while (i < entry->num_modifiers && entry->modifiers[i].modifier < modifier)
+		++i;
+	if (i < entry->num_modifiers && entry->modifiers[i].modifier == modifier)
+	{
+		entry->modifiers[i].flags |= flags;
+		return;
+	}
+	if (entry->num_modifiers == entry->max_modifiers)
+	{
+		entry->max_modifiers = entry->max_modifiers ? 2 * entry->max_modifiers : 4;
+		entry->modifiers = realloc(entry->modifiers, entry->max_modifiers * sizeof(struct dmabuf_caps_modifier));
+		assert(entry->modifiers);
+	}
+	memmove(entry->modifiers + i + 1, entry->modifiers + i, (entry->num_modifiers - i) * sizeof(struct dmabuf_caps_modifier));
+	entry->modifiers[i].modifier = modifier;
+	entry->modifiers[i].flags = flags;
+	entry->num_modifiers++;
+}
+
+
+const struct dmabuf_caps_entry* dmabuf_caps_find(const struct dmabuf_caps* caps, uint32_t format)
+{
+	const struct dmabuf_caps_entry* entry = find_slot(caps, format);
+	return (entry && entry->format) ? entry : 0;
+}
+
+
+static int compare_modifiers(const void* a, const void* b)
+{
+	const uint64_t ma = ((const struct dmabuf_caps_modifier*)a)->modifier;
+	const uint64_t mb = ((const struct dmabuf_caps_modifier*)b)->modifier;
+	return ma < mb ? -1 : ma > mb ? 1 : 0;
+}
+
+
+static const struct dmabuf_caps_modifier* find_modifier(const struct dmabuf_caps* caps, uint32_t format, uint64_t modifier)
+{
+	const struct dmabuf_caps_entry* entry = dmabuf_caps_find(caps, format);
+	if (!entry)
+		return 0;
+	// LINEAR sorts first, so the common question needs no search.
+	if (modifier == DRM_FORMAT_MOD_LINEAR)
+		return entry->modifiers[0].modifier == DRM_FORMAT_MOD_LINEAR ? entry->modifiers : 0;
+	const struct dmabuf_caps_modifier key = { modifier, 0 };
+	return bsearch(&key, entry->modifiers, entry->num_modifiers, sizeof(struct dmabuf_caps_modifier), compare_modifiers);
+}
+
+
+int dmabuf_caps_has(const struct dmabuf_caps* caps, uint32_t format, uint64_t modifier)
+{
+	return find_modifier(caps, format, modifier) != 0;
+}
+
+
+int dmabuf_caps_flags(const struct dmabuf_caps* caps, uint32_t format, uint64_t modifier)
+{
+	const struct dmabuf_caps_modifier* mod = find_modifier(caps, format, modifier);
+	return mod ? (int)mod->flags : -1;
+}
+
+
+void dmabuf_caps_clear(struct dmabuf_caps* caps)
+{
+	for (int s=0; s<DMABUF_CAPS_SLOTS; ++s)
+		free(caps->slots[s].modifiers);
+	memset(caps, 0, sizeof(*caps));
+}
+
+
+void dmabuf_caps_print(const struct dmabuf_caps* caps, FILE* f)
+{
+	for (int s=0; s<DMABUF_CAPS_SLOTS; ++s)
+	{
+		const struct dmabuf_caps_entry* entry = caps->slots + s;
+		if (!entry->format)
+			continue;
+		const uint32_t format = entry->format;
+		fprintf(f, "dmabuf listener found format %c%c%c%c with modifiers:", (format>>0)&0xff, (format>>8)&0xff, (format>>16)&0xff, (format>>24)&0xff);
+		for (int i=0; i<entry->num_modifiers; ++i)
+		{
+			const uint64_t modifier = entry->modifiers[i].modifier;
+			if (modifier == DRM_FORMAT_MOD_LINEAR)
+				fprintf(f, " LINEAR");
+			else if (modifier == DRM_FORMAT_MOD_INVALID)
+				fprintf(f, " IMPLICIT");
+			else
+				fprintf(f, " 0x%016" PRIx64, modifier);
+			if (entry->modifiers[i].flags & DMABUF_CAPS_SCANOUT)
+				fprintf(f, "(scanout)");
+		}
+		fprintf(f, "\n");
+	}
+}
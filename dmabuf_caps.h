@@ -0,0 +1,59 @@
+//
+// A table of the (format, modifier) pairs that a compositor accepts for dmabuf buffers.
+// It is filled from linux-dmabuf events, and answers "is NV12 + LINEAR supported?" in O(1).
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#ifndef DMABUF_CAPS_H
+#define DMABUF_CAPS_H
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#define DRM_FORMAT_MOD_LINEAR	0ULL
+#define DRM_FORMAT_MOD_INVALID	0x00ffffffffffffffULL
+
+#define DMABUF_CAPS_SLOTS	256	// Hash table size: must be a power of two, well above the nr of formats.
+
+#define DMABUF_CAPS_SCANOUT	(1<<0)	// From a linux-dmabuf feedback tranche with the scanout flag.
+
+struct dmabuf_caps_modifier
+{
+	uint64_t	modifier;
+	uint32_t	flags;		// DMABUF_CAPS_* bits.
+};
+
+struct dmabuf_caps_entry
+{
+	uint32_t			format;		// DRM fourcc, 0 for an empty slot.
+	int				num_modifiers;
+	int				max_modifiers;
+	struct dmabuf_caps_modifier*	modifiers;	// Sorted, without duplicates: LINEAR (0) comes first if present.
+};
+
+struct dmabuf_caps
+{
+	int				num_formats;
+	struct dmabuf_caps_entry	slots[DMABUF_CAPS_SLOTS];
+};
+
+// Record that the compositor takes this format with this modifier. Flags of repeated additions are or-ed.
+extern void dmabuf_caps_add(struct dmabuf_caps* caps, uint32_t format, uint64_t modifier, uint32_t flags);
+
+// Look up a format, returns 0 if the compositor does not take it at all.
+extern const struct dmabuf_caps_entry* dmabuf_caps_find(const struct dmabuf_caps* caps, uint32_t format);
+
+// Does the compositor take this format with this modifier?
+extern int dmabuf_caps_has(const struct dmabuf_caps* caps, uint32_t format, uint64_t modifier);
+
+// The DMABUF_CAPS_* flags for this format and modifier, or -1 if the compositor does not take it.
+extern int dmabuf_caps_flags(const struct dmabuf_caps* caps, uint32_t format, uint64_t modifier);
+
+// Forget everything, e.g. before new dmabuf feedback comes in.
+extern void dmabuf_caps_clear(struct dmabuf_caps* caps);
+
+// List the table, one format per line.
+extern void dmabuf_caps_print(const struct dmabuf_caps* caps, FILE* f);
+
+#endif
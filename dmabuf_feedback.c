@@ -0,0 +1,168 @@
+//
+// Receives linux-dmabuf (version 4) feedback, and turns it into a dmabuf_caps table.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+
+#include "dmabuf_feedback.h"
+
+
+struct format_table_entry
+{
+	uint32_t	format;
+	uint32_t	padding;
+	uint64_t	modifier;
+};
+
+
+static dev_t device_from_array(const struct wl_array* array)
+{
+	dev_t dev = 0;
+	if (array->size == sizeof(dev_t))
+		memcpy(&dev, array->data, sizeof(dev_t));
+	return dev;
+}
+
+
+static void feedback_done(void* data, struct zwp_linux_dmabuf_feedback_v1* proxy)
+{
+	(void)proxy;
+	struct dmabuf_feedback* fb = data;
+
+	// Publish the new table.
+	dmabuf_caps_clear(&fb->caps);
+	fb->caps = fb->pending;
+	memset(&fb->pending, 0, sizeof(fb->pending));
+	fb->num_tranches = fb->pending_tranches;
+	fb->pending_tranches = 0;
+	fb->scanout_device = fb->pending_scanout_device;
+	fb->pending_scanout_device = 0;
+
+	fprintf
+	(
+		stderr,
+		"dmabuf feedback: %d formats in %d tranches, main device %u:%u\n",
+		fb->caps.num_formats, fb->num_tranches, major(fb->main_device), minor(fb->main_device)
+	);
+	if (fb->changed)
+		fb->changed(fb->data, fb);
+}
+
+
+static void feedback_format_table(void* data, struct zwp_linux_dmabuf_feedback_v1* proxy, int32_t fd, uint32_t size)
+{
+	(void)proxy;
+	struct dmabuf_feedback* fb = data;
+	if (fb->table)
+		munmap((void*)fb->table, fb->table_size);
+	fb->table = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	fb->table_size = size;
+	if (fb->table == MAP_FAILED)
+	{
+		fprintf(stderr, "dmabuf feedback: cannot map the format table.\n");
+		fb->table = 0;
+		fb->table_size = 0;
+	}
+	close(fd);
+}
+
+
+static void feedback_main_device(void* data, struct zwp_linux_dmabuf_feedback_v1* proxy, struct wl_array* device)
+{
+	(void)proxy;
+	struct dmabuf_feedback* fb = data;
+	fb->main_device = device_from_array(device);
+}
+
+
+static void feedback_tranche_done(void* data, struct zwp_linux_dmabuf_feedback_v1* proxy)
+{
+	(void)proxy;
+	struct dmabuf_feedback* fb = data;
+
+	// The flags arrive after the formats, so the formats of a tranche are only added once it is complete.
+	const uint32_t flags = (fb->tranche_flags & ZWP_LINUX_DMABUF_FEEDBACK_V1_TRANCHE_FLAGS_SCANOUT) ? DMABUF_CAPS_SCANOUT : 0;
+	const size_t num_entries = fb->table_size / sizeof(struct format_table_entry);
+	const struct format_table_entry* entries = fb->table;
+	const uint16_t* index;
+	wl_array_for_each(index, &fb->tranche_indices)
+	{
+		if (entries && *index < num_entries)
+			dmabuf_caps_add(&fb->pending, entries[*index].format, entries[*index].modifier, flags);
+	}
+	if (flags & DMABUF_CAPS_SCANOUT)
+		fb->pending_scanout_device = fb->tranche_device;
+	fb->pending_tranches++;
+
+	fb->tranche_indices.size = 0;
+	fb->tranche_flags = 0;
+	fb->tranche_device = 0;
+}
+
+
+static void feedback_tranche_target_device(void* data, struct zwp_linux_dmabuf_feedback_v1* proxy, struct wl_array* device)
+{
+	(void)proxy;
+	struct dmabuf_feedback* fb = data;
+	fb->tranche_device = device_from_array(device);
+}
+
+
+static void feedback_tranche_formats(void* data, struct zwp_linux_dmabuf_feedback_v1* proxy, struct wl_array* indices)
+{
+	(void)proxy;
+	struct dmabuf_feedback* fb = data;
+	void* dst = wl_array_add(&fb->tranche_indices, indices->size);
+	if (dst)
+		memcpy(dst, indices->data, indices->size);
+}
+
+
+static void feedback_tranche_flags(void* data, struct zwp_linux_dmabuf_feedback_v1* proxy, uint32_t flags)
+{
+	(void)proxy;
+	struct dmabuf_feedback* fb = data;
+	fb->tranche_flags = flags;
+}
+
+
+static const struct zwp_linux_dmabuf_feedback_v1_listener feedback_listener =
+{
+	.done = feedback_done,
+	.format_table = feedback_format_table,
+	.main_device = feedback_main_device,
+	.tranche_done = feedback_tranche_done,
+	.tranche_target_device = feedback_tranche_target_device,
+	.tranche_formats = feedback_tranche_formats,
+	.tranche_flags = feedback_tranche_flags,
+};
+
+
+void dmabuf_feedback_init(struct dmabuf_feedback* fb, struct zwp_linux_dmabuf_feedback_v1* proxy, dmabuf_feedback_changed_fn changed, void* data)
+{
+	memset(fb, 0, sizeof(*fb));
+	fb->proxy = proxy;
+	fb->changed = changed;
+	fb->data = data;
+	wl_array_init(&fb->tranche_indices);
+	zwp_linux_dmabuf_feedback_v1_add_listener(proxy, &feedback_listener, fb);
+}
+
+
+void dmabuf_feedback_fini(struct dmabuf_feedback* fb)
+{
+	if (fb->proxy)
+		zwp_linux_dmabuf_feedback_v1_destroy(fb->proxy);
+	if (fb->table)
+		munmap((void*)fb->table, fb->table_size);
+	wl_array_release(&fb->tranche_indices);
+	dmabuf_caps_clear(&fb->caps);
+	dmabuf_caps_clear(&fb->pending);
+	memset(fb, 0, sizeof(*fb));
+}
@@ -0,0 +1,49 @@
+//
+// Receives linux-dmabuf (version 4) feedback, and turns it into a dmabuf_caps table.
+// Feedback comes in tranches of formats, each with a target device and flags, in order of preference.
+// The compositor sends new feedback when its preferences change, for instance when a window goes fullscreen.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#ifndef DMABUF_FEEDBACK_H
+#define DMABUF_FEEDBACK_H
+
+#include <sys/types.h>
+
+#include "linux-dma-protocol.h"
+
+#include "dmabuf_caps.h"
+
+struct dmabuf_feedback;
+
+typedef void (*dmabuf_feedback_changed_fn)(void* data, struct dmabuf_feedback* feedback);
+
+struct dmabuf_feedback
+{
+	struct zwp_linux_dmabuf_feedback_v1*	proxy;
+	struct dmabuf_caps			caps;		// Complete as of the last 'done' event.
+	dev_t					main_device;	// The device the compositor renders with.
+	dev_t					scanout_device;	// The target device of the last scanout tranche, or 0.
+	int					num_tranches;
+	dmabuf_feedback_changed_fn		changed;
+	void*					data;
+
+	// State while the compositor is still sending.
+	const void*		table;		// mmap-ed format table: { u32 format, u32 pad, u64 modifier } entries.
+	uint32_t		table_size;
+	struct dmabuf_caps	pending;
+	dev_t			tranche_device;
+	uint32_t		tranche_flags;
+	struct wl_array		tranche_indices;
+	int			pending_tranches;
+	dev_t			pending_scanout_device;
+};
+
+// Start listening to a feedback object (from get_default_feedback or get_surface_feedback).
+// 'changed' is called after every complete batch of feedback.
+extern void dmabuf_feedback_init(struct dmabuf_feedback* fb, struct zwp_linux_dmabuf_feedback_v1* proxy, dmabuf_feedback_changed_fn changed, void* data);
+
+extern void dmabuf_feedback_fini(struct dmabuf_feedback* fb);
+
+#endif
@@ -0,0 +1,202 @@
+//
+// Explicit synchronization of the dmabufs we hand to the compositor.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <linux/dma-buf.h>
+
+#include <xf86drm.h>
+
+#include "explicit_sync.h"
+
+
+// The fences of a dmabuf as a sync_file: with DMA_BUF_SYNC_READ the writers, with DMA_BUF_SYNC_WRITE all users.
+static int export_sync_file(int dma_fd, uint32_t flags)
+{
+	struct dma_buf_export_sync_file args;
+	memset(&args, 0, sizeof(args));
+	args.flags = flags;
+	args.fd = -1;
+	if (ioctl(dma_fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &args) < 0)
+		return -1;
+	return args.fd;
+}
+
+
+static int open_render_node(dev_t device)
+{
+	drmDevicePtr dev = 0;
+	int fd = -1;
+	if (device && drmGetDeviceFromDevId(device, 0, &dev) == 0)
+	{
+		if (dev->available_nodes & (1 << DRM_NODE_RENDER))
+			fd = open(dev->nodes[DRM_NODE_RENDER], O_RDWR | O_CLOEXEC);
+		drmFreeDevice(&dev);
+	}
+	if (fd < 0)
+		fd = open("/dev/dri/renderD128", O_RDWR | O_CLOEXEC);
+	return fd;
+}
+
+
+static struct wp_linux_drm_syncobj_timeline_v1* import_timeline(struct explicit_sync* es, uint32_t handle)
+{
+	int fd = -1;
+	if (drmSyncobjHandleToFD(es->drm_fd, handle, &fd) < 0)
+		return 0;
+	struct wp_linux_drm_syncobj_timeline_v1* timeline = wp_linux_drm_syncobj_manager_v1_import_timeline(es->manager, fd);
+	close(fd);
+	return timeline;
+}
+
+
+int explicit_sync_init(struct explicit_sync* es, struct wp_linux_drm_syncobj_manager_v1* manager, dev_t device)
+{
+	memset(es, 0, sizeof(*es));
+	es->drm_fd = -1;
+	if (!manager)
+		return 0;
+	es->drm_fd = open_render_node(device);
+	if (es->drm_fd < 0)
+	{
+		fprintf(stderr, "No DRM render node for syncobjs: %s\n", strerror(errno));
+		return 0;
+	}
+	if (drmSyncobjCreate(es->drm_fd, 0, &es->acquire_handle) < 0 || drmSyncobjCreate(es->drm_fd, 0, &es->release_handle) < 0)
+	{
+		fprintf(stderr, "Cannot create DRM syncobjs: %s\n", strerror(errno));
+		explicit_sync_fini(es);
+		return 0;
+	}
+	es->manager = manager;
+	es->acquire_timeline = import_timeline(es, es->acquire_handle);
+	es->release_timeline = import_timeline(es, es->release_handle);
+	if (!es->acquire_timeline || !es->release_timeline)
+	{
+		explicit_sync_fini(es);
+		return 0;
+	}
+	return 1;
+}
+
+
+void explicit_sync_attach(struct explicit_sync* es, struct wl_surface* surface)
+{
+	if (es->acquire_timeline && !es->surface)
+		es->surface = wp_linux_drm_syncobj_manager_v1_get_surface(es->manager, surface);
+}
+
+
+void explicit_sync_detach(struct explicit_sync* es)
+{
+	if (es->surface)
+		wp_linux_drm_syncobj_surface_v1_destroy(es->surface);
+	es->surface = 0;
+}
+
+
+uint64_t explicit_sync_commit(struct explicit_sync* es, int dma_fd)
+{
+	if (!es->surface)
+		return 0;
+	const uint64_t point = ++es->point;
+
+	// Acquire: whatever the capture hardware still has to write. Usually nothing, and then we signal right away.
+	int signaled = 0;
+	const int sync_file = export_sync_file(dma_fd, DMA_BUF_SYNC_READ);
+	if (sync_file >= 0)
+	{
+		uint32_t tmp;
+		if (drmSyncobjCreate(es->drm_fd, 0, &tmp) == 0)
+		{
+			signaled =
+				drmSyncobjImportSyncFile(es->drm_fd, tmp, sync_file) == 0 &&
+				drmSyncobjTransfer(es->drm_fd, es->acquire_handle, point, tmp, 0, 0) == 0;
+			drmSyncobjDestroy(es->drm_fd, tmp);
+		}
+		close(sync_file);
+	}
+	if (!signaled)
+		drmSyncobjTimelineSignal(es->drm_fd, &es->acquire_handle, (uint64_t*)&point, 1);
+
+	wp_linux_drm_syncobj_surface_v1_set_acquire_point(es->surface, es->acquire_timeline, point >> 32, point & 0xffffffff);
+	wp_linux_drm_syncobj_surface_v1_set_release_point(es->surface, es->release_timeline, point >> 32, point & 0xffffffff);
+	return point;
+}
+
+
+// Has the compositor signalled the release point? Does not wait.
+static int released(struct explicit_sync* es, uint64_t release_point)
+{
+	uint64_t point = release_point;
+	return drmSyncobjTimelineWait(es->drm_fd, &es->release_handle, &point, 1, 0, DRM_SYNCOBJ_WAIT_FLAGS_WAIT_FOR_SUBMIT, 0) == 0;
+}
+
+
+// For kernels without drmSyncobjEventfd(): a timer, to look again shortly.
+static int retry_fd(void)
+{
+	const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (fd < 0)
+		return -1;
+	const struct itimerspec spec = { .it_value = { .tv_sec = 0, .tv_nsec = EXPLICIT_SYNC_RETRY_NS } };
+	timerfd_settime(fd, 0, &spec, NULL);
+	return fd;
+}
+
+
+int explicit_sync_release_fd(struct explicit_sync* es, uint64_t release_point, int dma_fd)
+{
+	if (release_point && es->drm_fd >= 0)
+	{
+		// Have the kernel tell us when the compositor signals the release point.
+		const int efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (efd >= 0 && drmSyncobjEventfd(es->drm_fd, es->release_handle, release_point, efd, 0) == 0)
+			return efd;
+		if (efd >= 0)
+			close(efd);
+		// An older kernel: never wait here, on the event thread, but poll the point again later.
+		return explicit_sync_release_retry(es, release_point);
+	}
+	// Implicit sync: wait for everyone that still reads the buffer.
+	return export_sync_file(dma_fd, DMA_BUF_SYNC_WRITE);
+}
+
+
+int explicit_sync_release_retry(struct explicit_sync* es, uint64_t release_point)
+{
+	if (!release_point || es->drm_fd < 0 || released(es, release_point))
+		return -1;
+	return retry_fd();
+}
+
+
+void explicit_sync_fini(struct explicit_sync* es)
+{
+	explicit_sync_detach(es);
+	if (es->acquire_timeline)
+		wp_linux_drm_syncobj_timeline_v1_destroy(es->acquire_timeline);
+	if (es->release_timeline)
+		wp_linux_drm_syncobj_timeline_v1_destroy(es->release_timeline);
+	es->acquire_timeline = es->release_timeline = 0;
+	if (es->drm_fd >= 0)
+	{
+		if (es->acquire_handle)
+			drmSyncobjDestroy(es->drm_fd, es->acquire_handle);
+		if (es->release_handle)
+			drmSyncobjDestroy(es->drm_fd, es->release_handle);
+		close(es->drm_fd);
+	}
+	es->acquire_handle = es->release_handle = 0;
+	es->drm_fd = -1;
+}
@@ -0,0 +1,52 @@
+//
+// Explicit synchronization of the dmabufs we hand to the compositor.
+// With wp_linux_drm_syncobj_v1, every commit carries an acquire point (the frame is complete)
+// and a release point (the compositor is done reading it), on DRM syncobj timelines.
+// Without it, we fall back to the fences of the dmabuf itself, exported as a sync_file.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#ifndef EXPLICIT_SYNC_H
+#define EXPLICIT_SYNC_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "linux-drm-syncobj-protocol.h"
+
+#define EXPLICIT_SYNC_RETRY_NS	1000000	// Without syncobj eventfds, look at a release point this often.
+
+struct explicit_sync
+{
+	int						drm_fd;		// Render node that owns the syncobjs, or -1.
+	struct wp_linux_drm_syncobj_manager_v1*		manager;
+	struct wp_linux_drm_syncobj_surface_v1*		surface;	// Only while we commit dmabufs ourselves.
+	uint32_t					acquire_handle;
+	uint32_t					release_handle;
+	struct wp_linux_drm_syncobj_timeline_v1*	acquire_timeline;
+	struct wp_linux_drm_syncobj_timeline_v1*	release_timeline;
+	uint64_t					point;		// Last point used on both timelines.
+};
+
+// Set up the timelines on the render node of the given device. Returns 0 if we must do without syncobjs.
+extern int explicit_sync_init(struct explicit_sync* es, struct wp_linux_drm_syncobj_manager_v1* manager, dev_t device);
+
+// Start or stop setting points on the surface. While attached, every commit with a buffer needs explicit_sync_commit().
+extern void explicit_sync_attach(struct explicit_sync* es, struct wl_surface* surface);
+extern void explicit_sync_detach(struct explicit_sync* es);
+
+// Set the acquire and release points for the frame in this dmabuf, right before the commit.
+// Returns the release point, or 0 without syncobjs.
+extern uint64_t explicit_sync_commit(struct explicit_sync* es, int dma_fd);
+
+// After wl_buffer.release: an fd that polls readable once the compositor is really done with the buffer,
+// or -1 if it is done already (or we cannot tell). Never blocks.
+extern int explicit_sync_release_fd(struct explicit_sync* es, uint64_t release_point, int dma_fd);
+
+// Once that fd polls readable: -1 if the buffer is free now, or a new fd to wait on.
+extern int explicit_sync_release_retry(struct explicit_sync* es, uint64_t release_point);
+
+extern void explicit_sync_fini(struct explicit_sync* es);
+
+#endif
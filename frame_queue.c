@@ -0,0 +1,44 @@
+//
+// Lock-free handoff of capture buffer indices between exactly two threads.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#include "frame_queue.h"
+
+
+int frame_mailbox_post(struct frame_mailbox* mailbox, int buf_nr)
+{
+	// Release: the slot contents (timestamp, sequence) written before posting are visible to the taker.
+	return atomic_exchange_explicit(&mailbox->slot, buf_nr+1, memory_order_acq_rel) - 1;
+}
+
+
+int frame_mailbox_take(struct frame_mailbox* mailbox)
+{
+	return atomic_exchange_explicit(&mailbox->slot, 0, memory_order_acq_rel) - 1;
+}
+
+
+int frame_queue_push(struct frame_queue* queue, int buf_nr)
+{
+	const unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	const unsigned int head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	if (tail - head == FRAME_QUEUE_SIZE)
+		return 0;
+	queue->entries[tail & (FRAME_QUEUE_SIZE-1)] = buf_nr;
+	atomic_store_explicit(&queue->tail, tail+1, memory_order_release);
+	return 1;
+}
+
+
+int frame_queue_pop(struct frame_queue* queue)
+{
+	const unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	const unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+	if (head == tail)
+		return -1;
+	const int buf_nr = queue->entries[head & (FRAME_QUEUE_SIZE-1)];
+	atomic_store_explicit(&queue->head, head+1, memory_order_release);
+	return buf_nr;
+}
@@ -0,0 +1,42 @@
+//
+// Lock-free handoff of capture buffer indices between exactly two threads.
+// A mailbox carries the newest captured frame to the presenter (latest-wins),
+// and a queue carries the buffers the presenter is done with back to the capture thread.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include <stdatomic.h>
+
+#define FRAME_QUEUE_SIZE	64	// Must be a power of two, and at least the nr of capture buffers.
+
+// Holds at most one buffer index. Posting over an unread index hands that one back to the poster.
+struct frame_mailbox
+{
+	atomic_int	slot;		// Buffer index + 1, or 0 when empty.
+};
+
+// Single-producer, single-consumer ring of buffer indices.
+struct frame_queue
+{
+	atomic_uint	head;		// Next to pop: only written by the consumer.
+	atomic_uint	tail;		// Next to push: only written by the producer.
+	int		entries[FRAME_QUEUE_SIZE];
+};
+
+// Post a buffer index. Returns the index it displaced, or -1 if the mailbox was empty.
+extern int frame_mailbox_post(struct frame_mailbox* mailbox, int buf_nr);
+
+// Take the buffer index out of the mailbox, or -1 if there is none.
+extern int frame_mailbox_take(struct frame_mailbox* mailbox);
+
+// Producer side: returns 0 if the queue is full.
+extern int frame_queue_push(struct frame_queue* queue, int buf_nr);
+
+// Consumer side: returns -1 if the queue is empty.
+extern int frame_queue_pop(struct frame_queue* queue);
+
+#endif
@@ -0,0 +1,86 @@
+//
+// Per-frame latency records, from V4L2 capture to presentation on screen.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "frame_stats.h"
+
+
+uint64_t frame_stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+void frame_stats_add(struct frame_stats* stats, const struct frame_stats_record* record)
+{
+	const unsigned int index = atomic_fetch_add_explicit(&stats->count, 1, memory_order_relaxed);
+	stats->records[index & (FRAME_STATS_SIZE-1)] = *record;
+}
+
+
+void frame_stats_discard(struct frame_stats* stats)
+{
+	atomic_fetch_add_explicit(&stats->discarded, 1, memory_order_relaxed);
+}
+
+
+static int compare_u64(const void* a, const void* b)
+{
+	const uint64_t x = *(const uint64_t*)a;
+	const uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+
+static void print_stage(FILE* f, const char* name, uint64_t* values, int n)
+{
+	qsort(values, n, sizeof(uint64_t), compare_u64);
+	fprintf
+	(
+		f,
+		"%-18s p50 %8.3f ms   p99 %8.3f ms   max %8.3f ms\n",
+		name,
+		values[n/2] / 1e6,
+		values[(n*99)/100] / 1e6,
+		values[n-1] / 1e6
+	);
+}
+
+
+void frame_stats_print(struct frame_stats* stats, FILE* f)
+{
+	const unsigned int count = atomic_load(&stats->count);
+	const int n = count < FRAME_STATS_SIZE ? (int)count : FRAME_STATS_SIZE;
+	fprintf(f, "Latency over the last %d presented frames (%u discarded):\n", n, atomic_load(&stats->discarded));
+	if (n == 0)
+		return;
+
+	// Stages, in order: capture, dequeue, commit, present.
+	static const char* names[] = { "capture->dequeue", "dequeue->commit", "commit->present", "capture->present" };
+	uint64_t* values = malloc(n * sizeof(uint64_t));
+	if (!values)
+		return;
+	for (int stage=0; stage<4; ++stage)
+	{
+		int valid = 0;
+		for (int i=0; i<n; ++i)
+		{
+			const struct frame_stats_record* r = stats->records + i;
+			const uint64_t t[4] = { r->capture_ns, r->dequeue_ns, r->commit_ns, r->present_ns };
+			const uint64_t from = stage == 3 ? t[0] : t[stage];
+			const uint64_t to = t[stage+1 > 3 ? 3 : stage+1];
+			if (from && to >= from)	// A capture timestamp of 0 means the driver gave none.
+				values[valid++] = to - from;
+		}
+		if (valid)
+			print_stage(f, names[stage], values, valid);
+	}
+	free(values);
+}
@@ -0,0 +1,43 @@
+//
+// Per-frame latency records, from V4L2 capture to presentation on screen.
+// Records go into a fixed-size ring that never blocks the writer, and are summarised as p50/p99/max.
+// All times are CLOCK_MONOTONIC nanoseconds.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#ifndef FRAME_STATS_H
+#define FRAME_STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define FRAME_STATS_SIZE	4096	// Must be a power of two. Older records are overwritten.
+
+struct frame_stats_record
+{
+	uint64_t	capture_ns;	// V4L2 buffer timestamp: when the driver captured the frame.
+	uint64_t	dequeue_ns;	// When we took it from the driver.
+	uint64_t	commit_ns;	// When we committed it to the compositor.
+	uint64_t	present_ns;	// When the compositor says it turned into light.
+};
+
+struct frame_stats
+{
+	atomic_uint			count;		// Total nr of records added, wraps into the ring.
+	atomic_uint			discarded;	// Frames the compositor never showed.
+	struct frame_stats_record	records[FRAME_STATS_SIZE];
+};
+
+// The CLOCK_MONOTONIC time, in nanoseconds.
+extern uint64_t frame_stats_now(void);
+
+extern void frame_stats_add(struct frame_stats* stats, const struct frame_stats_record* record);
+
+extern void frame_stats_discard(struct frame_stats* stats);
+
+// Print p50/p99/max of each stage, over the records still in the ring.
+extern void frame_stats_print(struct frame_stats* stats, FILE* f);
+
+#endif
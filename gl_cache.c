@@ -0,0 +1,293 @@
+//
+// An on-disk cache for linked GL programs, and the EGL config we chose.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "gl_cache.h"
+
+#include <GLES2/gl2ext.h>
+
+#define CACHE_NAME	"minimal_wayland_client"
+#define PROGRAM_MAGIC	0x31425047u	// "GPB1"
+
+// GLES3 core, which the GLES2 headers lack.
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#	define GL_PROGRAM_BINARY_RETRIEVABLE_HINT	0x8257
+#endif
+#ifndef GL_PROGRAM_BINARY_LENGTH
+#	define GL_PROGRAM_BINARY_LENGTH		0x8741
+#endif
+#ifndef GL_NUM_PROGRAM_BINARY_FORMATS
+#	define GL_NUM_PROGRAM_BINARY_FORMATS	0x87FE
+#endif
+
+// A program binary, as stored.
+struct program_header
+{
+	uint32_t	magic;
+	uint32_t	format;		// As the driver told us.
+	uint32_t	length;		// Nr of bytes that follow.
+};
+
+static PFNGLGETPROGRAMBINARYOESPROC	get_program_binary;
+static PFNGLPROGRAMBINARYOESPROC	program_binary;
+static PFNGLPROGRAMPARAMETERIEXTPROC	program_parameter;
+
+
+// FNV-1a, 64 bit.
+static uint64_t hash(uint64_t h, const void* data, size_t size)
+{
+	const uint8_t* bytes = data;
+	for (size_t i=0; i<size; ++i)
+		h = (h ^ bytes[i]) * 0x100000001b3ull;
+	return h;
+}
+
+
+static uint64_t hash_string(uint64_t h, const char* s)
+{
+	// Include the terminator, so that "ab"+"c" and "a"+"bc" differ.
+	return s ? hash(h, s, strlen(s) + 1) : hash(h, "", 1);
+}
+
+
+// Where an entry lives. Returns 0 if we have no place to cache.
+static int entry_path(char* path, size_t size, const char* kind, uint64_t key, int create)
+{
+	const char* xdg = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+	char dir[512];
+	if (xdg && *xdg)
+		snprintf(dir, sizeof(dir), "%s", xdg);
+	else if (home && *home)
+		snprintf(dir, sizeof(dir), "%s/.cache", home);
+	else
+		return 0;
+	if (create)
+		mkdir(dir, 0700);
+	const int len = snprintf(path, size, "%s/%s", dir, CACHE_NAME);
+	if (create && mkdir(path, 0700) < 0 && errno != EEXIST)
+		return 0;
+	snprintf(path + len, size - len, "/%s-%016llx", kind, (unsigned long long)key);
+	return 1;
+}
+
+
+// Reads a whole entry into a malloc'ed buffer, or returns 0.
+static void* read_entry(const char* kind, uint64_t key, size_t* size)
+{
+	char path[640];
+	if (!entry_path(path, sizeof(path), kind, key, 0))
+		return 0;
+	FILE* f = fopen(path, "rb");
+	if (!f)
+		return 0;
+	void* data = 0;
+	struct stat st;
+	if (fstat(fileno(f), &st) == 0 && st.st_size > 0 && (data = malloc(st.st_size)))
+	{
+		if (fread(data, 1, st.st_size, f) == (size_t)st.st_size)
+			*size = st.st_size;
+		else
+		{
+			free(data);
+			data = 0;
+		}
+	}
+	fclose(f);
+	return data;
+}
+
+
+// Writes an entry to a temporary file first, so that a concurrent run never reads half of one.
+static void write_entry(const char* kind, uint64_t key, const void* header, size_t header_size, const void* data, size_t size)
+{
+	char path[640];
+	char tmp[660];
+	if (!entry_path(path, sizeof(path), kind, key, 1))
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	FILE* f = fopen(tmp, "wb");
+	if (!f)
+	{
+		fprintf(stderr, "Cannot write to the cache at %s: %s\n", tmp, strerror(errno));
+		return;
+	}
+	const int ok = fwrite(header, 1, header_size, f) == header_size && fwrite(data, 1, size, f) == size;
+	if (fclose(f) != 0 || !ok || rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+
+static uint64_t config_key(EGLDisplay dpy, const EGLint* attribs)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	h = hash_string(h, eglQueryString(dpy, EGL_VENDOR));
+	h = hash_string(h, eglQueryString(dpy, EGL_VERSION));
+	h = hash_string(h, eglQueryString(dpy, EGL_CLIENT_APIS));
+	h = hash_string(h, eglQueryString(dpy, EGL_EXTENSIONS));
+	int n = 0;
+	while (attribs[n] != EGL_NONE)
+		n += 2;
+	return hash(h, attribs, n * sizeof(EGLint));
+}
+
+
+// Does the config still have what was asked for? The ID could belong to another config by now.
+static int config_matches(EGLDisplay dpy, EGLConfig config, const EGLint* attribs)
+{
+	for (int i=0; attribs[i] != EGL_NONE; i += 2)
+	{
+		const EGLint want = attribs[i+1];
+		EGLint have = 0;
+		if (want == EGL_DONT_CARE)
+			continue;
+		if (!eglGetConfigAttrib(dpy, config, attribs[i], &have))
+			return 0;
+		switch (attribs[i])
+		{
+			case EGL_SURFACE_TYPE:
+			case EGL_RENDERABLE_TYPE:
+			case EGL_CONFORMANT:
+				if ((have & want) != want)
+					return 0;
+				break;
+			case EGL_RED_SIZE:
+			case EGL_GREEN_SIZE:
+			case EGL_BLUE_SIZE:
+			case EGL_ALPHA_SIZE:
+			case EGL_DEPTH_SIZE:
+			case EGL_STENCIL_SIZE:
+			case EGL_SAMPLE_BUFFERS:
+			case EGL_SAMPLES:
+				if (have < want)
+					return 0;
+				break;
+			default:
+				if (have != want)
+					return 0;
+		}
+	}
+	return 1;
+}
+
+
+EGLConfig gl_cache_load_config(EGLDisplay dpy, const EGLint* attribs)
+{
+	size_t size = 0;
+	EGLint* id = read_entry("config", config_key(dpy, attribs), &size);
+	if (!id)
+		return 0;
+	// Looking a config up by its ID skips the sorting of all the others.
+	const EGLint by_id[] = { EGL_CONFIG_ID, *id, EGL_NONE };
+	EGLConfig config = 0;
+	EGLint count = 0;
+	if (size != sizeof(EGLint) || !eglChooseConfig(dpy, by_id, &config, 1, &count) || count < 1 || !config_matches(dpy, config, attribs))
+		config = 0;
+	free(id);
+	return config;
+}
+
+
+void gl_cache_store_config(EGLDisplay dpy, const EGLint* attribs, EGLConfig config)
+{
+	EGLint id = 0;
+	if (eglGetConfigAttrib(dpy, config, EGL_CONFIG_ID, &id))
+		write_entry("config", config_key(dpy, attribs), &id, sizeof(id), "", 0);
+}
+
+
+// Can this driver hand out program binaries, and take them back?
+static int have_program_binaries(void)
+{
+	if (!get_program_binary)
+	{
+		// Core in GLES3, and an extension before that.
+		get_program_binary = (PFNGLGETPROGRAMBINARYOESPROC) eglGetProcAddress("glGetProgramBinary");
+		program_binary = (PFNGLPROGRAMBINARYOESPROC) eglGetProcAddress("glProgramBinary");
+		program_parameter = (PFNGLPROGRAMPARAMETERIEXTPROC) eglGetProcAddress("glProgramParameteri");
+		if (!get_program_binary || !program_binary)
+		{
+			get_program_binary = (PFNGLGETPROGRAMBINARYOESPROC) eglGetProcAddress("glGetProgramBinaryOES");
+			program_binary = (PFNGLPROGRAMBINARYOESPROC) eglGetProcAddress("glProgramBinaryOES");
+		}
+	}
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return get_program_binary && program_binary && formats > 0;
+}
+
+
+static uint64_t program_key(const char* vertex_source, const char* fragment_source)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	h = hash_string(h, (const char*)glGetString(GL_VENDOR));
+	h = hash_string(h, (const char*)glGetString(GL_RENDERER));
+	h = hash_string(h, (const char*)glGetString(GL_VERSION));
+	h = hash_string(h, vertex_source);
+	return hash_string(h, fragment_source);
+}
+
+
+GLuint gl_cache_load_program(const char* vertex_source, const char* fragment_source)
+{
+	if (!have_program_binaries())
+		return 0;
+	size_t size = 0;
+	struct program_header* header = read_entry("program", program_key(vertex_source, fragment_source), &size);
+	if (!header)
+		return 0;
+	GLuint program = 0;
+	if (size >= sizeof(*header) && header->magic == PROGRAM_MAGIC && header->length == size - sizeof(*header))
+	{
+		program = glCreateProgram();
+		program_binary(program, header->format, header + 1, header->length);
+		// The driver may still turn it down, e.g. after an update that kept its version strings.
+		GLint linked = 0;
+		glGetProgramiv(program, GL_LINK_STATUS, &linked);
+		if (!linked)
+		{
+			glDeleteProgram(program);
+			program = 0;
+		}
+	}
+	free(header);
+	return program;
+}
+
+
+void gl_cache_prepare_program(GLuint program)
+{
+	if (have_program_binaries() && program_parameter)
+		program_parameter(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+}
+
+
+void gl_cache_store_program(GLuint program, const char* vertex_source, const char* fragment_source)
+{
+	if (!have_program_binaries())
+		return;
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	void* binary = length > 0 ? malloc(length) : 0;
+	if (!binary)
+		return;
+	GLenum format = 0;
+	GLsizei written = 0;
+	get_program_binary(program, length, &written, &format, binary);
+	if (written > 0)
+	{
+		const struct program_header header = { PROGRAM_MAGIC, format, (uint32_t)written };
+		write_entry("program", program_key(vertex_source, fragment_source), &header, sizeof(header), binary, written);
+	}
+	free(binary);
+}
@@ -0,0 +1,30 @@
+//
+// An on-disk cache for what is slow to make at startup: linked GL programs, and the EGL config we chose.
+// Entries live under $XDG_CACHE_HOME/minimal_wayland_client (or ~/.cache/minimal_wayland_client), one file each,
+// named after a hash of their key. Keys include the vendor, renderer and version strings of the driver,
+// so after a driver update, entries simply miss, and are written anew.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#ifndef GL_CACHE_H
+#define GL_CACHE_H
+
+#include <EGL/egl.h>
+#include <GLES2/gl2.h>
+
+// The config that was chosen for these attributes before, or 0 on a miss, or if it no longer has them.
+extern EGLConfig gl_cache_load_config(EGLDisplay dpy, const EGLint* attribs);
+
+extern void gl_cache_store_config(EGLDisplay dpy, const EGLint* attribs, EGLConfig config);
+
+// A program linked from these sources in an earlier run, or 0 on a miss. Needs a current GLES3 context.
+extern GLuint gl_cache_load_program(const char* vertex_source, const char* fragment_source);
+
+// Ask the driver to keep the binary of a program around: call before linking it.
+extern void gl_cache_prepare_program(GLuint program);
+
+// Store a program, linked from these sources.
+extern void gl_cache_store_program(GLuint program, const char* vertex_source, const char* fragment_source);
+
+#endif
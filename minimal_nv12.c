@@ -6,6 +6,8 @@
 // (c)2023 by Bram Stolk (b.stolk@gmail.com)
 //
 
+#define _GNU_SOURCE	// For memfd_create()
+
 #include <sys/ioctl.h>
 #include <inttypes.h>
 #include <stdlib.h>
@@ -16,21 +18,53 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <time.h>
 
 #include <wayland-client-core.h>
 #include <wayland-egl.h>
 
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <EGL/eglplatform.h>
 #include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
 
 #include <linux/videodev2.h>
+#include <linux/dma-buf.h>
 
 #include "xdg-shell-client-protocol.h" // Include code generated with wayland-scanner.
 
 #include "linux-dma-protocol.h"
 
-#define MAXBUF	4
+#include "presentation-time-protocol.h"
+#include "viewporter-protocol.h"
+#include "fractional-scale-protocol.h"
+
+#include "dmabuf_caps.h"
+#include "dmabuf_feedback.h"
+#include "frame_queue.h"
+#include "capture_file.h"
+#include "explicit_sync.h"
+#include "frame_stats.h"
+#include "bench_report.h"
+#include "vid_format.h"
+#include "v4l2_stream.h"
+#include "dma_alloc.h"
+#include "startup_trace.h"
+#include "shm_pool.h"
+#include "pixel_convert.h"
+#include "gl_cache.h"
+
+#define DEFAULT_EXTRA_BUFFERS	2	// On top of the driver minimum: one on screen, one pending in the compositor.
 
 // OpenGLES
 
@@ -41,20 +75,93 @@ static EGLContext		egl_ctx;
 static EGLSurface		egl_srf;
 
 // video
+
 static int			vid_fd;
 static uint32_t			vid_fourcc;
 static enum v4l2_buf_type	vid_buffer_type;
-static int			vid_num_planes;
+static int			vid_num_planes;	// Nr of memory planes (exported fds) per buffer.
 static uint32_t			vid_resolution[2];
-static uint32_t			vid_strides[VIDEO_MAX_PLANES];
-static struct v4l2_buffer	vid_buffers[MAXBUF];
-static struct v4l2_plane	vid_planes[MAXBUF][VIDEO_MAX_PLANES];
-static const int		vid_num_buffers = MAXBUF;
-static int			vid_dma_fds[MAXBUF][VIDEO_MAX_PLANES];
+static struct vid_plane_layout	vid_layout[4];	// Per colour plane.
+static int			vid_num_color_planes;
+static const struct vid_format_desc*	vid_desc;
+static struct v4l2_format	vid_format;
+static enum v4l2_memory		vid_memory;
+static int			vid_import;	// Capture into dmabufs of our own (-i), rather than the driver's.
+static struct dma_alloc		dma_alloc = { -1, -1, 0 };	// Shared by all devices.
+static atomic_int		vid_in_driver;	// Nr of buffers queued to the driver.
+static uint64_t			vid_modifier = DRM_FORMAT_MOD_LINEAR;	// V4L2 only produces linear buffers.
+static int			vid_depth;	// The ring depth asked for, to reallocate after a source change.
+static int			vid_max_depth;
+
+// A capture buffer, which is shared between the video device and the compositor.
+struct vid_slot
+{
+	struct v4l2_buffer	buf;
+	struct v4l2_plane	planes[VIDEO_MAX_PLANES];
+	int			dma_fds[VIDEO_MAX_PLANES];
+	EGLImageKHR		images[3];	// For the shader path: one per texture.
+	GLuint			textures[3];
+	uint64_t		capture_ns;	// Latency bookkeeping for the frame in this buffer.
+	uint64_t		dequeue_ns;
+	uint64_t		release_point;	// Syncobj point the compositor signals when done with our last commit of it.
+	int			release_fd;	// Polls readable once the compositor is really done with it, or -1.
+	uint8_t*		cpu_maps[VIDEO_MAX_PLANES];	// For the wl_shm path: the memory planes, mapped for reading.
+	size_t			cpu_map_sizes[VIDEO_MAX_PLANES];
+};
+
+// The ring of capture buffers. Its depth is decided at run time, and it can grow while streaming.
+struct vid_ring
+{
+	int			count;
+	int			max_count;
+	struct vid_slot*	slots[VIDEO_MAX_FRAME];
+};
+
+static struct vid_ring		vid_ring;
+
+// Where frames come from: a V4L2 device, or a file played back at a fixed rate.
+// A backend sets up the vid_* format globals and fills the ring. Its vid_fd is readable when a frame is ready.
+struct capture_source
+{
+	const char*	name;
+	int		(*open)(const char* path, uint32_t required_format);
+	int		(*reset_format)(uint32_t pixelformat);	// After a source change, with the ring empty. 0 keeps the pixelformat.
+	uint32_t	(*best_format)(void);			// The pixelformat the compositor now likes best, or 0 to stay as we are.
+	int		(*start)(int depth, int max_depth);	// Fill the ring, with all buffers queued.
+	void		(*stop)(void);				// Empty the ring.
+	int		(*dequeue)(void);			// Buffer index of the next frame, or -1.
+	void		(*queue)(int buf_nr);
+	int		(*grow)(void);				// Add one buffer to the ring: returns its index, or -1.
+	int		(*source_changed)(void);
+	void		(*close)(void);
+};
+
+static const struct capture_source*	capture;
+
+static uint32_t			file_resolution[2];	// For a file source: set with -s.
+static int			file_fps = 30;
+static struct capture_file	capture_file;
+
+// Optional capture thread (-t). While it runs, it owns VIDIOC_DQBUF and VIDIOC_QBUF.
+// The newest frame reaches the main thread through a mailbox, and used buffers come back through a queue.
+static pthread_t		capture_thread;
+static int			capture_threaded;	// Asked for with -t.
+static int			capture_running;
+static atomic_int		capture_stop;
+static struct frame_mailbox	capture_mailbox;
+static struct frame_queue	capture_returns;
+static int			frame_efd = -1;		// Capture thread -> main thread: a frame was posted.
+static int			return_efd = -1;	// Main thread -> capture thread: a buffer came back, or stop.
 
 // Wayland
 
 static struct wl_compositor*	compositor;
+static struct wl_subcompositor*	subcompositor;
+static struct wl_shm*		shm;
+static struct dmabuf_caps	shm_caps;	// The formats the compositor takes in wl_shm buffers.
+static struct shm_pool		shm_pool;
+static uint32_t			shm_format;	// What we put in them: our capture format, NV12 or XRGB8888.
+static int32_t			shm_stride;
 static struct wl_surface*	surface;
 static struct wl_region*	region;
 
@@ -63,12 +170,125 @@ static struct xdg_surface*	xdg_surface;
 static struct xdg_toplevel*	xdg_toplevel;
 
 static struct zwp_linux_dmabuf_v1* dmabuf;
+static struct dmabuf_caps	dmabuf_caps;	// The formats and modifiers the compositor takes (before version 4).
+static struct dmabuf_feedback	default_feedback;	// Version 4 and up: what the compositor takes in general,
+static struct dmabuf_feedback	surface_feedback;	// and what it prefers for our surface.
+static int			feedback_changed = 0;
+
+static struct wp_linux_drm_syncobj_manager_v1*	syncobj_manager;
+static struct explicit_sync	explicit_sync;
+
+static struct wp_viewporter*			viewporter;
+static struct wp_fractional_scale_manager_v1*	fractional_scale_manager;
+static struct wp_viewport*			viewport;
+static struct wp_fractional_scale_v1*		fractional_scale;
+
+static struct wp_presentation*	presentation;
+static uint32_t			presentation_clock = CLOCK_MONOTONIC;
+static struct frame_stats	frame_stats;
+static volatile sig_atomic_t	stats_requested = 0;	// Set by SIGUSR1.
+
+static int			bench_frames = 0;	// With -c: quit after this many frames.
+static struct bench_report	bench;
+static int64_t			bench_last_sequence = -1;
 
 // Application
 
-static int32_t			winw = 1280;
+static int32_t			winw = 1280;	// Logical (surface) size.
 static int32_t			winh =  720;
+static uint32_t			scale120 = 120;	// Preferred scale of the compositor, in 120ths.
+static int32_t			bufw = 1280;	// Rendered size, in device pixels.
+static int32_t			bufh =  720;
+static int32_t			allocw = 0;	// Size of our EGL window: at least bufw x bufh.
+static int32_t			alloch = 0;
+static int32_t			pending_w = 0;	// The size from the last configure, not yet acked.
+static int32_t			pending_h = 0;
+static uint32_t			pending_serial;
+static int			configure_pending = 0;
 static int			done =    0;
+static int			configured = 0;
+static int			compositor_sized = 0;	// Did the compositor pick our window size?
+static int			timer_fd =   -1;
+
+// How captured frames end up on screen.
+enum present_path
+{
+	PRESENT_DMABUF,		// The compositor takes our capture buffers directly.
+	PRESENT_SHADER,		// We convert to RGB on the GPU, sampling from our capture buffers.
+	PRESENT_SHM,		// We copy (or convert) frames into wl_shm buffers, on the CPU.
+	PRESENT_NONE,		// We can't show video at all.
+};
+static enum present_path	present_path = PRESENT_NONE;
+static int			vid_shown = -1;	// The buffer we last drew from, on the shader path.
+
+
+// Scaling: the viewport maps our buffers onto the logical window size, so the compositor (ideally the scanout plane)
+// scales them. Video buffers are attached at video resolution. The EGL window is sized to the exact device pixels.
+
+// With a viewport, the EGL window can be larger than what we show: we draw into its bottom-left corner, and crop that out.
+// So resizes within a bucket do not reallocate. Buckets grow in steps of 64 pixels, with a quarter extra to grow into,
+// and only shrink when less than half is used.
+static int32_t bucket_size(int32_t need, int32_t have)
+{
+	if (need <= have && 2 * need > have)
+		return have;
+	return (need + need / 4 + 63) & ~63;
+}
+
+
+static void apply_scale(void)
+{
+	bufw = viewport ? (int32_t)((winw * scale120 + 60) / 120) : winw;
+	bufh = viewport ? (int32_t)((winh * scale120 + 60) / 120) : winh;
+	int32_t w = bufw;
+	int32_t h = bufh;
+	if (viewport)
+	{
+		w = bucket_size(bufw, allocw);
+		h = bucket_size(bufh, alloch);
+		// Video buffers are shown whole. Without a size from the compositor, they set the surface size themselves.
+		const int video_buffers = present_path == PRESENT_DMABUF || present_path == PRESENT_SHM;
+		if (video_buffers)
+		{
+			const wl_fixed_t unset = wl_fixed_from_int(-1);
+			wp_viewport_set_source(viewport, unset, unset, unset, unset);
+		}
+		else
+			wp_viewport_set_source(viewport, wl_fixed_from_int(0), wl_fixed_from_int(h - bufh), wl_fixed_from_int(bufw), wl_fixed_from_int(bufh));
+		if (video_buffers && !compositor_sized)
+			wp_viewport_set_destination(viewport, -1, -1);
+		else
+			wp_viewport_set_destination(viewport, winw, winh);
+	}
+	if (w != allocw || h != alloch)
+	{
+		allocw = w;
+		alloch = h;
+		if (native_win)
+		{
+			// EGL reallocates its buffers at the next swap.
+			wl_egl_window_resize(native_win, allocw, alloch, 0, 0);
+			bench.reallocs++;
+		}
+	}
+}
+
+
+static void fractional_scale_preferred(void* data, struct wp_fractional_scale_v1* fs, uint32_t scale)
+{
+	(void)data;
+	(void)fs;
+	if (scale == scale120)
+		return;
+	fprintf(stderr, "Compositor prefers a scale of %.3f.\n", scale / 120.0);
+	scale120 = scale;
+	apply_scale();
+}
+
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener =
+{
+	.preferred_scale = fractional_scale_preferred,
+};
 
 
 // xdg toplevel handling
@@ -87,13 +307,9 @@ static void xdg_toplevel_handle_configure
 	(void) states;
 	if(w == 0 && h == 0)
 		return;
-	if(winw != w || winh != h)
-	{
-		winw = w;
-		winh = h;
-		wl_egl_window_resize(native_win, winw, winh, 0, 0);
-		wl_surface_commit(surface);
-	}
+	// Applied when the configure gets acked.
+	pending_w = w;
+	pending_h = h;
 }
 
 static void xdg_toplevel_handle_close
@@ -118,7 +334,11 @@ static struct xdg_toplevel_listener xdg_toplevel_listener = {
 static void xdg_surface_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial)
 {
 	(void) data;
-	xdg_surface_ack_configure(xdg_surface, serial);
+	(void) xdg_surface;
+	// Acked from the main loop: during an interactive resize, many configures come in at once.
+	pending_serial = serial;
+	configure_pending = 1;
+	configured = 1;
 }
 
 static const struct xdg_surface_listener xdg_surface_listener =
@@ -127,6 +347,25 @@ static const struct xdg_surface_listener xdg_surface_listener =
 };
 
 
+// Only the last configure needs an ack, and only its size is applied. The next frame commits it.
+static void apply_configure(void)
+{
+	if (!configure_pending)
+		return;
+	xdg_surface_ack_configure(xdg_surface, pending_serial);
+	configure_pending = 0;
+	if (pending_w && (pending_w != winw || pending_h != winh || !compositor_sized))
+	{
+		compositor_sized = 1;
+		winw = pending_w;
+		winh = pending_h;
+		apply_scale();
+		bench.resizes++;
+	}
+	pending_w = pending_h = 0;
+}
+
+
 // xdg wm base handling
 
 static void xdg_wm_base_ping(void *data, struct xdg_wm_base *xdg_wm_base, uint32_t serial)
@@ -141,22 +380,110 @@ static const struct xdg_wm_base_listener xdg_wm_base_listener =
 };
 
 
+// video code (forward declarations)
+
+static void requeue_buffer(int buf_nr);
+
+
+// wl_buffer handling
+
+static void buffer_release(void* data, struct wl_buffer* buffer)
+{
+	(void)buffer;
+	// The compositor no longer needs this buffer, but its GPU may still be reading from it.
+	// Only once that is done may the capture device fill it again.
+	const int buf_nr = (int)(intptr_t)data;
+	struct vid_slot* slot = vid_ring.slots[buf_nr];
+	slot->release_fd = explicit_sync_release_fd(&explicit_sync, slot->release_point, slot->dma_fds[0]);
+	if (slot->release_fd < 0)
+		requeue_buffer(buf_nr);
+}
+
+
+static const struct wl_buffer_listener buffer_listener =
+{
+	.release = buffer_release,
+};
+
+
+// wl_buffer cache: every capture buffer gets its wl_buffer made once, and reused for every frame.
+// The key is the V4L2 buffer index, plus the format, modifier and size the wl_buffer was made with.
+
+struct buffer_cache_entry
+{
+	struct wl_buffer*			wl_buffer;
+	struct zwp_linux_buffer_params_v1*	params;	// Kept until we know whether the compositor accepted it.
+	struct wl_callback*			check;	// For a buffer made mid-stream: the sync that tells us.
+	uint32_t				format;
+	uint64_t				modifier;
+	uint32_t				width, height;
+	int					failed;
+};
+
+static struct buffer_cache_entry	buffer_cache[VIDEO_MAX_FRAME];	// Indexed by V4L2 buffer index.
+static int				buffer_cache_failed;
+
+
+static int buffer_cache_matches(const struct buffer_cache_entry* entry)
+{
+	return
+		entry->format == vid_fourcc &&
+		entry->modifier == vid_modifier &&
+		entry->width == vid_resolution[0] &&
+		entry->height == vid_resolution[1];
+}
+
+
+// The wl_buffer for a capture buffer, or 0 if there is none (yet) for the current format.
+// While its params are still around, we do not know yet whether the compositor takes it.
+static struct wl_buffer* buffer_cache_lookup(int buf_nr)
+{
+	const struct buffer_cache_entry* entry = buffer_cache + buf_nr;
+	if (!entry->wl_buffer || entry->params || entry->failed || !buffer_cache_matches(entry))
+		return 0;
+	return entry->wl_buffer;
+}
+
+
+static void buffer_cache_drop(struct buffer_cache_entry* entry)
+{
+	if (entry->check)
+		wl_callback_destroy(entry->check);
+	if (entry->params)
+		zwp_linux_buffer_params_v1_destroy(entry->params);
+	if (entry->wl_buffer)
+		wl_buffer_destroy(entry->wl_buffer);
+	memset(entry, 0, sizeof(*entry));
+}
+
+
+// Forget all wl_buffers, e.g. when the capture format or resolution changes.
+static void buffer_cache_invalidate(void)
+{
+	for (int b=0; b<VIDEO_MAX_FRAME; ++b)
+		buffer_cache_drop(buffer_cache + b);
+	buffer_cache_failed = 0;
+}
+
+
 // dma buf protocol
 
-static void params_created(void* data, struct zwp_linux_buffer_params_v1* params, struct wl_buffer* new_buffer)
+static void params_failed(void* data, struct zwp_linux_buffer_params_v1* params)
 {
-	(void)data;
 	(void)params;
-	(void)new_buffer;
-	fprintf(stderr,"dmabuf params created\n");
+	struct buffer_cache_entry* entry = data;
+	fprintf(stderr,"dmabuf params creation failed for video buffer %d.\n", (int)(entry - buffer_cache));
+	entry->failed = 1;
+	buffer_cache_failed = 1;
 }
 
 
-static void params_failed(void* data, struct zwp_linux_buffer_params_v1* params)
+static void params_created(void* data, struct zwp_linux_buffer_params_v1* params, struct wl_buffer* new_buffer)
 {
+	// Only sent for the asynchronous create request: we use create_immed.
 	(void)data;
 	(void)params;
-	fprintf(stderr,"dmabuf params creation failed.\n");
+	wl_buffer_destroy(new_buffer);
 }
 
 
@@ -180,13 +507,7 @@ static void dmabuf_modifier(void* data, struct zwp_linux_dmabuf_v1* zwp_linux_dm
 	(void)data;
 	(void)zwp_linux_dmabuf;
 	const uint64_t modifier = modifier_lo | ((uint64_t)modifier_hi) << 32UL;
-	if (modifier == 0)
-		fprintf
-		(
-			stderr,
-			"dmabuf listener found format %c%c%c%c\n",
-			(format>>0)&0xff, (format>>8)&0xff, (format>>16)&0xff, (format>>24)&0xff
-		);
+	dmabuf_caps_add(&dmabuf_caps, format, modifier, 0);
 }
 
 
@@ -196,8 +517,163 @@ static const struct zwp_linux_dmabuf_v1_listener dmabuf_listener = {
 };
 
 
+static void surface_feedback_changed(void* data, struct dmabuf_feedback* feedback)
+{
+	(void)data;
+	(void)feedback;
+	// Re-choose how to present in the main loop, not in the middle of dispatching.
+	feedback_changed = 1;
+}
+
+
+// The best knowledge we have of what the compositor takes: surface feedback, default feedback, or the old events.
+static const struct dmabuf_caps* compositor_caps(void)
+{
+	if (surface_feedback.caps.num_formats)
+		return &surface_feedback.caps;
+	if (default_feedback.caps.num_formats)
+		return &default_feedback.caps;
+	return &dmabuf_caps;
+}
+
+
+// wl_shm formats: the same fourcc codes as DRM, except for the two that every compositor has.
+
+static void shm_format_event(void* data, struct wl_shm* wl_shm, uint32_t format)
+{
+	(void)data;
+	(void)wl_shm;
+	if (format == WL_SHM_FORMAT_ARGB8888)
+		format = DRM_FORMAT_ARGB8888;
+	else if (format == WL_SHM_FORMAT_XRGB8888)
+		format = DRM_FORMAT_XRGB8888;
+	dmabuf_caps_add(&shm_caps, format, DRM_FORMAT_MOD_LINEAR, 0);
+}
+
+static const struct wl_shm_listener shm_listener =
+{
+	.format = shm_format_event,
+};
+
+
 // registry handling
 
+// Presentation time: when did our frames actually hit the screen?
+
+static void presentation_clock_id(void* data, struct wp_presentation* wp_presentation, uint32_t clk_id)
+{
+	(void)data;
+	(void)wp_presentation;
+	presentation_clock = clk_id;
+	if (clk_id != CLOCK_MONOTONIC)
+		fprintf(stderr, "Compositor presentation clock is not CLOCK_MONOTONIC: no presentation latencies.\n");
+}
+
+
+static const struct wp_presentation_listener presentation_listener =
+{
+	.clock_id = presentation_clock_id,
+};
+
+
+static void presentation_sync_output(void* data, struct wp_presentation_feedback* feedback, struct wl_output* output)
+{
+	(void)data;
+	(void)feedback;
+	(void)output;
+}
+
+
+static void presentation_presented
+(
+	void* data,
+	struct wp_presentation_feedback* feedback,
+	uint32_t tv_sec_hi,
+	uint32_t tv_sec_lo,
+	uint32_t tv_nsec,
+	uint32_t refresh,
+	uint32_t seq_hi,
+	uint32_t seq_lo,
+	uint32_t flags
+)
+{
+	(void)refresh;
+	(void)seq_hi;
+	(void)seq_lo;
+	(void)flags;
+	struct frame_stats_record* record = data;
+	if (presentation_clock == CLOCK_MONOTONIC)
+	{
+		const uint64_t sec = ((uint64_t)tv_sec_hi << 32) | tv_sec_lo;
+		record->present_ns = sec * 1000000000ull + tv_nsec;
+		frame_stats_add(&frame_stats, record);
+	}
+	free(record);
+	wp_presentation_feedback_destroy(feedback);
+}
+
+
+static void presentation_discarded(void* data, struct wp_presentation_feedback* feedback)
+{
+	frame_stats_discard(&frame_stats);
+	free(data);
+	wp_presentation_feedback_destroy(feedback);
+}
+
+
+static const struct wp_presentation_feedback_listener presentation_feedback_listener =
+{
+	.sync_output = presentation_sync_output,
+	.presented   = presentation_presented,
+	.discarded   = presentation_discarded,
+};
+
+
+// Ask when the frame in this buffer reaches the screen. Call right before the commit that shows it.
+static void track_presentation(int buf_nr)
+{
+	if (!presentation)
+		return;
+	const struct vid_slot* slot = vid_ring.slots[buf_nr];
+	struct frame_stats_record* record = calloc(1, sizeof(struct frame_stats_record));
+	assert(record);
+	record->capture_ns = slot->capture_ns;
+	record->dequeue_ns = slot->dequeue_ns;
+	record->commit_ns = frame_stats_now();
+	struct wp_presentation_feedback* feedback = wp_presentation_feedback(presentation, surface);
+	wp_presentation_feedback_add_listener(feedback, &presentation_feedback_listener, record);
+}
+
+
+// What the startup time is measured to: the first frame we commit.
+static void trace_first_frame(void)
+{
+	if (bench.startup_ms == 0)
+		bench.startup_ms = startup_trace_mark("first frame committed");
+}
+
+
+// Count a shown frame for the benchmark. Gaps in the V4L2 sequence nrs are frames that were dropped,
+// by the driver or by us.
+static void bench_count_frame(int buf_nr)
+{
+	trace_first_frame();
+	const uint32_t sequence = vid_ring.slots[buf_nr]->buf.sequence;
+	if (bench_last_sequence >= 0 && sequence > bench_last_sequence)
+		bench.dropped += sequence - bench_last_sequence - 1;
+	bench_last_sequence = sequence;
+	if (++bench.frames == bench_frames)
+		done = 1;
+}
+
+
+static void request_stats(int signum)
+{
+	(void)signum;
+	stats_requested = 1;
+}
+
+
 static void global_registry_handler
 (
 	void *data,
@@ -214,12 +690,30 @@ static void global_registry_handler
 	//fprintf(stderr, "Registry event for %s id %d\n", interface, id);
 	if (strcmp(interface, "wl_compositor") == 0) {
 		compositor = wl_registry_bind(registry, id, &wl_compositor_interface, 1);
+	} else if (strcmp(interface, wl_subcompositor_interface.name) == 0) {
+		subcompositor = wl_registry_bind(registry, id, &wl_subcompositor_interface, 1);
+	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
+		shm = wl_registry_bind(registry, id, &wl_shm_interface, 1);
+		wl_shm_add_listener(shm, &shm_listener, 0);
 	} else if (strcmp(interface, xdg_wm_base_interface.name) == 0) {
 		wm_base = wl_registry_bind(registry, id, &xdg_wm_base_interface, 1);
 		xdg_wm_base_add_listener(wm_base, &xdg_wm_base_listener, NULL);
 	} else if (strcmp(interface, zwp_linux_dmabuf_v1_interface.name) == 0) {
-		dmabuf = wl_registry_bind(registry, id, &zwp_linux_dmabuf_v1_interface, 3);
-		zwp_linux_dmabuf_v1_add_listener(dmabuf, &dmabuf_listener, 0);
+		const uint32_t v = version < 4 ? 3 : 4;
+		dmabuf = wl_registry_bind(registry, id, &zwp_linux_dmabuf_v1_interface, v);
+		if (v >= ZWP_LINUX_DMABUF_V1_GET_DEFAULT_FEEDBACK_SINCE_VERSION)
+			dmabuf_feedback_init(&default_feedback, zwp_linux_dmabuf_v1_get_default_feedback(dmabuf), 0, 0);
+		else
+			zwp_linux_dmabuf_v1_add_listener(dmabuf, &dmabuf_listener, 0);
+	} else if (strcmp(interface, wp_linux_drm_syncobj_manager_v1_interface.name) == 0) {
+		syncobj_manager = wl_registry_bind(registry, id, &wp_linux_drm_syncobj_manager_v1_interface, 1);
+	} else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		viewporter = wl_registry_bind(registry, id, &wp_viewporter_interface, 1);
+	} else if (strcmp(interface, wp_fractional_scale_manager_v1_interface.name) == 0) {
+		fractional_scale_manager = wl_registry_bind(registry, id, &wp_fractional_scale_manager_v1_interface, 1);
+	} else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+		presentation = wl_registry_bind(registry, id, &wp_presentation_interface, 1);
+		wp_presentation_add_listener(presentation, &presentation_listener, 0);
 	}
 }
 
@@ -245,366 +739,2084 @@ static const struct wl_registry_listener registry_listener =
 
 // video code
 
-static int xioctl(int fd, unsigned long request, void *arg)
-{
-	int r;
-	do {
-		r = ioctl(fd, request, arg);
-	} while (r == -1 && errno == EINTR);
-        return r;
-}
+// A V4L2 capture source: one v4l2_stream, whose buffers back the ring slots.
+static struct v4l2_stream	vid_stream;
 
 
-int setup_video(const char* devname, const uint32_t required_format, const int plane_count)
+// Give the ring slots [first, first+count) the buffers of the stream. Their dma fds stay with the stream.
+static void ring_add_stream_slots(int first, int count)
 {
-	// Open the video device.
-	vid_fourcc = required_format;
-	vid_fd = open(devname, O_RDWR);
-	if (vid_fd < 0)
-		return -1;
-	struct v4l2_capability cap;
-	if (xioctl(vid_fd, VIDIOC_QUERYCAP, &cap) == -1)
+	for (int b=first; b<first+count; ++b)
 	{
-		fprintf(stderr, "QUERYCAP failed: %s\n", strerror(errno));
-		close(vid_fd);
-		return -1;
+		const struct v4l2_stream_buffer* buffer = vid_stream.buffers + b;
+		struct vid_slot* slot = calloc(1, sizeof(struct vid_slot));
+		assert(slot);
+		slot->buf = buffer->buf;
+		for (int p=0; p<vid_num_planes; ++p)
+			slot->dma_fds[p] = buffer->dma_fds[p];
+		slot->release_fd = -1;
+		vid_ring.slots[b] = slot;
+		vid_ring.count = b+1;
+		if (buffer->in_driver)
+			vid_in_driver++;
 	}
-	// Make sure it can capture multiplanar video using dma.
-	const int multiplanar_capable =
-		cap.capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE;
-	const int streaming_capable =
-		cap.capabilities & V4L2_CAP_STREAMING;
+}
 
-	if (!streaming_capable)
-	{
-		fprintf(stderr, "Video device %s cannot stream.\n", devname);
-		close(vid_fd);
-		return -1;
-	}
 
-	fprintf(stderr, "Video device %s multi-plane capable: %s\n", devname, multiplanar_capable ? "YES" : "NO");
-	if (!multiplanar_capable && plane_count > 1)
+// Close the dma buffers of all ring slots (if they own them), and forget them.
+// Any wl_buffers and EGLImages made from them must be gone by now.
+static void ring_free_slots(int own_fds)
+{
+	for (int b=0; b<vid_ring.count; ++b)
 	{
-		close(vid_fd);
-		return -1;
+		struct vid_slot* slot = vid_ring.slots[b];
+		for (int p=0; p<vid_num_planes; ++p)
+		{
+			if (slot->cpu_maps[p])
+				munmap(slot->cpu_maps[p], slot->cpu_map_sizes[p]);
+			if (own_fds)
+				close(slot->dma_fds[p]);
+		}
+		if (slot->release_fd >= 0)
+			close(slot->release_fd);
+		free(slot);
+		vid_ring.slots[b] = 0;
 	}
+	vid_ring.count = 0;
+	vid_in_driver = 0;
+}
 
-	vid_buffer_type = plane_count > 1 ? V4L2_CAP_VIDEO_CAPTURE_MPLANE : V4L2_CAP_VIDEO_CAPTURE;
 
-	// It's not clear to me why DMABUF access does not work here.
-	// Why do we have to do MMAP first?
-	const enum v4l2_memory memory_access_type = V4L2_MEMORY_MMAP;
-	//const enum v4l2_memory memory_access_type = V4L2_MEMORY_DMABUF;
+// Lay out the colour planes of our frames, in the vid_format of the capture source.
+// Returns the size of a frame (0 for multi-planar formats).
+static uint32_t compute_plane_layout(const struct vid_format_desc* desc)
+{
+	vid_num_color_planes = desc->num_planes;
+	return vid_format_layout(desc, &vid_format, vid_layout);
+}
 
-	// See what current format is.
-	struct v4l2_format current_format;
-	memset(&current_format, 0, sizeof(current_format));
-	current_format.type = vid_buffer_type;
-	if (xioctl(vid_fd, VIDIOC_G_FMT, &current_format) < 0)
-	{
-		fprintf(stderr, "VIDIOC_G_FMT failed: %s\n", strerror(errno));
-		close(vid_fd);
-		return -1;
-	}
-	vid_resolution[0] = current_format.fmt.pix.width;
-	vid_resolution[1] = current_format.fmt.pix.height;
-	vid_strides[0] = current_format.fmt.pix.bytesperline;
-	const uint32_t fourcc = current_format.fmt.pix.pixelformat;
-	fprintf
-	(
-		stderr,
-		"Current setting has type 0x%x and pixelformat %c%c%c%c\n",
-		current_format.type,
-		(fourcc>> 0) & 0xff,
-		(fourcc>> 8) & 0xff,
-		(fourcc>>16) & 0xff,
-		(fourcc>>24) & 0xff
-	);
-	fprintf
-	(
-		stderr,
-		"Current resolution: %dx%d with stride %d\n",
-		vid_resolution[0], vid_resolution[1], vid_strides[0]
-	);
 
-	vid_num_planes = plane_count;
-	struct v4l2_requestbuffers request;
-	memset(&request, 0, sizeof(request));
-	request.type = vid_buffer_type;
-	request.memory = memory_access_type;
-	request.count = vid_num_buffers * vid_num_planes;
-	if (xioctl(vid_fd, VIDIOC_REQBUFS, &request) < 0)
-	{
-		fprintf(stderr, "VIDEOC_REQBUFS failed: %s\n", strerror(errno));
-		close(vid_fd);
-		return -1;
-	}
-	if (request.count < (uint32_t)vid_num_buffers * vid_num_planes)
-	{
-		fprintf(stderr, "VIDEOC_REQBUFS fell short with only %d buffers.\n", request.count);
-		close(vid_fd);
-		return -1;
-	}
-	fprintf(stderr, "Created %d buffers\n", request.count);
+// The vid_* format globals follow the format of the stream.
+static void v4l2_take_format(void)
+{
+	vid_buffer_type = vid_stream.type;
+	vid_memory = vid_stream.memory;
+	vid_format = vid_stream.format;
+	vid_resolution[0] = vid_stream.width;
+	vid_resolution[1] = vid_stream.height;
+	vid_num_planes = vid_stream.num_mem_planes;
+	vid_desc = vid_stream.desc;
+	vid_fourcc = vid_desc->drm_fourcc;
+	compute_plane_layout(vid_desc);
+}
 
-	// Queue and export
-	for (int b=0; b<vid_num_buffers; ++b)
-	{
-		// Queue
-		struct v4l2_buffer* buf = vid_buffers + b;
-		memset(buf, 0, sizeof(struct v4l2_buffer));
-		buf->type = vid_buffer_type;
-		buf->memory = memory_access_type;
-		buf->index = b;
-		if (xioctl(vid_fd, VIDIOC_QUERYBUF, buf) < 0)
-		{
-			fprintf(stderr, "VIDIOC_QUERYBUF failed: %s\n", strerror(errno));
-			close(vid_fd);
-			return 0;
-		}
-		fprintf(stderr, "buffer %d has type 0x%x size %u and offset %08x\n", b, buf->type, buf->length, buf->m.offset);
 
-		if (vid_num_planes > 1)
-		{
-			fprintf(stderr, "vid_num_planes: %d\n", vid_num_planes);
-			buf->length = VIDEO_MAX_PLANES;
-			buf->m.planes = vid_planes[b];
-		}
-		if (xioctl(vid_fd, VIDIOC_QBUF, buf) < 0)
-		{
-			fprintf(stderr, "VIDIOC_QBUF failed for buffer %d: %s\n", b, strerror(errno));
-			close(vid_fd);
-			return -1;
-		}
+// Prefer a pixelformat that the compositor can scan out, then one it takes without conversion.
+// Any other we know, we can convert ourselves. V4L2 buffers are linear, so only the LINEAR modifier counts.
+static int rank_format(uint32_t drm_fourcc)
+{
+	const int flags = dmabuf_caps_flags(compositor_caps(), drm_fourcc, DRM_FORMAT_MOD_LINEAR);
+	if (flags < 0)
+		return 1;
+	return (flags & DMABUF_CAPS_SCANOUT) ? 3 : 2;
+}
 
-		// Export the dma buffers of the video device.
-		struct v4l2_exportbuffer exp;
-		memset(&exp, 0, sizeof(exp));
-		for (int p=0; p<vid_num_planes; ++p)
-		{
-			exp.type = vid_buffer_type;
-			exp.index = b;
-			exp.plane = p;
-			if (xioctl(vid_fd, VIDIOC_EXPBUF, &exp) < 0)
-			{
-				fprintf
-				(
-					stderr,
-					"VIDIOC_EXPBUF failed for buffer %d, plane %d: %s\n",
-					b, p, strerror(errno)
-				);
-				close(vid_fd);
-				return -1;
-			}
-			vid_dma_fds[b][p] = exp.fd;
-			fprintf(stderr, "Buffer %d plane %d uses fd %d\n", b, p, vid_dma_fds[b][p]);
-		}
-	}
-	fprintf(stderr, "Exported %d dma buffers from video device.\n", vid_num_buffers * vid_num_planes);
+
+// rank_format() reads the caps tables, which the main thread fills while it dispatches. The video setup thread
+// uses this copy of its ranks instead, taken on the main thread before it starts.
+static const uint32_t		setup_formats[] = { DRM_FORMAT_NV12, DRM_FORMAT_NV16, DRM_FORMAT_YUV420, DRM_FORMAT_YUYV, DRM_FORMAT_UYVY };
+static int			setup_ranks[sizeof(setup_formats) / sizeof(setup_formats[0])];
+
+
+static void snapshot_ranks(void)
+{
+	for (size_t i=0; i<sizeof(setup_formats)/sizeof(setup_formats[0]); ++i)
+		setup_ranks[i] = rank_format(setup_formats[i]);
+}
+
+
+static int rank_snapshot(uint32_t drm_fourcc)
+{
+	for (size_t i=0; i<sizeof(setup_formats)/sizeof(setup_formats[0]); ++i)
+		if (setup_formats[i] == drm_fourcc)
+			return setup_ranks[i];
+	return 1;
+}
+
+
+// With a required format there is nothing to rank, and any format we know, we can present.
+static int v4l2_open(const char* devname, uint32_t required_format)
+{
+	if (v4l2_stream_open(&vid_stream, devname, required_format, required_format ? 0 : rank_snapshot) < 0)
+		return -1;
+	vid_fd = vid_stream.fd;
+	v4l2_take_format();
 	return 0;
 }
 
-// dmabuf code
 
-void create_dma_buffer(int buf_nr, int plane_nr)
+static int v4l2_reset_format(uint32_t pixelformat)
 {
-	const int fd = vid_dma_fds[buf_nr][plane_nr];
-	struct zwp_linux_buffer_params_v1* params = 0;
-	uint64_t modifier = 0;
-	params = zwp_linux_dmabuf_v1_create_params(dmabuf);
-	for (int i=0; i<vid_num_planes; ++i)
-	{
-		int stride = vid_strides[0];
-		int offset = 0;
-		fprintf(stderr, "adding parameter fd=%d plane=%d offset=%d stride=%d\n", fd, i, offset, stride);
-		zwp_linux_buffer_params_v1_add
-		(
-			params,
-			fd,
-			i,
-			offset,
-			stride,
-			modifier >> 32,
-			modifier & 0xffffffff
-		);
-	}
-	if (zwp_linux_buffer_params_v1_add_listener(params, &params_create_listener, 0) < 0)
-		fprintf(stderr, "Failed to add linux buffer params listener.\n");
-	uint32_t flags = 0;
-	zwp_linux_buffer_params_v1_create
-	(
-		params,
-		vid_resolution[0],
-		vid_resolution[1],
-		vid_fourcc,
-		flags
-	);
+	if (v4l2_stream_reset_format(&vid_stream, pixelformat) < 0)
+		return -1;
+	v4l2_take_format();
+	return 0;
 }
 
 
-static void create_dma_buffers(void)
+static uint32_t v4l2_best_format(void)
 {
-	for (int b=0; b<vid_num_buffers; ++b)
-		for (int p=0; p<vid_num_planes; ++p)
-			create_dma_buffer(b, p);
+	const uint32_t best = v4l2_stream_best_format(&vid_stream, rank_format);
+	const struct vid_format_desc* desc = vid_format_find(best);
+	if (!desc || desc == vid_desc || rank_format(desc->drm_fourcc) <= rank_format(vid_fourcc))
+		return 0;
+	return best;
 }
 
-// OpenGL ES code
 
-static EGLBoolean CreateEGLContext ()
+// Allocate the ring, queue all of it, and start capturing.
+static int v4l2_start(int depth, int max_depth)
+{
+	if (v4l2_stream_start(&vid_stream, depth, vid_import ? &dma_alloc : 0) < 0)
+	{
+		v4l2_stream_stop(&vid_stream);
+		return -1;
+	}
+	// Buffers of our own may have changed the pitch.
+	v4l2_take_format();
+	ring_add_stream_slots(0, vid_stream.num_buffers);
+	vid_ring.max_count = max_depth > vid_ring.count ? max_depth : vid_ring.count;
+	if (vid_ring.max_count > VIDEO_MAX_FRAME)
+		vid_ring.max_count = VIDEO_MAX_FRAME;
+	return 0;
+}
+
+
+// Stop capturing, and give all buffers back to the driver.
+static void v4l2_stop(void)
+{
+	ring_free_slots(0);
+	v4l2_stream_stop(&vid_stream);
+}
+
+
+// Take the next captured frame from the device, and return its buffer index, or -1 if none is ready.
+static int v4l2_dequeue(void)
+{
+	const int index = v4l2_stream_next(&vid_stream);
+	if (index < 0)
+		return -1;
+	vid_in_driver--;
+	const struct v4l2_buffer* buf = &vid_stream.buffers[index].buf;
+	struct vid_slot* slot = vid_ring.slots[index];
+	slot->buf.timestamp = buf->timestamp;
+	slot->buf.sequence = buf->sequence;
+	slot->dequeue_ns = frame_stats_now();
+	// Only a monotonic capture timestamp can be compared with our clock.
+	if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		slot->capture_ns = (uint64_t)buf->timestamp.tv_sec * 1000000000ull + (uint64_t)buf->timestamp.tv_usec * 1000ull;
+	else
+		slot->capture_ns = 0;
+	return index;
+}
+
+
+// Queue a buffer to the capture device, so that it can be filled again.
+static void v4l2_queue(int buf_nr)
+{
+	if (v4l2_stream_queue(&vid_stream, buf_nr) == 0)
+		vid_in_driver++;
+}
+
+
+static int v4l2_grow(void)
+{
+	const int index = v4l2_stream_grow(&vid_stream);
+	if (index >= 0)
+		ring_add_stream_slots(index, 1);
+	return index;
+}
+
+
+static int v4l2_source_changed(void)
+{
+	return v4l2_stream_source_changed(&vid_stream);
+}
+
+
+static void v4l2_close(void)
+{
+	v4l2_stream_close(&vid_stream);
+	vid_fd = -1;
+}
+
+
+static const struct capture_source capture_v4l2 =
+{
+	.name           = "V4L2",
+	.open           = v4l2_open,
+	.reset_format   = v4l2_reset_format,
+	.best_format    = v4l2_best_format,
+	.start          = v4l2_start,
+	.stop           = v4l2_stop,
+	.dequeue        = v4l2_dequeue,
+	.queue          = v4l2_queue,
+	.grow           = v4l2_grow,
+	.source_changed = v4l2_source_changed,
+	.close          = v4l2_close,
+};
+
+
+// File capture source: raw frames of a single memory plane, at the resolution given with -s.
+
+static int file_open(const char* path, uint32_t required_format)
+{
+	if (!required_format)
+		required_format = V4L2_PIX_FMT_NV12;
+	const struct vid_format_desc* desc = vid_format_find(required_format);
+	if (!desc || desc->mem_planes != 1)
+	{
+		fprintf(stderr, "A file source needs a single-plane format, such as NV12 or YUYV.\n");
+		return -1;
+	}
+	if (!file_resolution[0] || !file_resolution[1])
+	{
+		fprintf(stderr, "A file source needs its resolution, given with -s.\n");
+		return -1;
+	}
+
+	// Pretend to be a single-planar V4L2 device, so that the plane layout comes out the same.
+	vid_buffer_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	vid_memory = V4L2_MEMORY_MMAP;
+	memset(&vid_format, 0, sizeof(vid_format));
+	vid_format.type = vid_buffer_type;
+	vid_format.fmt.pix.width = file_resolution[0];
+	vid_format.fmt.pix.height = file_resolution[1];
+	vid_format.fmt.pix.pixelformat = required_format;
+	// Packed 4:2:2 formats (one colour plane) have 2 bytes per pixel, the planar ones have 1 byte of luma.
+	vid_format.fmt.pix.bytesperline = file_resolution[0] * (desc->num_planes == 1 ? 2 : 1);
+	vid_resolution[0] = file_resolution[0];
+	vid_resolution[1] = file_resolution[1];
+	vid_num_planes = 1;
+	vid_fourcc = desc->drm_fourcc;
+	vid_desc = desc;
+	const uint32_t frame_size = compute_plane_layout(desc);
+	vid_format.fmt.pix.sizeimage = frame_size;
+
+	if (capture_file_open(&capture_file, path, frame_size, file_fps) < 0)
+		return -1;
+	vid_fd = capture_file.timer_fd;
+	return 0;
+}
+
+
+static int file_reset_format(uint32_t pixelformat)
+{
+	(void)pixelformat;
+	return 0;
+}
+
+
+static int file_start(int depth, int max_depth)
+{
+	(void)max_depth;
+	if (depth <= 0)
+		depth = 1 + DEFAULT_EXTRA_BUFFERS;
+	int dma_fds[CAPTURE_FILE_MAX_BUFFERS];
+	const int count = capture_file_alloc(&capture_file, depth, dma_fds);
+	if (count < 0)
+	{
+		capture_file_free(&capture_file);
+		return -1;
+	}
+	vid_ring.max_count = count;
+	for (int b=0; b<count; ++b)
+	{
+		struct vid_slot* slot = calloc(1, sizeof(struct vid_slot));
+		assert(slot);
+		slot->buf.index = b;
+		slot->dma_fds[0] = dma_fds[b];
+		slot->release_fd = -1;
+		vid_ring.slots[b] = slot;
+	}
+	vid_ring.count = count;
+	vid_in_driver = count;
+	fprintf(stderr, "Created %d udmabuf buffers for the file source.\n", count);
+	return 0;
+}
+
+
+static void file_stop(void)
+{
+	ring_free_slots(1);
+	capture_file_free(&capture_file);
+}
+
+
+static int file_dequeue(void)
+{
+	uint32_t sequence;
+	const int index = capture_file_dequeue(&capture_file, &sequence);
+	if (index < 0)
+		return -1;
+	vid_in_driver--;
+	struct vid_slot* slot = vid_ring.slots[index];
+	slot->buf.sequence = sequence;
+	slot->dequeue_ns = frame_stats_now();
+	slot->capture_ns = slot->dequeue_ns;	// Synthetic frames are captured when we take them.
+	return index;
+}
+
+
+static void file_queue(int buf_nr)
+{
+	capture_file_queue(&capture_file, buf_nr);
+	vid_in_driver++;
+}
+
+
+static void file_close(void)
+{
+	capture_file_close(&capture_file);
+	vid_fd = -1;
+}
+
+
+static const struct capture_source capture_from_file =
+{
+	.name           = "file",
+	.open           = file_open,
+	.reset_format   = file_reset_format,
+	.best_format    = 0,
+	.start          = file_start,
+	.stop           = file_stop,
+	.dequeue        = file_dequeue,
+	.queue          = file_queue,
+	.grow           = 0,
+	.source_changed = 0,
+	.close          = file_close,
+};
+
+
+// Open a capture source: a regular file is played back, anything else is taken to be a V4L2 device.
+static int setup_video(const char* path, uint32_t required_format, int depth, int max_depth)
+{
+	struct stat st;
+	capture = stat(path, &st) == 0 && S_ISREG(st.st_mode) ? &capture_from_file : &capture_v4l2;
+	fprintf(stderr, "Capturing from %s source %s.\n", capture->name, path);
+	if (capture->open(path, required_format) < 0)
+		return -1;
+	vid_depth = depth;
+	vid_max_depth = max_depth;
+	if (capture->start(depth, max_depth) < 0)
+	{
+		capture->close();
+		return -1;
+	}
+	return 0;
+}
+
+
+// During startup, the capture source is set up on a thread of its own, while we wait on the compositor.
+// Until it is joined, the main thread keeps its hands off the video state, and the thread off the Wayland state.
+
+struct video_setup
+{
+	const char*	path;
+	uint32_t	required_format;
+	int		depth;
+	int		max_depth;
+	int		result;
+	pthread_t	thread;
+	int		threaded;
+};
+
+static struct video_setup	video_setup;
+
+
+static void* video_setup_main(void* arg)
+{
+	struct video_setup* vs = arg;
+	vs->result = setup_video(vs->path, vs->required_format, vs->depth, vs->max_depth);
+	startup_trace_mark("capture source started");
+	return 0;
+}
+
+
+static void start_video_setup(const char* path, uint32_t required_format, int depth, int max_depth)
+{
+	video_setup.path = path;
+	video_setup.required_format = required_format;
+	video_setup.depth = depth;
+	video_setup.max_depth = max_depth;
+	video_setup.threaded = pthread_create(&video_setup.thread, 0, video_setup_main, &video_setup) == 0;
+	if (!video_setup.threaded)
+		video_setup_main(&video_setup);
+}
+
+
+static int finish_video_setup(void)
+{
+	if (video_setup.threaded)
+		pthread_join(video_setup.thread, 0);
+	video_setup.threaded = 0;
+	return video_setup.result;
+}
+
+
+static void signal_fd(int fd)
+{
+	const uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) != sizeof(one))
+		fprintf(stderr, "eventfd write failed: %s\n", strerror(errno));
+}
+
+
+static void drain_fd(int fd)
+{
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "eventfd read failed: %s\n", strerror(errno));
+}
+
+
+// Hand a buffer back to the capture device: directly, or via the capture thread if that runs.
+static void requeue_buffer(int buf_nr)
+{
+	if (!capture_running)
+	{
+		capture->queue(buf_nr);
+		return;
+	}
+	// Never full: each buffer index is in the queue at most once.
+	frame_queue_push(&capture_returns, buf_nr);
+	signal_fd(return_efd);
+}
+
+
+// The capture thread: dequeue frames as soon as they are ready, regardless of how busy the compositor keeps us.
+static void* capture_main(void* arg)
+{
+	(void)arg;
+	while (!atomic_load(&capture_stop))
+	{
+		// With nothing queued, polling the device would report an error: only wait for returned buffers then.
+		struct pollfd fds[2] =
+		{
+			{ .fd = return_efd,                          .events = POLLIN },
+			{ .fd = vid_in_driver > 0 ? vid_fd : -1,     .events = POLLIN },
+		};
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Capture thread poll failed: %s\n", strerror(errno));
+			break;
+		}
+		if (fds[1].revents & (POLLERR | POLLHUP))
+		{
+			fprintf(stderr, "Capture device reported an error, or went away.\n");
+			break;
+		}
+		if (fds[0].revents & POLLIN)
+			drain_fd(return_efd);
+
+		int buf_nr;
+		while ((buf_nr = frame_queue_pop(&capture_returns)) >= 0)
+			capture->queue(buf_nr);
+
+		while ((buf_nr = capture->dequeue()) >= 0)
+		{
+			// Latest wins: a frame the main thread did not get to yet goes straight back to the device.
+			const int displaced = frame_mailbox_post(&capture_mailbox, buf_nr);
+			if (displaced >= 0)
+				capture->queue(displaced);
+			else
+				signal_fd(frame_efd);
+		}
+	}
+	return 0;
+}
+
+
+static int start_capture_thread(void)
+{
+	atomic_store(&capture_stop, 0);
+	// SIGUSR1 is for the main thread: the capture thread inherits a mask that blocks it.
+	sigset_t mask, old_mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	const int err = pthread_create(&capture_thread, 0, capture_main, 0);
+	pthread_sigmask(SIG_SETMASK, &old_mask, 0);
+	if (err != 0)
+	{
+		fprintf(stderr, "Failed to start the capture thread.\n");
+		return 0;
+	}
+	capture_running = 1;
+	return 1;
+}
+
+
+// Stop the capture thread, and finish its handoffs on the main thread.
+static void stop_capture_thread(void)
+{
+	if (!capture_running)
+		return;
+	atomic_store(&capture_stop, 1);
+	signal_fd(return_efd);
+	pthread_join(capture_thread, 0);
+	capture_running = 0;
+
+	int buf_nr;
+	while ((buf_nr = frame_queue_pop(&capture_returns)) >= 0)
+		capture->queue(buf_nr);
+	if ((buf_nr = frame_mailbox_take(&capture_mailbox)) >= 0)
+		capture->queue(buf_nr);
+}
+
+
+// dmabuf code
+
+// Make the wl_buffer for a capture buffer, unless the cache already has it.
+static void create_dma_buffer(int buf_nr)
+{
+	struct buffer_cache_entry* entry = buffer_cache + buf_nr;
+	if (entry->wl_buffer && buffer_cache_matches(entry))
+		return;
+	buffer_cache_drop(entry);
+
+	const struct vid_slot* slot = vid_ring.slots[buf_nr];
+	struct zwp_linux_buffer_params_v1* params = 0;
+	const uint64_t modifier = vid_modifier;
+	params = zwp_linux_dmabuf_v1_create_params(dmabuf);
+	for (int i=0; i<vid_num_color_planes; ++i)
+	{
+		const struct vid_plane_layout* layout = vid_layout + i;
+		const int fd = slot->dma_fds[layout->mem_plane];
+		fprintf(stderr, "adding parameter fd=%d plane=%d offset=%u stride=%u\n", fd, i, layout->offset, layout->stride);
+		zwp_linux_buffer_params_v1_add
+		(
+			params,
+			fd,
+			i,
+			layout->offset,
+			layout->stride,
+			modifier >> 32,
+			modifier & 0xffffffff
+		);
+	}
+	if (zwp_linux_buffer_params_v1_add_listener(params, &params_create_listener, entry) < 0)
+		fprintf(stderr, "Failed to add linux buffer params listener.\n");
+	uint32_t flags = 0;
+	// The wl_buffer is usable straight away: no need to wait for a 'created' event.
+	entry->wl_buffer = zwp_linux_buffer_params_v1_create_immed
+	(
+		params,
+		vid_resolution[0],
+		vid_resolution[1],
+		vid_fourcc,
+		flags
+	);
+	wl_buffer_add_listener(entry->wl_buffer, &buffer_listener, (void*)(intptr_t)buf_nr);
+	entry->params = params;
+	entry->format = vid_fourcc;
+	entry->modifier = modifier;
+	entry->width = vid_resolution[0];
+	entry->height = vid_resolution[1];
+}
+
+
+// Create wl_buffers for the ring slots [first, first+count), and check that the compositor accepted them.
+static int create_dma_buffers(int first, int count)
+{
+	for (int b=first; b<first+count; ++b)
+		create_dma_buffer(b);
+
+	// A rejected buffer shows up as a 'failed' event on its params.
+	wl_display_roundtrip(native_dpy);
+	for (int b=first; b<first+count; ++b)
+	{
+		struct buffer_cache_entry* entry = buffer_cache + b;
+		if (entry->params)
+		{
+			zwp_linux_buffer_params_v1_destroy(entry->params);
+			entry->params = 0;
+		}
+	}
+	if (buffer_cache_failed)
+		return 0;
+	for (int b=first; b<first+count; ++b)
+		if (!buffer_cache_lookup(b))
+			return 0;
+	return 1;
+}
+
+
+// A sync after the wl_buffer of a grown slot: by now, the compositor has told us whether it takes it.
+static void grown_buffer_checked(void* data, struct wl_callback* callback, uint32_t time)
+{
+	(void)time;
+	wl_callback_destroy(callback);
+	struct buffer_cache_entry* entry = data;
+	entry->check = 0;
+	if (entry->params)
+	{
+		zwp_linux_buffer_params_v1_destroy(entry->params);
+		entry->params = 0;
+	}
+	if (entry->failed)
+		fprintf(stderr, "The compositor does not take grown buffer %d: it stays with the device.\n", (int)(entry - buffer_cache));
+}
+
+static const struct wl_callback_listener grown_buffer_listener =
+{
+	.done = grown_buffer_checked,
+};
+
+
+// Grow the ring by one buffer while streaming, when the compositor holds on to all the others.
+// This happens mid-stream, so there is no roundtrip: the new slot is presented once a sync says the compositor took it.
+static int ring_grow(void)
+{
+	if (vid_ring.count >= vid_ring.max_count || !capture->grow)
+		return 0;
+	const int first = capture->grow();
+	if (first < 0)
+	{
+		vid_ring.max_count = vid_ring.count; // Don't try again.
+		return 0;
+	}
+	create_dma_buffer(first);
+	struct buffer_cache_entry* entry = buffer_cache + first;
+	entry->check = wl_display_sync(native_dpy);
+	wl_callback_add_listener(entry->check, &grown_buffer_listener, entry);
+	fprintf(stderr, "Grew the buffer ring to %d buffers.\n", vid_ring.count);
+	return 1;
+}
+
+
+// Show a captured frame by handing its buffer to the compositor, without copying.
+static void present_frame(int buf_nr)
+{
+	struct wl_buffer* buffer = buffer_cache_lookup(buf_nr);
+	if (!buffer)
+	{
+		// The compositor never accepted this one.
+		requeue_buffer(buf_nr);
+		return;
+	}
+	wl_surface_attach(surface, buffer, 0, 0);
+	wl_surface_damage(surface, 0, 0, INT32_MAX, INT32_MAX);
+	track_presentation(buf_nr);
+	// The whole frame is written at once, so the fences of the first memory plane cover all of it.
+	vid_ring.slots[buf_nr]->release_point = explicit_sync_commit(&explicit_sync, vid_ring.slots[buf_nr]->dma_fds[0]);
+	wl_surface_commit(surface);
+}
+
+// wl_shm fallback: without dmabuf or EGL import, we copy each frame into shared memory.
+// If the compositor takes our format in wl_shm buffers, the planes are copied as-is. Else YUYV is repacked to NV12,
+// which is half the size of XRGB, or YUYV and NV12 are converted to XRGB.
+
+static int setup_shm_path(void)
+{
+	if (!shm)
+		return 0;
+	if (shm_pool.num_buffers)
+		return 1;
+	const int32_t w = vid_resolution[0];
+	const int32_t h = vid_resolution[1];
+	size_t size;
+	if (dmabuf_caps_has(&shm_caps, vid_fourcc, DRM_FORMAT_MOD_LINEAR))
+	{
+		// Same layout as the file source: packed 4:2:2 has 2 bytes per pixel, planar formats 1 byte of luma.
+		shm_format = vid_fourcc;
+		shm_stride = (w * (vid_desc->num_planes == 1 ? 2 : 1) + 31) & ~31;
+		size = (size_t)shm_stride * h;
+		for (int i=1; i<vid_desc->num_planes; ++i)
+			size += (size_t)(shm_stride / vid_desc->chroma_stride_div) * (h / vid_desc->vsub);
+	}
+	else if (vid_fourcc == DRM_FORMAT_YUYV && dmabuf_caps_has(&shm_caps, DRM_FORMAT_NV12, DRM_FORMAT_MOD_LINEAR))
+	{
+		shm_format = DRM_FORMAT_NV12;
+		shm_stride = (w + 31) & ~31;
+		size = (size_t)shm_stride * (h + (h + 1) / 2);
+	}
+	else if (vid_fourcc == DRM_FORMAT_YUYV || vid_fourcc == DRM_FORMAT_NV12)
+	{
+		shm_format = WL_SHM_FORMAT_XRGB8888;
+		shm_stride = w * 4;
+		size = (size_t)shm_stride * h;
+	}
+	else
+	{
+		fprintf(stderr, "Compositor takes neither our format, nor a format we can convert to, in wl_shm buffers.\n");
+		return 0;
+	}
+	if (shm_pool_init(&shm_pool, shm, 3, w, h, shm_stride, size, shm_format) < 0)
+		return 0;
+	fprintf
+	(
+		stderr,
+		"Copying frames into wl_shm buffers%s, with %s code.\n",
+		shm_format == vid_fourcc ? "" : shm_format == DRM_FORMAT_NV12 ? " as NV12" : " as XRGB",
+		pixel_convert_impl()
+	);
+	return 1;
+}
+
+
+// Where a memory plane of a capture buffer is, in our address space.
+static const uint8_t* map_plane(struct vid_slot* slot, int p)
+{
+	if (!slot->cpu_maps[p])
+	{
+		const off_t size = lseek(slot->dma_fds[p], 0, SEEK_END);
+		void* data = size > 0 ? mmap(0, size, PROT_READ, MAP_SHARED, slot->dma_fds[p], 0) : MAP_FAILED;
+		if (data == MAP_FAILED)
+		{
+			fprintf(stderr, "Cannot map buffer %d plane %d: %s\n", slot->buf.index, p, strerror(errno));
+			return 0;
+		}
+		slot->cpu_maps[p] = data;
+		slot->cpu_map_sizes[p] = size;
+	}
+	return slot->cpu_maps[p];
+}
+
+
+// Bracket CPU reads of a dmabuf, so that caches are kept coherent with the device that wrote it.
+static void sync_planes(struct vid_slot* slot, uint64_t flags)
+{
+	struct dma_buf_sync sync = { .flags = flags | DMA_BUF_SYNC_READ };
+	for (int p=0; p<vid_num_planes; ++p)
+		ioctl(slot->dma_fds[p], DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+
+// Show a captured frame by copying it into a free wl_shm buffer. The capture buffer can be requeued right after.
+// Returns 0 if the frame was skipped.
+static int present_shm_frame(int buf_nr)
+{
+	struct shm_pool_buffer* target = shm_pool_acquire(&shm_pool);
+	if (!target)
+	{
+		// The compositor holds all our buffers: we are producing faster than it shows them.
+		// Not counted here: the gap in sequence nrs at the next shown frame counts it as dropped.
+		return 0;
+	}
+	struct vid_slot* slot = vid_ring.slots[buf_nr];
+	const uint8_t* planes[4];
+	for (int i=0; i<vid_num_color_planes; ++i)
+	{
+		const uint8_t* base = map_plane(slot, vid_layout[i].mem_plane);
+		if (!base)
+		{
+			target->busy = 0;
+			return 0;
+		}
+		planes[i] = base + vid_layout[i].offset;
+	}
+
+	const int32_t w = vid_resolution[0];
+	const int32_t h = vid_resolution[1];
+	sync_planes(slot, DMA_BUF_SYNC_START);
+	if (shm_format == WL_SHM_FORMAT_XRGB8888 && vid_fourcc == DRM_FORMAT_NV12)
+		pixel_convert_nv12_to_xrgb(planes[0], vid_layout[0].stride, planes[1], vid_layout[1].stride, target->data, shm_stride, w, h);
+	else if (shm_format == WL_SHM_FORMAT_XRGB8888)
+		pixel_convert_yuyv_to_xrgb(planes[0], vid_layout[0].stride, target->data, shm_stride, w, h);
+	else if (shm_format != vid_fourcc)
+		pixel_convert_yuyv_to_nv12(planes[0], vid_layout[0].stride, target->data, shm_stride, target->data + (size_t)shm_stride * h, shm_stride, w, h);
+	else
+	{
+		uint8_t* dst = target->data;
+		for (int i=0; i<vid_num_color_planes; ++i)
+		{
+			// Colour planes after the first are the (subsampled) chroma planes.
+			const int div = i ? vid_desc->chroma_stride_div : 1;
+			const int rows = i ? h / vid_desc->vsub : h;
+			const int row_bytes = w * (vid_desc->num_planes == 1 ? 2 : 1) / div;
+			pixel_convert_copy_plane(planes[i], vid_layout[i].stride, dst, shm_stride / div, row_bytes, rows);
+			dst += (size_t)(shm_stride / div) * rows;
+		}
+	}
+	sync_planes(slot, DMA_BUF_SYNC_END);
+
+	wl_surface_attach(surface, target->wl_buffer, 0, 0);
+	wl_surface_damage(surface, 0, 0, INT32_MAX, INT32_MAX);
+	track_presentation(buf_nr);
+	wl_surface_commit(surface);
+	return 1;
+}
+
+
+// OpenGL ES code
+
+// Connect EGL to the display, and choose a config. This loads the GL driver, which takes a while:
+// when we know early on that we will need it, it runs on a thread of its own during startup.
+
+static EGLConfig		egl_config;
+static EGLBoolean		egl_display_ok;
+static pthread_t		egl_thread;
+static int			egl_threaded;
+
+
+static EGLBoolean init_egl_display(void)
 {
 	egl_dpy = eglGetDisplay(native_dpy);
 	if ( egl_dpy == EGL_NO_DISPLAY )
 	{
-		fprintf(stderr, "eglGetDisplay() returned EGL_NO_DISPLAY.\n");
-		return EGL_FALSE;
+		fprintf(stderr, "eglGetDisplay() returned EGL_NO_DISPLAY.\n");
+		return EGL_FALSE;
+	}
+
+	// Initialize EGL
+	EGLint majorVersion=0;
+	EGLint minorVersion=0;
+	if ( !eglInitialize(egl_dpy, &majorVersion, &minorVersion) )
+	{
+		fprintf(stderr,"eglInitialize() returned EGL_FALSE.\n");
+		return EGL_FALSE;
+	}
+
+	// Choose config: there is no need to list them all first.
+	EGLint numConfigs=0;
+	EGLint fbAttribs[] =
+	{
+		EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
+		EGL_RED_SIZE,        8,
+		EGL_GREEN_SIZE,      8,
+		EGL_BLUE_SIZE,       8,
+#if 0
+		EGL_SAMPLE_BUFFERS,  1,
+		EGL_SAMPLES,         4, // 4x MSAA
+#endif
+		EGL_NONE
+	};
+	// The config of an earlier run can be looked up by its ID, which is cheaper than matching all of them.
+	egl_config = gl_cache_load_config(egl_dpy, fbAttribs);
+	if (egl_config)
+		return EGL_TRUE;
+	const int chosen = eglChooseConfig(egl_dpy, fbAttribs, &egl_config, 1, &numConfigs);
+	if (chosen == EGL_FALSE)
+	{
+		fprintf(stderr, "eglChooseConfig() returned EGL_FALSE.\n");
+		return EGL_FALSE;
+	}
+	if (numConfigs<1)
+	{
+		fprintf(stderr, "eglChooseConfig() yielded %d configurations.\n", numConfigs);
+		return EGL_FALSE;
+	}
+	gl_cache_store_config(egl_dpy, fbAttribs, egl_config);
+	return EGL_TRUE;
+}
+
+
+static void* egl_init_main(void* arg)
+{
+	(void)arg;
+	egl_display_ok = init_egl_display();
+	startup_trace_mark("EGL initialized");
+	return 0;
+}
+
+
+static void start_egl_init(void)
+{
+	egl_threaded = pthread_create(&egl_thread, 0, egl_init_main, 0) == 0;
+}
+
+
+// Returns EGL_FALSE if EGL cannot be used.
+static EGLBoolean finish_egl_init(void)
+{
+	if (egl_threaded)
+		pthread_join(egl_thread, 0);
+	else if (!egl_dpy)
+		egl_init_main(0);
+	egl_threaded = 0;
+	return egl_display_ok;
+}
+
+
+// Give our surface to EGL: a native window on it, with an EGLSurface that our context (made once) draws into.
+static EGLBoolean CreateEGLContext ()
+{
+	if (!finish_egl_init())
+		return EGL_FALSE;
+
+	// Create a surface
+	native_win = wl_egl_window_create(surface, allocw, alloch);
+	assert(native_win != EGL_NO_SURFACE);
+	egl_srf = eglCreateWindowSurface(egl_dpy, egl_config, native_win, NULL);
+	if ( egl_srf == EGL_NO_SURFACE )
+	{
+		fprintf(stderr, "eglCreateWindowSurface() returned EGL_NO_SURFACE.\n");
+		egl_srf = 0;
+		return EGL_FALSE;
+	}
+
+	// Create a GL context
+	EGLint contextAttribs[] = { EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE, EGL_NONE };
+	if (!egl_ctx)
+		egl_ctx = eglCreateContext(egl_dpy, egl_config, EGL_NO_CONTEXT, contextAttribs );
+	if ( egl_ctx == EGL_NO_CONTEXT )
+	{
+		fprintf(stderr, "eglCreateContext() returned EGL_NO_CONTEXT.\n");
+		egl_ctx = 0;
+		return EGL_FALSE;
+	}
+
+	// Make the context current
+	if ( !eglMakeCurrent(egl_dpy, egl_srf, egl_srf, egl_ctx) )
+	{
+		fprintf(stderr, "eglMakeCurrent() returned EGL_FALSE.\n");
+		return EGL_FALSE;
+	}
+
+	return EGL_TRUE;
+}
+
+
+static void draw()
+{
+	static int16_t red=0x20, grn=0x70, blu=0xa0;
+	static int16_t dr=1, db=-1;
+
+	glClearColor(red / 255.0f, grn / 255.0f, blu / 255.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	red += dr;
+	blu += db;
+	if (red<0 || red>0xff) dr = -dr;
+	if (blu<0 || blu>0xff) db = -db;
+}
+
+
+// YUV to RGB conversion on the GPU, for when the compositor does not take our format.
+// Every plane of a capture buffer is imported as an EGLImage, and sampled as a texture.
+
+static PFNEGLCREATEIMAGEKHRPROC			egl_create_image;
+static PFNEGLDESTROYIMAGEKHRPROC		egl_destroy_image;
+static PFNGLEGLIMAGETARGETTEXTURE2DOESPROC	gl_image_target_texture;
+static GLuint					yuv_program;
+static GLint					yuv_layout_loc;
+
+// How the colour planes of a frame are mapped onto textures.
+enum yuv_layout
+{
+	YUV_SEMIPLANAR	= 0,	// Y in .r of texture 0, UV in .rg of texture 1.
+	YUV_PLANAR	= 1,	// Y, U, V in .r of textures 0, 1, 2.
+	YUV_YUYV	= 2,	// Y in .r of texture 0 (GR88), UV in .ga of texture 1 (ABGR8888 at half width).
+	YUV_UYVY	= 3,	// Y in .g of texture 0 (GR88), UV in .rb of texture 1 (ABGR8888 at half width).
+};
+
+struct yuv_texture_desc
+{
+	int		color_plane;
+	uint32_t	drm_format;
+	int		wdiv, hdiv;
+};
+
+static enum yuv_layout		yuv_layout;
+static struct yuv_texture_desc	yuv_textures[3];
+static int			yuv_num_textures;
+
+static const char* yuv_vertex_shader =
+	"#version 300 es\n"
+	"out vec2 uv;\n"
+	"void main()\n"
+	"{\n"
+	"	// A full screen triangle strip, without any vertex buffers.\n"
+	"	vec2 pos = vec2(float(gl_VertexID & 1), float(gl_VertexID >> 1));\n"
+	"	uv = vec2(pos.x, 1.0 - pos.y);\n"
+	"	gl_Position = vec4(2.0 * pos - 1.0, 0.0, 1.0);\n"
+	"}\n";
+
+static const char* yuv_fragment_shader =
+	"#version 300 es\n"
+	"precision highp float;\n"
+	"uniform sampler2D tex0;\n"
+	"uniform sampler2D tex1;\n"
+	"uniform sampler2D tex2;\n"
+	"uniform int plane_layout;\n"
+	"in vec2 uv;\n"
+	"out vec4 colour;\n"
+	"void main()\n"
+	"{\n"
+	"	vec3 yuv;\n"
+	"	if (plane_layout == 0)\n"
+	"		yuv = vec3(texture(tex0, uv).r, texture(tex1, uv).rg);\n"
+	"	else if (plane_layout == 1)\n"
+	"		yuv = vec3(texture(tex0, uv).r, texture(tex1, uv).r, texture(tex2, uv).r);\n"
+	"	else if (plane_layout == 2)\n"
+	"		yuv = vec3(texture(tex0, uv).r, texture(tex1, uv).ga);\n"
+	"	else\n"
+	"		yuv = vec3(texture(tex0, uv).g, texture(tex1, uv).rb);\n"
+	"	// BT.601, limited range.\n"
+	"	yuv -= vec3(16.0/255.0, 0.5, 0.5);\n"
+	"	yuv.x *= 255.0/219.0;\n"
+	"	colour = vec4\n"
+	"	(\n"
+	"		yuv.x + 1.596 * yuv.z,\n"
+	"		yuv.x - 0.392 * yuv.y - 0.813 * yuv.z,\n"
+	"		yuv.x + 2.017 * yuv.y,\n"
+	"		1.0\n"
+	"	);\n"
+	"}\n";
+
+
+static GLuint compile_shader(GLenum type, const char* source)
+{
+	const GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+	GLint compiled = 0;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+	if (!compiled)
+	{
+		char log[1024];
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		fprintf(stderr, "Shader compilation failed: %s\n", log);
+		glDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+
+static GLuint link_program(const char* vertex_source, const char* fragment_source)
+{
+	// A binary from an earlier run saves us the compiling and linking.
+	const GLuint cached = gl_cache_load_program(vertex_source, fragment_source);
+	if (cached)
+		return cached;
+	const GLuint vs = compile_shader(GL_VERTEX_SHADER, vertex_source);
+	const GLuint fs = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+	if (!vs || !fs)
+		return 0;
+	const GLuint program = glCreateProgram();
+	glAttachShader(program, vs);
+	glAttachShader(program, fs);
+	gl_cache_prepare_program(program);
+	glLinkProgram(program);
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked)
+	{
+		char log[1024];
+		glGetProgramInfoLog(program, sizeof(log), NULL, log);
+		fprintf(stderr, "Shader program link failed: %s\n", log);
+		glDeleteProgram(program);
+		return 0;
+	}
+	gl_cache_store_program(program, vertex_source, fragment_source);
+	return program;
+}
+
+
+// Decide how the planes of our capture format are imported as textures.
+static int choose_yuv_layout(void)
+{
+	const struct yuv_texture_desc y8 = { 0, DRM_FORMAT_R8, 1, 1 };
+	switch (vid_fourcc)
+	{
+		case DRM_FORMAT_NV12:
+		case DRM_FORMAT_NV16:
+			yuv_layout = YUV_SEMIPLANAR;
+			yuv_textures[0] = y8;
+			yuv_textures[1] = (struct yuv_texture_desc) { 1, DRM_FORMAT_GR88, 2, vid_fourcc == DRM_FORMAT_NV12 ? 2 : 1 };
+			yuv_num_textures = 2;
+			return 1;
+		case DRM_FORMAT_YUV420:
+			yuv_layout = YUV_PLANAR;
+			yuv_textures[0] = y8;
+			yuv_textures[1] = (struct yuv_texture_desc) { 1, DRM_FORMAT_R8, 2, 2 };
+			yuv_textures[2] = (struct yuv_texture_desc) { 2, DRM_FORMAT_R8, 2, 2 };
+			yuv_num_textures = 3;
+			return 1;
+		case DRM_FORMAT_YUYV:
+		case DRM_FORMAT_UYVY:
+			// The same packed plane is sampled twice: per pixel for luma, per pixel pair for chroma.
+			yuv_layout = vid_fourcc == DRM_FORMAT_YUYV ? YUV_YUYV : YUV_UYVY;
+			yuv_textures[0] = (struct yuv_texture_desc) { 0, DRM_FORMAT_GR88, 1, 1 };
+			yuv_textures[1] = (struct yuv_texture_desc) { 0, DRM_FORMAT_ABGR8888, 2, 1 };
+			yuv_num_textures = 2;
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+
+// Wrap the planes of one capture buffer in EGLImages, and bind those to textures.
+static int import_egl_images(struct vid_slot* slot)
+{
+	glGenTextures(yuv_num_textures, slot->textures);
+	for (int t=0; t<yuv_num_textures; ++t)
+	{
+		const struct yuv_texture_desc* desc = yuv_textures + t;
+		const struct vid_plane_layout* layout = vid_layout + desc->color_plane;
+		const EGLint attribs[] =
+		{
+			EGL_WIDTH,				(EGLint) (vid_resolution[0] / desc->wdiv),
+			EGL_HEIGHT,				(EGLint) (vid_resolution[1] / desc->hdiv),
+			EGL_LINUX_DRM_FOURCC_EXT,		(EGLint) desc->drm_format,
+			EGL_DMA_BUF_PLANE0_FD_EXT,		slot->dma_fds[layout->mem_plane],
+			EGL_DMA_BUF_PLANE0_OFFSET_EXT,		(EGLint) layout->offset,
+			EGL_DMA_BUF_PLANE0_PITCH_EXT,		(EGLint) layout->stride,
+			EGL_NONE
+		};
+		slot->images[t] = egl_create_image(egl_dpy, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+		if (slot->images[t] == EGL_NO_IMAGE_KHR)
+		{
+			fprintf(stderr, "eglCreateImageKHR() failed for plane %d with error 0x%x.\n", desc->color_plane, eglGetError());
+			return 0;
+		}
+		glBindTexture(GL_TEXTURE_2D, slot->textures[t]);
+		gl_image_target_texture(GL_TEXTURE_2D, slot->images[t]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	return 1;
+}
+
+
+// Get everything ready to convert frames on the GPU. Needs a current GLES3 context.
+static int setup_yuv_shader(void)
+{
+	const char* extensions = eglQueryString(egl_dpy, EGL_EXTENSIONS);
+	if (!extensions || !strstr(extensions, "EGL_EXT_image_dma_buf_import"))
+	{
+		fprintf(stderr, "EGL cannot import dma buffers.\n");
+		return 0;
+	}
+	if (!choose_yuv_layout())
+	{
+		fprintf(stderr, "No shader conversion for this pixelformat.\n");
+		return 0;
+	}
+	egl_create_image = (PFNEGLCREATEIMAGEKHRPROC) eglGetProcAddress("eglCreateImageKHR");
+	egl_destroy_image = (PFNEGLDESTROYIMAGEKHRPROC) eglGetProcAddress("eglDestroyImageKHR");
+	gl_image_target_texture = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC) eglGetProcAddress("glEGLImageTargetTexture2DOES");
+	if (!egl_create_image || !egl_destroy_image || !gl_image_target_texture)
+		return 0;
+
+	yuv_program = link_program(yuv_vertex_shader, yuv_fragment_shader);
+	if (!yuv_program)
+		return 0;
+	glUseProgram(yuv_program);
+	glUniform1i(glGetUniformLocation(yuv_program, "tex0"), 0);
+	glUniform1i(glGetUniformLocation(yuv_program, "tex1"), 1);
+	glUniform1i(glGetUniformLocation(yuv_program, "tex2"), 2);
+	yuv_layout_loc = glGetUniformLocation(yuv_program, "plane_layout");
+	glUniform1i(yuv_layout_loc, yuv_layout);
+
+	for (int b=0; b<vid_ring.count; ++b)
+		if (!import_egl_images(vid_ring.slots[b]))
+			return 0;
+	return 1;
+}
+
+
+// Convert a captured frame to RGB in our window.
+static void draw_frame(int buf_nr)
+{
+	const struct vid_slot* slot = vid_ring.slots[buf_nr];
+	if (!slot->images[0])
+	{
+		// Added to the ring after setup: import it now.
+		if (!import_egl_images(vid_ring.slots[buf_nr]))
+			return;
+	}
+	glViewport(0, 0, bufw, bufh);
+	for (int t=0; t<yuv_num_textures; ++t)
+	{
+		glActiveTexture(GL_TEXTURE0 + t);
+		glBindTexture(GL_TEXTURE_2D, slot->textures[t]);
+	}
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+
+// Let go of the EGLImages of all capture buffers, before the buffers themselves go.
+static void release_egl_images(void)
+{
+	for (int b=0; b<vid_ring.count; ++b)
+	{
+		struct vid_slot* slot = vid_ring.slots[b];
+		if (!slot->images[0])
+			continue;
+		for (int t=0; t<yuv_num_textures; ++t)
+			if (slot->images[t])
+			{
+				egl_destroy_image(egl_dpy, slot->images[t]);
+				slot->images[t] = 0;
+			}
+		glDeleteTextures(yuv_num_textures, slot->textures);
+	}
+}
+
+
+static void cleanup_yuv_shader(void)
+{
+	release_egl_images();
+	if (yuv_program)
+		glDeleteProgram(yuv_program);
+	yuv_program = 0;
+}
+
+
+// Take our surface back from EGL, for a path that attaches its own wl_buffers: the two must never both attach to it.
+// The context stays, but our GL state goes with the surface.
+static void destroy_egl_surface(void)
+{
+	if (egl_srf)
+	{
+		cleanup_yuv_shader();
+		eglMakeCurrent(egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroySurface(egl_dpy, egl_srf);
+		egl_srf = 0;
+	}
+	if (native_win)
+	{
+		wl_egl_window_destroy(native_win);
+		native_win = 0;
+	}
+}
+
+
+// The compositor or EGL would not import the dmabufs of our own (-i), e.g. because the heap gave us scattered pages.
+// Have the device capture into buffers of its own, and export those instead. Returns 0 if there is nothing to fall back to.
+static int fall_back_to_mmap(void)
+{
+	if (vid_memory != V4L2_MEMORY_DMABUF)
+		return 0;
+	fprintf(stderr, "Our own dmabufs cannot be imported: capturing into buffers of the device instead.\n");
+	const int threaded = capture_running;
+	stop_capture_thread();
+	release_egl_images();
+	buffer_cache_invalidate();
+	vid_shown = -1;
+	capture->stop();
+	vid_import = 0;
+	if (capture->start(vid_depth, vid_max_depth) < 0)
+	{
+		fprintf(stderr, "Cannot restart capture with buffers of the device.\n");
+		done = 1;
+		return 0;
+	}
+	if (threaded)
+		start_capture_thread();
+	return 1;
+}
+
+
+// Make wl_buffers for the whole ring, falling back to the buffers of the device if the compositor rejects ours.
+static int create_ring_buffers(void)
+{
+	if (create_dma_buffers(0, vid_ring.count))
+		return 1;
+	return fall_back_to_mmap() && create_dma_buffers(0, vid_ring.count);
+}
+
+
+// Wayland helper funcs.
+
+static int connect_to_wayland()
+{
+	native_dpy = wl_display_connect(0);
+	if (!native_dpy)
+	{
+		fprintf(stderr, "wl_display_connect(0) return 0.\n");
+		exit(1);
+	}
+
+	struct wl_registry *wl_registry = wl_display_get_registry(native_dpy);
+	void* data = 0;
+	wl_registry_add_listener(wl_registry, &registry_listener, data);
+	wl_display_dispatch(native_dpy);
+	wl_display_roundtrip(native_dpy);
+
+	dmabuf_caps_print(compositor_caps(), stderr);
+
+	if (!compositor)
+		fprintf(stderr, "Wayland server did not provide us with a compositor.\n");
+	if (!wm_base)
+		fprintf(stderr, "Wayland server did not provide us with a WM Base.\n");
+	return (compositor && wm_base) ? 1 : 0;
+}
+
+
+// Create a timer that fires at the given rate, to pace drawing when there is no video to wait on.
+static int create_timer(int hz)
+{
+	const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+	{
+		fprintf(stderr, "timerfd_create() failed: %s\n", strerror(errno));
+		return -1;
+	}
+	// Periods of a second or more do not fit in tv_nsec.
+	const long long period = 1000000000LL / hz;
+	const struct timespec interval = { .tv_sec = period / 1000000000LL, .tv_nsec = period % 1000000000LL };
+	const struct itimerspec spec = { .it_interval = interval, .it_value = interval };
+	if (timerfd_settime(fd, 0, &spec, NULL) < 0)
+	{
+		fprintf(stderr, "timerfd_settime() failed: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+// Block until the compositor, the capture device or the timer has something for us.
+// Wayland events are read and dispatched here, using the prepare_read/read_events protocol.
+// Video events (POLLPRI) are watched even when no buffer is queued.
+// Returns -1 when the connection to the compositor is lost.
+static int wait_for_events(int watch_video, int* video_ready, int* video_event, int* timer_ready)
+{
+	*video_ready = 0;
+	*video_event = 0;
+	*timer_ready = 0;
+
+	while (wl_display_prepare_read(native_dpy) != 0)
+		wl_display_dispatch_pending(native_dpy);
+
+	short wl_events = POLLIN;
+	if (wl_display_flush(native_dpy) < 0)
+	{
+		if (errno != EAGAIN)
+		{
+			wl_display_cancel_read(native_dpy);
+			return -1;
+		}
+		wl_events |= POLLOUT; // Socket is full: wake up when we can flush the rest.
+	}
+
+	// With a capture thread, frames come in through frame_efd instead of from the device.
+	// Released buffers that the compositor's GPU still reads from follow these.
+	struct pollfd fds[4 + VIDEO_MAX_FRAME] =
+	{
+		{ .fd = wl_display_get_fd(native_dpy), .events = wl_events },
+		{ .fd = vid_fd,                        .events = watch_video && !capture_running ? POLLIN | POLLPRI : POLLPRI },
+		{ .fd = timer_fd,                      .events = POLLIN },
+		{ .fd = capture_running ? frame_efd : -1, .events = POLLIN },
+	};
+	int releasing[VIDEO_MAX_FRAME];
+	int nfds = 4;
+	for (int b=0; b<vid_ring.count; ++b)
+		if (vid_ring.slots[b]->release_fd >= 0)
+		{
+			releasing[nfds-4] = b;
+			fds[nfds].fd = vid_ring.slots[b]->release_fd;
+			fds[nfds].events = POLLIN;
+			nfds++;
+		}
+	if (poll(fds, nfds, -1) < 0)
+	{
+		wl_display_cancel_read(native_dpy);
+		return errno == EINTR ? 0 : -1;
+	}
+
+	if (fds[0].revents & (POLLHUP | POLLERR))
+	{
+		// The compositor went away: poll() would keep returning this.
+		wl_display_cancel_read(native_dpy);
+		fprintf(stderr, "Lost the connection to the compositor.\n");
+		return -1;
+	}
+	if (fds[0].revents & POLLIN)
+	{
+		if (wl_display_read_events(native_dpy) < 0)
+			return -1;
+	}
+	else
+		wl_display_cancel_read(native_dpy);
+
+	*video_ready = (fds[1].revents & POLLIN) != 0;
+	if (fds[3].revents & POLLIN)
+	{
+		drain_fd(frame_efd);
+		*video_ready = 1;
+	}
+	*video_event = (fds[1].revents & POLLPRI) != 0;
+	if (fds[2].revents & POLLIN)
+	{
+		uint64_t expirations;
+		*timer_ready = read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations);
+	}
+	for (int i=4; i<nfds; ++i)
+		if (fds[i].revents)
+		{
+			struct vid_slot* slot = vid_ring.slots[releasing[i-4]];
+			close(slot->release_fd);
+			slot->release_fd = explicit_sync_release_retry(&explicit_sync, slot->release_point);
+			if (slot->release_fd < 0)
+				requeue_buffer(releasing[i-4]);
+		}
+
+	return wl_display_dispatch_pending(native_dpy) < 0 ? -1 : 0;
+}
+
+
+// Set up EGL and the YUV shader, to convert frames ourselves.
+static int setup_shader_path(void)
+{
+	if (!egl_srf)
+	{
+		// Create a native window, the size of the video, unless the compositor told us otherwise.
+		if (!compositor_sized)
+		{
+			winw = vid_resolution[0];
+			winh = vid_resolution[1];
+		}
+		apply_scale();
+
+		// To do the drawing, we need an OpenGLES context.
+		if (!CreateEGLContext())
+		{
+			destroy_egl_surface();
+			return 0;
+		}
+	}
+	if (!yuv_program && !setup_yuv_shader())
+	{
+		// With the shader linked, it was the import of our buffers that failed.
+		const int import_failed = yuv_program != 0;
+		cleanup_yuv_shader();
+		if (!import_failed || !fall_back_to_mmap() || !setup_yuv_shader())
+		{
+			// Whatever path we take instead, attaches to our surface itself.
+			destroy_egl_surface();
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+// New dmabuf feedback came in: switch between handing our buffers to the compositor and converting them.
+static void rechoose_present_path(void)
+{
+	const int flags = dmabuf_caps_flags(compositor_caps(), vid_fourcc, DRM_FORMAT_MOD_LINEAR);
+	if (flags >= 0)
+		fprintf(stderr, "Compositor takes our format, %s.\n", (flags & DMABUF_CAPS_SCANOUT) ? "for direct scanout" : "for composition");
+	else
+		fprintf(stderr, "Compositor no longer takes our format.\n");
+
+	if ((present_path == PRESENT_SHADER || present_path == PRESENT_SHM) && flags >= 0)
+	{
+		if (create_ring_buffers())
+		{
+			// Our next attach replaces the last EGL frame, and EGL must not attach anything after it.
+			destroy_egl_surface();
+			present_path = PRESENT_DMABUF;
+			explicit_sync_attach(&explicit_sync, surface);
+			apply_scale();
+			if (vid_shown >= 0)
+				requeue_buffer(vid_shown);
+			vid_shown = -1;
+			fprintf(stderr, "Switched to zero-copy presentation.\n");
+		}
+	}
+	else if (present_path == PRESENT_DMABUF && flags < 0)
+	{
+		// Buffers the compositor still holds come back with wl_buffer.release once EGL swaps, or our next attach.
+		if (setup_shader_path())
+		{
+			// EGL commits without our acquire and release points.
+			present_path = PRESENT_SHADER;
+			explicit_sync_detach(&explicit_sync);
+			apply_scale();
+			fprintf(stderr, "Switched to shader presentation.\n");
+		}
+		else if (setup_shm_path())
+		{
+			present_path = PRESENT_SHM;
+			explicit_sync_detach(&explicit_sync);
+			apply_scale();
+			fprintf(stderr, "Switched to wl_shm presentation.\n");
+		}
+	}
+}
+
+
+// The source changed format or resolution, or we switch to another pixelformat (0 to keep it): everything made
+// from the old buffers is stale. Drop the wl_buffer cache and EGLImages, reallocate the ring, and rebuild them for the new format.
+static int restart_video(uint32_t pixelformat)
+{
+	stop_capture_thread();
+	if (present_path == PRESENT_SHADER)
+		cleanup_yuv_shader();
+	shm_pool_fini(&shm_pool);
+	buffer_cache_invalidate();
+	vid_shown = -1;
+	capture->stop();
+
+	if (capture->reset_format(pixelformat) < 0 || capture->start(vid_depth, vid_max_depth) < 0)
+		return -1;
+	fprintf(stderr, "Restarted video at %dx%d.\n", vid_resolution[0], vid_resolution[1]);
+	if (capture_threaded && present_path != PRESENT_NONE && !start_capture_thread())
+		return -1;
+
+	if (present_path == PRESENT_DMABUF)
+	{
+		if (dmabuf_caps_has(compositor_caps(), vid_fourcc, DRM_FORMAT_MOD_LINEAR) && create_ring_buffers())
+			return 0;
+		present_path = PRESENT_SHADER;
+		explicit_sync_detach(&explicit_sync);
+	}
+	if (present_path == PRESENT_SHADER)
+	{
+		if (native_win)
+		{
+			if (!compositor_sized)
+			{
+				winw = vid_resolution[0];
+				winh = vid_resolution[1];
+			}
+			apply_scale();
+		}
+		// As at startup: without a shader, we convert on the CPU. A failed setup already gave up the EGL surface.
+		if (!setup_shader_path())
+			present_path = PRESENT_SHM;
+	}
+	if (present_path == PRESENT_SHM)
+	{
+		if (!setup_shm_path())
+		{
+			fprintf(stderr, "Cannot present the new video format.\n");
+			return -1;
+		}
+		apply_scale();
+	}
+	return 0;
+}
+
+
+static void cleanup_resources()
+{
+	stop_capture_thread();
+	if (egl_threaded)
+		finish_egl_init();
+	destroy_egl_surface();
+	shm_pool_fini(&shm_pool);
+	buffer_cache_invalidate();
+	capture->stop();
+	capture->close();
+	if (fractional_scale)
+		wp_fractional_scale_v1_destroy(fractional_scale);
+	fractional_scale = 0;
+	if (viewport)
+		wp_viewport_destroy(viewport);
+	viewport = 0;
+	xdg_toplevel_destroy(xdg_toplevel);
+	xdg_toplevel = 0;
+	xdg_surface_destroy(xdg_surface);
+	xdg_surface = 0;
+	explicit_sync_detach(&explicit_sync);
+	wl_surface_destroy(surface);
+	surface = 0;
+	if (egl_ctx)
+	{
+		eglDestroyContext(egl_dpy, egl_ctx);
+		egl_ctx = 0;
 	}
+}
 
-	// Initialize EGL
-	EGLint majorVersion=0;
-	EGLint minorVersion=0;
-	if ( !eglInitialize(egl_dpy, &majorVersion, &minorVersion) )
-	{
-		fprintf(stderr,"eglInitialize() returned EGL_FALSE.\n");
-		return EGL_FALSE;
-	}
 
-	// Get configs
-	EGLint numConfigs=0;
-	const EGLBoolean got_configs = eglGetConfigs(egl_dpy, NULL, 0, &numConfigs);
-	if (!got_configs)
+// Video wall: several capture devices at once, each on a subsurface of our window, laid out in a grid.
+// Every stream has its own state, and is presented zero-copy. The subsurfaces are synchronized: their new frames
+// only show with the next commit of our (background) surface, so frames that come in together go to screen together.
+
+#define WALL_MAX_TILES	16
+
+struct wall_tile;
+
+struct wall_buffer
+{
+	struct wall_tile*	tile;
+	int			index;
+	struct wl_buffer*	wl_buffer;
+	struct zwp_linux_buffer_params_v1*	params;	// Until we know the compositor took it.
+};
+
+struct wall_tile
+{
+	struct v4l2_stream	stream;
+	struct wl_surface*	surface;
+	struct wl_subsurface*	subsurface;
+	struct wp_viewport*	viewport;
+	struct wall_buffer	buffers[VIDEO_MAX_FRAME];
+	int			pending;	// The newest frame, until the wall may commit again, or -1.
+};
+
+static struct wall_tile		wall_tiles[WALL_MAX_TILES];
+static int			wall_num_tiles;
+static int			wall_failed;
+static struct wl_buffer*	wall_background;
+static struct wp_viewport*	wall_viewport;
+static struct wl_callback*	wall_frame_callback;	// Outstanding for our last commit: no new one until it is done.
+
+
+static void wall_frame_done(void* data, struct wl_callback* callback, uint32_t time)
+{
+	(void)time;
+	wl_callback_destroy(callback);
+	wall_frame_callback = 0;
+	// Only commits with new video count as frames.
+	if (data && ++bench.frames == bench_frames)
+		done = 1;
+}
+
+static const struct wl_callback_listener wall_frame_listener =
+{
+	.done = wall_frame_done,
+};
+
+
+static void wall_buffer_release(void* data, struct wl_buffer* buffer)
+{
+	(void)buffer;
+	// The compositor is done with this frame: the device can capture into it again.
+	struct wall_buffer* wb = data;
+	v4l2_stream_queue(&wb->tile->stream, wb->index);
+}
+
+static const struct wl_buffer_listener wall_buffer_listener =
+{
+	.release = wall_buffer_release,
+};
+
+
+static void wall_params_failed(void* data, struct zwp_linux_buffer_params_v1* params)
+{
+	(void)params;
+	const struct wall_tile* tile = data;
+	fprintf(stderr, "dmabuf params creation failed for %s.\n", tile->stream.devname);
+	wall_failed = 1;
+}
+
+static const struct zwp_linux_buffer_params_v1_listener wall_params_listener =
+{
+	.created = params_created,
+	.failed  = wall_params_failed,
+};
+
+
+// Only formats that the compositor takes as-is: a wall is zero-copy, or nothing.
+static int wall_accepts(uint32_t drm_fourcc)
+{
+	return dmabuf_caps_has(compositor_caps(), drm_fourcc, DRM_FORMAT_MOD_LINEAR);
+}
+
+
+// Open and start a capture device, and give it a subsurface and a wl_buffer per capture buffer.
+static int wall_add_tile(const char* devname, uint32_t required_format, int depth)
+{
+	struct wall_tile* tile = wall_tiles + wall_num_tiles;
+	tile->pending = -1;
+	if (v4l2_stream_open(&tile->stream, devname, required_format, wall_accepts) < 0)
+		return 0;
+	wall_num_tiles++;
+	if (v4l2_stream_start(&tile->stream, depth, vid_import ? &dma_alloc : 0) < 0)
+		return 0;
+
+	tile->surface = wl_compositor_create_surface(compositor);
+	tile->subsurface = wl_subcompositor_get_subsurface(subcompositor, tile->surface, surface);
+	wl_subsurface_set_sync(tile->subsurface);
+	tile->viewport = wp_viewporter_get_viewport(viewporter, tile->surface);
+
+	const struct v4l2_stream* s = &tile->stream;
+	for (int b=0; b<s->num_buffers; ++b)
 	{
-		fprintf(stderr, "eglGetConfigs() returned EGL_FALSE.\n");
-		return EGL_FALSE;
+		struct wall_buffer* wb = tile->buffers + b;
+		struct zwp_linux_buffer_params_v1* params = zwp_linux_dmabuf_v1_create_params(dmabuf);
+		for (int i=0; i<s->desc->num_planes; ++i)
+		{
+			const struct vid_plane_layout* layout = s->layout + i;
+			zwp_linux_buffer_params_v1_add
+			(
+				params,
+				s->buffers[b].dma_fds[layout->mem_plane],
+				i,
+				layout->offset,
+				layout->stride,
+				DRM_FORMAT_MOD_LINEAR >> 32,
+				DRM_FORMAT_MOD_LINEAR & 0xffffffff
+			);
+		}
+		zwp_linux_buffer_params_v1_add_listener(params, &wall_params_listener, tile);
+		wb->tile = tile;
+		wb->index = b;
+		wb->wl_buffer = zwp_linux_buffer_params_v1_create_immed(params, s->width, s->height, s->desc->drm_fourcc, 0);
+		wl_buffer_add_listener(wb->wl_buffer, &wall_buffer_listener, wb);
+		// A rejected buffer shows up as a 'failed' event on its params, which the roundtrip in run_wall() waits for.
+		wb->params = params;
 	}
-	if (numConfigs == 0)
+	return 1;
+}
+
+
+// A single black pixel, which the viewport stretches over the whole window, behind the tiles.
+static struct wl_buffer* wall_create_background(void)
+{
+	const uint32_t black = 0xff000000;
+	const int fd = memfd_create("wall-background", MFD_CLOEXEC);
+	if (fd < 0 || pwrite(fd, &black, sizeof(black), 0) != sizeof(black))
 	{
-		fprintf(stderr, "eglGetConfigs() yielded 0 configs.\n");
-		return EGL_FALSE;
+		fprintf(stderr, "Cannot make a background buffer: %s\n", strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return 0;
 	}
+	struct wl_shm_pool* pool = wl_shm_create_pool(shm, fd, sizeof(black));
+	struct wl_buffer* buffer = wl_shm_pool_create_buffer(pool, 0, 1, 1, sizeof(black), WL_SHM_FORMAT_XRGB8888);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+	return buffer;
+}
 
-	// Choose config
-	EGLint fbAttribs[] =
-	{
-		EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
-		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
-		EGL_RED_SIZE,        8,
-		EGL_GREEN_SIZE,      8,
-		EGL_BLUE_SIZE,       8,
-#if 0
-		EGL_SAMPLE_BUFFERS,  1,
-		EGL_SAMPLES,         4, // 4x MSAA
-#endif
-		EGL_NONE
-	};
-	EGLConfig config = 0;
-	const int chosen = eglChooseConfig(egl_dpy, fbAttribs, &config, 1, &numConfigs);
-	if (chosen == EGL_FALSE)
+
+// Commit the wall, with the subsurfaces as they are, and have the compositor tell us when it may be committed again.
+static void wall_commit(int new_frames)
+{
+	wall_frame_callback = wl_surface_frame(surface);
+	wl_callback_add_listener(wall_frame_callback, &wall_frame_listener, (void*)(intptr_t)new_frames);
+	wl_surface_commit(surface);
+}
+
+
+// Lay the tiles out in a grid over the window, each keeping the aspect ratio of its video.
+// Takes effect with the next commit of our surface.
+static void wall_layout(void)
+{
+	int cols = 1;
+	while (cols * cols < wall_num_tiles)
+		cols++;
+	const int rows = (wall_num_tiles + cols - 1) / cols;
+	const int32_t cellw = winw / cols;
+	const int32_t cellh = winh / rows;
+
+	wp_viewport_set_destination(wall_viewport, winw, winh);
+	for (int i=0; i<wall_num_tiles; ++i)
 	{
-		fprintf(stderr, "eglChooseConfig() returned EGL_FALSE.\n");
-		return EGL_FALSE;
+		struct wall_tile* tile = wall_tiles + i;
+		int32_t w = cellw;
+		int32_t h = (int32_t)((int64_t)cellw * tile->stream.height / tile->stream.width);
+		if (h > cellh)
+		{
+			h = cellh;
+			w = (int32_t)((int64_t)cellh * tile->stream.width / tile->stream.height);
+		}
+		if (w < 1 || h < 1)
+			w = h = 1;
+		wl_subsurface_set_position(tile->subsurface, (i % cols) * cellw + (cellw - w) / 2, (i / cols) * cellh + (cellh - h) / 2);
+		wp_viewport_set_destination(tile->viewport, w, h);
+		wl_surface_commit(tile->surface);
 	}
-	if (numConfigs<1)
+}
+
+
+// Block until the compositor or any of the capture devices has something for us.
+static int wall_wait_for_events(struct pollfd* fds)
+{
+	while (wl_display_prepare_read(native_dpy) != 0)
+		wl_display_dispatch_pending(native_dpy);
+
+	short wl_events = POLLIN;
+	if (wl_display_flush(native_dpy) < 0)
 	{
-		fprintf(stderr, "eglChooseConfig() yielded %d configurations.\n", numConfigs);
-		return EGL_FALSE;
+		if (errno != EAGAIN)
+		{
+			wl_display_cancel_read(native_dpy);
+			return -1;
+		}
+		wl_events |= POLLOUT;
 	}
 
-	// Create a surface
-	egl_srf = eglCreateWindowSurface(egl_dpy, config, native_win, NULL);
-	if ( egl_srf == EGL_NO_SURFACE )
+	fds[0] = (struct pollfd) { .fd = wl_display_get_fd(native_dpy), .events = wl_events };
+	for (int i=0; i<wall_num_tiles; ++i)
+		fds[1+i] = (struct pollfd) { .fd = wall_tiles[i].stream.fd, .events = POLLIN };
+	if (poll(fds, 1 + wall_num_tiles, -1) < 0)
 	{
-		fprintf(stderr, "eglCreateWindowSurface() returned EGL_NO_SURFACE.\n");
-		return EGL_FALSE;
+		wl_display_cancel_read(native_dpy);
+		return errno == EINTR ? 0 : -1;
 	}
 
-	// Create a GL context
-	EGLint contextAttribs[] = { EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE, EGL_NONE };
-	egl_ctx = eglCreateContext(egl_dpy, config, EGL_NO_CONTEXT, contextAttribs );
-	if ( egl_ctx == EGL_NO_CONTEXT )
+	if (fds[0].revents & (POLLHUP | POLLERR))
 	{
-		fprintf(stderr, "eglCreateContext() returned EGL_NO_CONTEXT.\n");
-		return EGL_FALSE;
+		// The compositor went away: poll() would keep returning this.
+		wl_display_cancel_read(native_dpy);
+		fprintf(stderr, "Lost the connection to the compositor.\n");
+		return -1;
 	}
-
-	// Make the context current
-	if ( !eglMakeCurrent(egl_dpy, egl_srf, egl_srf, egl_ctx) )
+	if (fds[0].revents & POLLIN)
 	{
-		fprintf(stderr, "eglMakeCurrent() returned EGL_FALSE.\n");
-		return EGL_FALSE;
+		if (wl_display_read_events(native_dpy) < 0)
+			return -1;
 	}
+	else
+		wl_display_cancel_read(native_dpy);
 
-	return EGL_TRUE;
+	return wl_display_dispatch_pending(native_dpy) < 0 ? -1 : 0;
 }
 
 
-static void draw()
+// Ack the last configure, and take its size. Returns 1 if the tiles need a new layout.
+static int wall_apply_configure(void)
 {
-	static int16_t red=0x20, grn=0x70, blu=0xa0;
-	static int16_t dr=1, db=-1;
+	if (!configure_pending)
+		return 0;
+	xdg_surface_ack_configure(xdg_surface, pending_serial);
+	configure_pending = 0;
+	const int resized = pending_w && (pending_w != winw || pending_h != winh);
+	if (resized)
+	{
+		winw = pending_w;
+		winh = pending_h;
+		bench.resizes++;
+	}
+	pending_w = pending_h = 0;
+	return resized;
+}
 
-	glClearColor(red / 255.0f, grn / 255.0f, blu / 255.0f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT);
 
-	red += dr;
-	blu += db;
-	if (red<0 || red>0xff) dr = -dr;
-	if (blu<0 || blu>0xff) db = -db;
+static void wall_cleanup(void)
+{
+	if (wall_frame_callback)
+		wl_callback_destroy(wall_frame_callback);
+	wall_frame_callback = 0;
+	for (int i=0; i<wall_num_tiles; ++i)
+	{
+		struct wall_tile* tile = wall_tiles + i;
+		for (int b=0; b<tile->stream.num_buffers; ++b)
+		{
+			if (tile->buffers[b].params)
+				zwp_linux_buffer_params_v1_destroy(tile->buffers[b].params);
+			if (tile->buffers[b].wl_buffer)
+				wl_buffer_destroy(tile->buffers[b].wl_buffer);
+		}
+		if (tile->viewport)
+			wp_viewport_destroy(tile->viewport);
+		if (tile->subsurface)
+			wl_subsurface_destroy(tile->subsurface);
+		if (tile->surface)
+			wl_surface_destroy(tile->surface);
+		v4l2_stream_close(&tile->stream);
+	}
+	wall_num_tiles = 0;
+	if (wall_background)
+		wl_buffer_destroy(wall_background);
+	if (wall_viewport)
+		wp_viewport_destroy(wall_viewport);
+	if (xdg_toplevel)
+		xdg_toplevel_destroy(xdg_toplevel);
+	if (xdg_surface)
+		xdg_surface_destroy(xdg_surface);
+	wl_surface_destroy(surface);
+	surface = 0;
 }
 
 
-// Wayland helper funcs.
-
-static int connect_to_wayland()
+// Show all devices in one window. Returns the exit code.
+static int run_wall(char* const* devnames, int count, uint32_t required_format, int depth, int fullscreen)
 {
-	native_dpy = wl_display_connect(0);
-	if (!native_dpy)
+	if (!subcompositor || !shm || !viewporter || !dmabuf)
 	{
-		fprintf(stderr, "wl_display_connect(0) return 0.\n");
-		exit(1);
+		fprintf(stderr, "A video wall needs wl_subcompositor, wl_shm, wp_viewporter and linux-dmabuf.\n");
+		return 4;
 	}
-
-	struct wl_registry *wl_registry = wl_display_get_registry(native_dpy);
-	void* data = 0;
-	wl_registry_add_listener(wl_registry, &registry_listener, data);
-	wl_display_dispatch(native_dpy);
+	wall_viewport = wp_viewporter_get_viewport(viewporter, surface);
+	wall_background = wall_create_background();
+	if (!wall_background)
+		return 4;
+	for (int i=0; i<count; ++i)
+		if (!wall_add_tile(devnames[i], required_format, depth))
+		{
+			wall_cleanup();
+			return 4;
+		}
 	wl_display_roundtrip(native_dpy);
+	for (int i=0; i<wall_num_tiles; ++i)
+		for (int b=0; b<wall_tiles[i].stream.num_buffers; ++b)
+		{
+			zwp_linux_buffer_params_v1_destroy(wall_tiles[i].buffers[b].params);
+			wall_tiles[i].buffers[b].params = 0;
+		}
+	if (wall_failed)
+	{
+		fprintf(stderr, "The compositor does not take our capture buffers.\n");
+		wall_cleanup();
+		return 4;
+	}
 
-	if (!compositor)
-		fprintf(stderr, "Wayland server did not provide us with a compositor.\n");
-	if (!wm_base)
-		fprintf(stderr, "Wayland server did not provide us with a WM Base.\n");
-	return (compositor && wm_base) ? 1 : 0;
-}
+	xdg_surface = xdg_wm_base_get_xdg_surface(wm_base, surface);
+	xdg_surface_add_listener(xdg_surface, &xdg_surface_listener, NULL);
+	xdg_toplevel = xdg_surface_get_toplevel(xdg_surface);
+	xdg_toplevel_set_title(xdg_toplevel, "Video wall");
+	xdg_toplevel_add_listener(xdg_toplevel, &xdg_toplevel_listener, NULL);
+	if (fullscreen)
+		xdg_toplevel_set_fullscreen(xdg_toplevel, NULL);
+	wl_surface_commit(surface);
+	while (!configured)
+		wl_display_dispatch(native_dpy);
+
+	struct wl_region* opaque = wl_compositor_create_region(compositor);
+	wl_region_add(opaque, 0, 0, INT32_MAX, INT32_MAX);
+	wl_surface_set_opaque_region(surface, opaque);
+	wl_region_destroy(opaque);
+	wl_surface_attach(surface, wall_background, 0, 0);
+	wl_surface_damage(surface, 0, 0, INT32_MAX, INT32_MAX);
+	fprintf(stderr, "Showing %d capture devices on a video wall.\n", wall_num_tiles);
+
+	wall_apply_configure();
+	wall_layout();
+	wall_commit(0);
+
+	bench_report_start(&bench, "minimal_nv12", "wall");
+	struct pollfd fds[1 + WALL_MAX_TILES];
+	int relayout = 0;
+	while (!done)
+	{
+		if (wall_wait_for_events(fds) < 0)
+			break;
+		relayout |= wall_apply_configure();
 
+		// Keep the newest frame of each device, and hand the one it replaces straight back.
+		for (int i=0; i<wall_num_tiles; ++i)
+		{
+			if (!(fds[1+i].revents & POLLIN))
+				continue;
+			struct wall_tile* tile = wall_tiles + i;
+			const int buf_nr = v4l2_stream_dequeue(&tile->stream);
+			if (buf_nr < 0)
+				continue;
+			if (tile->pending >= 0)
+			{
+				v4l2_stream_queue(&tile->stream, tile->pending);
+				bench.dropped++;
+			}
+			tile->pending = buf_nr;
+		}
 
-static void cleanup_resources()
-{
-	eglDestroySurface(egl_dpy, egl_srf);
-	egl_srf = 0;
-	wl_egl_window_destroy(native_win);
-	native_win = 0;
-	xdg_toplevel_destroy(xdg_toplevel);
-	xdg_toplevel = 0;
-	xdg_surface_destroy(xdg_surface);
-	xdg_surface = 0;
-	wl_surface_destroy(surface);
-	surface = 0;
-	eglDestroyContext(egl_dpy, egl_ctx);
-	egl_ctx = 0;
+		// The compositor paces us: nothing new goes out until our last commit made it to the screen.
+		if (wall_frame_callback)
+			continue;
+		int new_frames = 0;
+		for (int i=0; i<wall_num_tiles; ++i)
+		{
+			// Each frame goes to its subsurface, where it waits for the commit of the wall.
+			struct wall_tile* tile = wall_tiles + i;
+			if (tile->pending < 0)
+				continue;
+			wl_surface_attach(tile->surface, tile->buffers[tile->pending].wl_buffer, 0, 0);
+			wl_surface_damage(tile->surface, 0, 0, INT32_MAX, INT32_MAX);
+			wl_surface_commit(tile->surface);
+			tile->pending = -1;
+			new_frames = 1;
+		}
+		if (relayout)
+			wall_layout();
+
+		// All of it goes to screen at once.
+		if (new_frames || relayout)
+		{
+			wall_commit(new_frames);
+			if (new_frames)
+				trace_first_frame();
+		}
+		relayout = 0;
+	}
+
+	for (int i=0; i<wall_num_tiles; ++i)
+		bench.dropped += wall_tiles[i].stream.dropped;
+	if (bench_frames)
+		bench_report_print(&bench, stdout);
+	wall_cleanup();
+	return 0;
 }
 
 
 int main(int argc, char* argv[])
 {
-	if (argc != 3)
+	startup_trace_begin();
+	int depth = 0;
+	int max_depth = 0;
+	int fullscreen = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:g:c:s:Fti")) != -1)
+	{
+		switch (opt)
+		{
+			case 's':
+				if (sscanf(optarg, "%ux%u@%d", file_resolution+0, file_resolution+1, &file_fps) < 2)
+					argc = 0;
+				break;
+			case 'c':
+				bench_frames = atoi(optarg);
+				break;
+			case 't':
+				capture_threaded = 1;
+				break;
+			case 'i':
+				vid_import = 1;
+				break;
+			case 'F':
+				fullscreen = 1;
+				break;
+			case 'n':
+				depth = atoi(optarg);
+				break;
+			case 'g':
+				max_depth = atoi(optarg);
+				break;
+			default:
+				argc = 0;
+				break;
+		}
+	}
+	// The last argument is a pixel format, if it looks like one. The others are capture sources.
+	int num_sources = argc - optind;
+	const char* fourcc = 0;
+	if (num_sources > 1 && strlen(argv[argc-1]) == 4 && !strchr(argv[argc-1], '/'))
+	{
+		fourcc = argv[argc-1];
+		num_sources--;
+	}
+	if (num_sources < 1 || num_sources > WALL_MAX_TILES)
 	{
-		fprintf(stderr, "Usage: /dev/video0 NV12\n");
+		fprintf(stderr, "Usage: %s [-F] [-t] [-i] [-c frames] [-n buffers] [-g max_buffers] [-s WxH[@fps]] /dev/video0|file [/dev/video1 ...] [NV12]\n", argv[0]);
+		fprintf(stderr, "  -F  Fullscreen, which lets the compositor scan out our buffers directly.\n");
+		fprintf(stderr, "  -t  Dequeue frames on a capture thread, so compositor stalls do not delay capture.\n");
+		fprintf(stderr, "  -i  Capture into dmabufs we allocate (from a DMA heap, or udmabuf), instead of the driver's own.\n");
+		fprintf(stderr, "  -n  Nr of capture buffers (default: driver minimum + %d).\n", DEFAULT_EXTRA_BUFFERS);
+		fprintf(stderr, "  -g  Let the buffer ring grow up to this many buffers under compositor back-pressure.\n");
+		fprintf(stderr, "  -c  Benchmark: quit after this many frames, and print the results as JSON on stdout.\n");
+		fprintf(stderr, "  -s  Resolution and rate (default %d fps) of raw frames, when capturing from a file.\n", file_fps);
+		fprintf(stderr, "With up to %d capture devices, they are shown together in a grid (zero-copy only).\n", WALL_MAX_TILES);
 		exit(1);
 	}
-	assert(argc==3);
-	const char* devname = argv[1];
-	const char* fourcc = argv[2];
+	const char* devname = argv[optind+0];
+	if (vid_import && dma_alloc_open(&dma_alloc) < 0)
+	{
+		fprintf(stderr, "Capturing into the buffers of the driver instead.\n");
+		vid_import = 0;
+	}
+	const uint32_t format = fourcc ? v4l2_fourcc(fourcc[0], fourcc[1], fourcc[2], fourcc[3]) : 0;
+
+	// With a given format, the capture source needs nothing from the compositor: set it up while we connect.
+	if (num_sources == 1 && format)
+		start_video_setup(devname, format, depth, max_depth);
 
 	// First order of business:
 	// Make sure we have a display, a compositor and a WM Base.
@@ -614,6 +2826,18 @@ int main(int argc, char* argv[])
 		fprintf(stderr, "Giving up.\n");
 		exit(2);
 	}
+	startup_trace_mark("connected to compositor");
+
+	// Without one, the source picks a format the compositor takes, which we know of now.
+	// If the compositor does not take the given format, we will be converting it with EGL: get that going too.
+	const struct vid_format_desc* desc = vid_format_find(format);
+	if (num_sources == 1 && !format)
+	{
+		snapshot_ranks();
+		start_video_setup(devname, format, depth, max_depth);
+	}
+	else if (num_sources == 1 && desc && !dmabuf_caps_has(compositor_caps(), desc->drm_fourcc, DRM_FORMAT_MOD_LINEAR))
+		start_egl_init();
 
 	// Make a surface that we can draw into.
 	surface = wl_compositor_create_surface(compositor);
@@ -623,13 +2847,30 @@ int main(int argc, char* argv[])
 		exit(3);
 	}
 
-	const uint32_t format = (fourcc[0]<<0) | (fourcc[1]<<8) | (fourcc[2]<<16) | (fourcc[3]<<24);
-	int vr = setup_video(devname, format, 1);
-	assert(vr>=0);
-	fprintf(stderr, "v4l2 connected.\n");
+	if (num_sources > 1)
+	{
+		const int code = run_wall(argv + optind, num_sources, format, depth, fullscreen);
+		dma_alloc_close(&dma_alloc);
+		dmabuf_caps_clear(&dmabuf_caps);
+		dmabuf_feedback_fini(&default_feedback);
+		wl_display_disconnect(native_dpy);
+		exit(code);
+	}
+
+	// Let the compositor scale our buffers, and tell us its preferred (fractional) scale.
+	if (viewporter)
+		viewport = wp_viewporter_get_viewport(viewporter, surface);
+	if (viewporter && fractional_scale_manager)
+	{
+		fractional_scale = wp_fractional_scale_manager_v1_get_fractional_scale(fractional_scale_manager, surface);
+		wp_fractional_scale_v1_add_listener(fractional_scale, &fractional_scale_listener, NULL);
+	}
 
-	create_dma_buffers();
+	// Let the compositor tell us which formats it prefers for this surface: scanout, when fullscreen.
+	if (dmabuf && zwp_linux_dmabuf_v1_get_version(dmabuf) >= ZWP_LINUX_DMABUF_V1_GET_DEFAULT_FEEDBACK_SINCE_VERSION)
+		dmabuf_feedback_init(&surface_feedback, zwp_linux_dmabuf_v1_get_surface_feedback(dmabuf, surface), surface_feedback_changed, 0);
 
+	// Ask for our window now, so that the compositor works on its first configure while the capture source starts.
 	xdg_surface = xdg_wm_base_get_xdg_surface(wm_base, surface);
 	assert(xdg_surface);
 	xdg_surface_add_listener(xdg_surface, &xdg_surface_listener, NULL);
@@ -638,28 +2879,228 @@ int main(int argc, char* argv[])
 	assert(xdg_toplevel);
 	xdg_toplevel_set_title(xdg_toplevel, "Wayland EGL example");
 	xdg_toplevel_add_listener(xdg_toplevel, &xdg_toplevel_listener, NULL);
+	if (fullscreen)
+		xdg_toplevel_set_fullscreen(xdg_toplevel, NULL);
 
 	wl_surface_commit(surface);
+	wl_display_flush(native_dpy);
+
+	if (finish_video_setup() < 0)
+	{
+		fprintf(stderr, "Cannot capture from %s.\n", devname);
+		exit(4);
+	}
+	// Now that the thread is done, the caps may be read again: see whether the compositor takes the format as-is.
+	fprintf(stderr, "Capture source connected, in a format the compositor %s.\n", rank_format(vid_fourcc) > 1 ? "takes as-is" : "does not take: we convert it");
+
+	// Fence our buffers explicitly, if the compositor can do that.
+	if (explicit_sync_init(&explicit_sync, syncobj_manager, default_feedback.main_device))
+		fprintf(stderr, "Using explicit sync with DRM syncobj timelines.\n");
+	else
+		fprintf(stderr, "Using implicit sync, with sync_file fences from the dmabufs.\n");
+
+	// Hand our buffers straight to the compositor if it takes the format, else convert them ourselves.
+	if (dmabuf_caps_has(compositor_caps(), vid_fourcc, DRM_FORMAT_MOD_LINEAR) && create_ring_buffers())
+	{
+		present_path = PRESENT_DMABUF;
+		explicit_sync_attach(&explicit_sync, surface);
+	}
+	else
+		present_path = PRESENT_SHADER;
+	apply_scale();
+
+	// We cannot attach buffers before the first configure event was acked.
+	while (!configured)
+		wl_display_dispatch(native_dpy);
+	apply_configure();
+	startup_trace_mark("window configured");
+
+	if (present_path == PRESENT_SHADER && !setup_shader_path())
+		present_path = PRESENT_SHM;
+	if (present_path == PRESENT_SHM && setup_shm_path())
+		apply_scale();
+	else if (present_path == PRESENT_SHM)
+	{
+		present_path = PRESENT_NONE;
+		// Without video to show, we draw with EGL, paced by a timer.
+		if (!egl_srf && !CreateEGLContext())
+			exit(4);
+		timer_fd = create_timer(60);
+		if (timer_fd < 0)
+			exit(4);
+	}
+	fprintf
+	(
+		stderr,
+		"Presenting video %s.\n",
+		present_path == PRESENT_DMABUF ? "zero-copy via dmabuf wl_buffers" :
+		present_path == PRESENT_SHADER ? "via a YUV to RGB shader" :
+		present_path == PRESENT_SHM ? "via wl_shm copies" :
+		"is not possible"
+	);
 
-	// Create a native window, and make it opaque.
+	// Make the window opaque.
 	region = wl_compositor_create_region(compositor);
-	wl_region_add(region, 0, 0, winw, winh);
+	if ((present_path == PRESENT_DMABUF || present_path == PRESENT_SHM) && !(viewport && compositor_sized))
+		wl_region_add(region, 0, 0, vid_resolution[0], vid_resolution[1]);
+	else
+		wl_region_add(region, 0, 0, winw, winh);
 	wl_surface_set_opaque_region(surface, region);
-	native_win = wl_egl_window_create(surface, winw, winh);
-	assert(native_win != EGL_NO_SURFACE);
 
-	// To do the drawing, we need an OpenGLES context.
-	CreateEGLContext();
+	if (capture_threaded && present_path != PRESENT_NONE)
+	{
+		frame_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		return_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (frame_efd < 0 || return_efd < 0 || !start_capture_thread())
+		{
+			fprintf(stderr, "Capturing on the main thread instead.\n");
+			capture_threaded = 0;
+		}
+	}
+
+	// Dump the latency statistics on SIGUSR1. Without SA_RESTART, the signal wakes up our poll().
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = request_stats;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGUSR1, &action, 0);
+	if (!presentation)
+		fprintf(stderr, "Compositor has no wp_presentation: no presentation latencies.\n");
+
+	bench_report_start
+	(
+		&bench,
+		"minimal_nv12",
+		present_path == PRESENT_DMABUF ? "dmabuf" :
+		present_path == PRESENT_SHADER ? "shader" :
+		present_path == PRESENT_SHM ? "shm" :
+		"none"
+	);
 
-	// Main loop.
+	// Main loop: only wake up when the compositor, capture device or timer has something for us.
 	while (!done)
 	{
-		wl_display_dispatch_pending(native_dpy);
-		draw();
-		eglSwapBuffers(egl_dpy, egl_srf);
+		int video_ready, video_event, timer_ready;
+		const int watch_video = present_path != PRESENT_NONE && vid_in_driver > 0;
+		if (wait_for_events(watch_video, &video_ready, &video_event, &timer_ready) < 0)
+			break;
+		apply_configure();
+
+		if (stats_requested)
+		{
+			stats_requested = 0;
+			frame_stats_print(&frame_stats, stderr);
+		}
+
+		if (video_event && capture->source_changed && capture->source_changed())
+		{
+			if (restart_video(0) < 0)
+				break;
+			continue;
+		}
+
+		if (feedback_changed)
+		{
+			feedback_changed = 0;
+			// The compositor may now prefer a format the device can capture in, e.g. one it can scan out when fullscreen.
+			const uint32_t better = capture->best_format ? capture->best_format() : 0;
+			if (better && present_path != PRESENT_NONE)
+			{
+				fprintf(stderr, "Switching to pixelformat %c%c%c%c, which the compositor prefers.\n", (better>>0)&0xff, (better>>8)&0xff, (better>>16)&0xff, (better>>24)&0xff);
+				if (restart_video(better) < 0)
+					break;
+			}
+			rechoose_present_path();
+		}
+
+		if (video_ready)
+		{
+			// If several frames are ready, only show the newest one, and hand the rest straight back.
+			// The capture thread already did that for us.
+			int newest = -1;
+			int buf_nr;
+			if (capture_running)
+				newest = frame_mailbox_take(&capture_mailbox);
+			else while ((buf_nr = capture->dequeue()) >= 0)
+			{
+				if (newest >= 0)
+					requeue_buffer(newest);
+				newest = buf_nr;
+			}
+			if (newest >= 0 && present_path == PRESENT_DMABUF)
+			{
+				// Each captured frame goes to the compositor as-is.
+				// Buffers are returned to the capture device on wl_buffer.release.
+				present_frame(newest);
+				bench_count_frame(newest);
+			}
+			else if (newest >= 0 && present_path == PRESENT_SHM)
+			{
+				// The copy is ours, so the capture buffer goes straight back.
+				if (present_shm_frame(newest))
+					bench_count_frame(newest);
+				requeue_buffer(newest);
+			}
+			else if (newest >= 0)
+			{
+				// Once the new frame is swapped in, the GPU is done with the previous one.
+				draw_frame(newest);
+				track_presentation(newest);
+				eglSwapBuffers(egl_dpy, egl_srf);
+				if (vid_shown >= 0)
+					requeue_buffer(vid_shown);
+				vid_shown = newest;
+				bench_count_frame(newest);
+			}
+
+			// If the compositor now holds every buffer, the device has nothing left to capture into.
+			if (vid_in_driver == 0 && present_path == PRESENT_DMABUF)
+			{
+				// The capture thread must keep its hands off the ring while it grows.
+				const int threaded = capture_running;
+				stop_capture_thread();
+				if (vid_in_driver == 0)
+					ring_grow();
+				if (threaded)
+					start_capture_thread();
+			}
+		}
+
+		if (timer_ready)
+		{
+			draw();
+			eglSwapBuffers(egl_dpy, egl_srf);
+			trace_first_frame();
+			if (++bench.frames == bench_frames)
+				done = 1;
+		}
 	}
 
+	if (bench_frames)
+		bench_report_print(&bench, stdout);
+
 	cleanup_resources();
+	explicit_sync_fini(&explicit_sync);
+	if (syncobj_manager)
+		wp_linux_drm_syncobj_manager_v1_destroy(syncobj_manager);
+	frame_stats_print(&frame_stats, stderr);
+	if (presentation)
+		wp_presentation_destroy(presentation);
+	if (fractional_scale_manager)
+		wp_fractional_scale_manager_v1_destroy(fractional_scale_manager);
+	if (viewporter)
+		wp_viewporter_destroy(viewporter);
+	if (timer_fd >= 0)
+		close(timer_fd);
+	if (frame_efd >= 0)
+		close(frame_efd);
+	if (return_efd >= 0)
+		close(return_efd);
+
+	dma_alloc_close(&dma_alloc);
+	dmabuf_caps_clear(&dmabuf_caps);
+	dmabuf_feedback_fini(&surface_feedback);
+	dmabuf_feedback_fini(&default_feedback);
 
 	wl_display_disconnect(native_dpy);
 	native_dpy = 0;
@@ -667,4 +3108,3 @@ int main(int argc, char* argv[])
 
 	exit(0);
 }
-
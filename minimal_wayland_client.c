@@ -12,11 +12,18 @@
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 #include <wayland-client-core.h>
 #include <wayland-egl.h>
 
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <EGL/eglplatform.h>
 #include <GLES2/gl2.h>
 
@@ -24,36 +31,234 @@
 
 #include "linux-dma-protocol.h"
 
+#include "viewporter-protocol.h"
+#include "fractional-scale-protocol.h"
+
+#include "dmabuf_caps.h"
+#include "dmabuf_feedback.h"
+#include "bench_report.h"
+#include "damage.h"
+#include "gl_cache.h"
+#include "startup_trace.h"
+
 
 // OpenGLES
 
 static EGLNativeDisplayType	native_dpy;
-static EGLNativeWindowType	native_win;
 static EGLDisplay*		egl_dpy;
-static EGLContext		egl_ctx;
-static EGLSurface		egl_srf;
+static EGLConfig		egl_config;
+static EGLContext		egl_ctx;	// Shared by all windows, unless they render on threads of their own.
+static __thread EGLContext	egl_thread_ctx;	// The context of this thread.
+static __thread EGLSurface	egl_current;	// The surface that egl_thread_ctx draws to now.
+static int			egl_has_buffer_age;
+static PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC	egl_swap_with_damage;	// 0 if the EGL lacks it.
 
 // Wayland
 
 static struct wl_compositor*	compositor;
-static struct wl_surface*	surface;
-static struct wl_region*	region;
 
 static struct xdg_wm_base*	wm_base;
-static struct xdg_surface*	xdg_surface;
-static struct xdg_toplevel*	xdg_toplevel;
 
 static struct zwp_linux_dmabuf_v1* dmabuf;
+static struct dmabuf_caps	dmabuf_caps;	// The formats and modifiers the compositor takes (before version 4).
+static struct dmabuf_feedback	default_feedback;	// The same, from version 4 and up.
+
+static struct wp_viewporter*			viewporter;
+static struct wp_fractional_scale_manager_v1*	fractional_scale_manager;
+
+// A window: everything the compositor, EGL and the scene need per toplevel.
+// Listeners get their window through the data pointer.
+
+struct window
+{
+	int				index;
+	struct wl_surface*		surface;
+	struct wl_region*		region;
+	struct xdg_surface*		xdg_surface;
+	struct xdg_toplevel*		xdg_toplevel;
+	struct wp_viewport*		viewport;
+	struct wp_fractional_scale_v1*	fractional_scale;
+	EGLNativeWindowType		native_win;
+	EGLSurface			egl_srf;
+
+	int32_t				winw;		// Logical (surface) size.
+	int32_t				winh;
+	uint32_t			scale120;	// Scale we render at, in 120ths. Only changes in apply_scale().
+	uint32_t			preferred_scale120;	// Preferred scale of the compositor, applied with the next configure.
+	int32_t				bufw;		// Rendered size, in device pixels.
+	int32_t				bufh;
+	int32_t				allocw;		// Size of the EGL window: at least bufw x bufh.
+	int32_t				alloch;
+	int32_t				pending_w;	// The size from the last configure, not yet acked.
+	int32_t				pending_h;
+	uint32_t			pending_serial;
+	int				configure_pending;
+	int				configured;	// Acked a configure: we may attach buffers.
+	int				closed;		// The compositor asked us to close it.
+	int				redraw_needed;
+	int				scale_changed;	// preferred_scale120 is new.
+	struct wl_callback*		frame_callback;	// The frame callback we wait for, if any.
+	struct wl_surface*		frame_surface;	// Our surface, but its frame callbacks go to the queue of the rendering thread.
+	uint32_t			outputs;	// Bit per output that shows (part of) the window.
+	int				group;		// The output whose thread should render us, or -1.
+	int				owner;		// The output whose thread renders us now, or -1.
+	struct damage_tracker		damage_tracker;
+
+	int16_t				tile_rgb[3];	// A tile that cycles its colour.
+	int16_t				tile_dr, tile_db;
+	int32_t				box_x, box_y;	// A box bouncing around the window.
+	int32_t				box_dx, box_dy;
+};
+
+#define MAX_WINDOWS	8
+
+// An output, and (with -o) the thread that renders the windows on it, with an EGL context and event queue of its own.
+// Frame callbacks of its windows come in on that queue, so each output is paced at its own rate,
+// and a slow or occluded one only stalls its own thread.
+
+struct output
+{
+	int				index;
+	struct wl_output*		wl_output;
+	int32_t				width;		// Current mode.
+	int32_t				height;
+	int32_t				refresh_mhz;
+	int				running;	// Has a thread.
+	int				failed;		// Its thread could not start, or had no EGL context: never try again.
+	pthread_t			thread;
+	struct wl_event_queue*		queue;
+	int				wake_fd;	// An eventfd, to get the thread out of its wait for frame callbacks.
+};
+
+#define MAX_OUTPUTS	8
+
+static struct output		outputs[MAX_OUTPUTS];
+static int			num_outputs = 0;
+static int			use_output_threads = 0;	// Render each output group on a thread of its own.
+static int			threads_stop = 0;	// Render threads must let go of their windows, and end.
+static int			threads_failed = 0;	// No output has a working thread: the main thread renders after all.
+static int			main_wake_fd = -1;	// Render threads get the main thread out of its wait with this eventfd.
+static pthread_mutex_t		windows_lock = PTHREAD_MUTEX_INITIALIZER;	// Guards the windows against listeners and render threads.
 
 // Application
 
-static int32_t			winw = 512;
-static int32_t			winh = 512;
+static struct window		windows[MAX_WINDOWS];
+static int			num_windows = 1;
+static int			bench_frames = 0;
+static int			resize_stress = 0;	// Keep resizing our window, as when dragging its border.
 static int			done = 0;
+static int			timer_fd = -1;
+static int			use_frame_callbacks = 0;	// Pace by wl_surface.frame instead of a blocking swap.
+static struct bench_report	report;
+
+
+static void wake_window(struct window* win);
+static void set_group(struct window* win, int group);
+
+
+// frame callback handling
+
+static void frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	struct window* win = data;
+	(void) time;
+	// The compositor is ready for a new frame. Comes in on the thread that renders the window.
+	wl_callback_destroy(callback);
+	pthread_mutex_lock(&windows_lock);
+	win->frame_callback = 0;
+	win->redraw_needed = 1;
+	pthread_mutex_unlock(&windows_lock);
+}
+
+static const struct wl_callback_listener frame_listener =
+{
+	.done = frame_done,
+};
+
+
+// Scaling: with a viewport, we render at the exact device pixel size, and the viewport maps that onto our logical size.
+// Without one, we render at the logical size and let the compositor scale.
+
+// With a viewport, the EGL window can be larger than what we show: we render into its bottom-left corner (GL's origin),
+// and crop that out. So a resize within the bucket does not reallocate the EGL buffers.
+// Buckets grow in steps of 64 pixels, with a quarter extra to grow into, and only shrink when less than half is used.
+static int32_t bucket_size(int32_t need, int32_t have)
+{
+	if (need <= have && 2 * need > have)
+		return have;
+	return (need + need / 4 + 63) & ~63;
+}
+
+
+// With render threads, called with the windows locked: the thread that renders the window can then read
+// the scale and sizes without the lock, while a new preferred scale comes in.
+static void apply_scale(struct window* win)
+{
+	win->scale120 = win->preferred_scale120;
+	win->bufw = win->viewport ? (int32_t)((win->winw * win->scale120 + 60) / 120) : win->winw;
+	win->bufh = win->viewport ? (int32_t)((win->winh * win->scale120 + 60) / 120) : win->winh;
+	int32_t w = win->bufw;
+	int32_t h = win->bufh;
+	if (win->viewport)
+	{
+		w = bucket_size(win->bufw, win->allocw);
+		h = bucket_size(win->bufh, win->alloch);
+		// Takes effect with the commit of the next swap, which attaches a buffer of the new size.
+		wp_viewport_set_source(win->viewport, wl_fixed_from_int(0), wl_fixed_from_int(h - win->bufh), wl_fixed_from_int(win->bufw), wl_fixed_from_int(win->bufh));
+		wp_viewport_set_destination(win->viewport, win->winw, win->winh);
+	}
+	if (w != win->allocw || h != win->alloch)
+	{
+		win->allocw = w;
+		win->alloch = h;
+		if (win->native_win)
+		{
+			// EGL reallocates its buffers at the next swap.
+			wl_egl_window_resize(win->native_win, win->allocw, win->alloch, 0, 0);
+			report.reallocs++;
+		}
+	}
+	damage_tracker_reset(&win->damage_tracker);
+	win->redraw_needed = 1;
+}
+
+
+static void fractional_scale_preferred(void* data, struct wp_fractional_scale_v1* fs, uint32_t scale)
+{
+	struct window* win = data;
+	(void)fs;
+	// Applied by the thread that renders the window, before its next frame.
+	pthread_mutex_lock(&windows_lock);
+	if (scale == win->preferred_scale120)
+	{
+		pthread_mutex_unlock(&windows_lock);
+		return;
+	}
+	fprintf(stderr, "Compositor prefers a scale of %.3f for window %d.\n", scale / 120.0, win->index);
+	win->preferred_scale120 = scale;
+	win->scale_changed = 1;
+	win->redraw_needed = 1;
+	wake_window(win);
+	pthread_mutex_unlock(&windows_lock);
+}
+
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener =
+{
+	.preferred_scale = fractional_scale_preferred,
+};
 
 
 // xdg toplevel handling
 
+static void set_pending_size(struct window* win, int32_t w, int32_t h)
+{
+	if(w == 0 && h == 0)
+		return;
+	// Applied when the configure gets acked.
+	win->pending_w = w;
+	win->pending_h = h;
+}
+
 static void xdg_toplevel_handle_configure
 (
 	void *data,
@@ -63,18 +268,12 @@ static void xdg_toplevel_handle_configure
 	struct wl_array *states
 )
 {
-	(void) data;
+	struct window* win = data;
 	(void) toplvl;
 	(void) states;
-	if(w == 0 && h == 0)
-		return;
-	if(winw != w || winh != h)
-	{
-		winw = w;
-		winh = h;
-		wl_egl_window_resize(native_win, winw, winh, 0, 0);
-		wl_surface_commit(surface);
-	}
+	pthread_mutex_lock(&windows_lock);
+	set_pending_size(win, w, h);
+	pthread_mutex_unlock(&windows_lock);
 }
 
 static void xdg_toplevel_handle_close
@@ -83,9 +282,11 @@ static void xdg_toplevel_handle_close
 	struct xdg_toplevel *xdg_toplevel
 )
 {
-	(void) data;
+	struct window* win = data;
 	(void) xdg_toplevel;
-	done = 1;
+	pthread_mutex_lock(&windows_lock);
+	win->closed = 1;
+	pthread_mutex_unlock(&windows_lock);
 }
 
 static struct xdg_toplevel_listener xdg_toplevel_listener = {
@@ -98,8 +299,15 @@ static struct xdg_toplevel_listener xdg_toplevel_listener = {
 
 static void xdg_surface_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial)
 {
-	(void) data;
-	xdg_surface_ack_configure(xdg_surface, serial);
+	struct window* win = data;
+	(void) xdg_surface;
+	// Acked before our next frame: during an interactive resize, many configures come in per frame.
+	pthread_mutex_lock(&windows_lock);
+	win->pending_serial = serial;
+	win->configure_pending = 1;
+	win->redraw_needed = 1;
+	wake_window(win);
+	pthread_mutex_unlock(&windows_lock);
 }
 
 static const struct xdg_surface_listener xdg_surface_listener =
@@ -108,6 +316,55 @@ static const struct xdg_surface_listener xdg_surface_listener =
 };
 
 
+static void set_opaque_region(struct window* win)
+{
+	if (win->region)
+		wl_region_destroy(win->region);
+	win->region = wl_compositor_create_region(compositor);
+	wl_region_add(win->region, 0, 0, win->winw, win->winh);
+	wl_surface_set_opaque_region(win->surface, win->region);
+}
+
+
+// Only the last configure needs an ack, and only its size is applied. Our next frame commits it.
+// With render threads, called by the one that renders the window, with the windows locked.
+static void apply_configure(struct window* win)
+{
+	if (win->scale_changed)
+		apply_scale(win);
+	win->scale_changed = 0;
+	if (win->configure_pending)
+	{
+		xdg_surface_ack_configure(win->xdg_surface, win->pending_serial);
+		win->configured = 1;
+	}
+	win->configure_pending = 0;
+	if (win->pending_w && (win->pending_w != win->winw || win->pending_h != win->winh))
+	{
+		win->winw = win->pending_w;
+		win->winh = win->pending_h;
+		apply_scale(win);
+		set_opaque_region(win);
+		report.resizes++;
+	}
+	win->pending_w = win->pending_h = 0;
+}
+
+
+// For -r: a burst of configures per frame, as when dragging a window border.
+// A floating window may pick its own size, so we need not wait for the compositor.
+static void stress_resize(struct window* win, int frame)
+{
+	for (int i=0; i<4; ++i)
+	{
+		const double t = (frame * 4 + i) * 0.01 + win->index;
+		const int32_t w = 320 + (int32_t)(256 * (1 + sin(t)));
+		const int32_t h = 240 + (int32_t)(192 * (1 + sin(1.3 * t)));
+		set_pending_size(win, w, h);
+	}
+}
+
+
 // xdg wm base handling
 
 static void xdg_wm_base_ping(void *data, struct xdg_wm_base *xdg_wm_base, uint32_t serial)
@@ -122,6 +379,94 @@ static const struct xdg_wm_base_listener xdg_wm_base_listener =
 };
 
 
+// output handling
+
+static void output_geometry(void* data, struct wl_output* wl_output, int32_t x, int32_t y, int32_t pw, int32_t ph, int32_t subpixel, const char* make, const char* model, int32_t transform)
+{
+	(void)data;
+	(void)wl_output;
+	(void)x;
+	(void)y;
+	(void)pw;
+	(void)ph;
+	(void)subpixel;
+	(void)make;
+	(void)model;
+	(void)transform;
+}
+
+
+static void output_mode(void* data, struct wl_output* wl_output, uint32_t flags, int32_t w, int32_t h, int32_t refresh)
+{
+	struct output* out = data;
+	(void)wl_output;
+	if (!(flags & WL_OUTPUT_MODE_CURRENT))
+		return;
+	out->width = w;
+	out->height = h;
+	out->refresh_mhz = refresh;
+}
+
+
+static void output_done(void* data, struct wl_output* wl_output)
+{
+	struct output* out = data;
+	(void)wl_output;
+	fprintf(stderr, "Output %d: %dx%d at %.2f Hz.\n", out->index, out->width, out->height, out->refresh_mhz / 1000.0);
+}
+
+
+static void output_scale(void* data, struct wl_output* wl_output, int32_t factor)
+{
+	(void)data;
+	(void)wl_output;
+	(void)factor;
+}
+
+
+static const struct wl_output_listener output_listener =
+{
+	.geometry = output_geometry,
+	.mode = output_mode,
+	.done = output_done,
+	.scale = output_scale,
+};
+
+
+// A window is rendered by the thread of the output it last entered. When it leaves that, another one that shows it takes over.
+static void surface_enter(void* data, struct wl_surface* wl_surface, struct wl_output* wl_output)
+{
+	struct window* win = data;
+	const struct output* out = wl_output_get_user_data(wl_output);
+	(void)wl_surface;
+	pthread_mutex_lock(&windows_lock);
+	win->outputs |= 1u << out->index;
+	if (!win->closed)
+		set_group(win, out->index);
+	pthread_mutex_unlock(&windows_lock);
+}
+
+
+static void surface_leave(void* data, struct wl_surface* wl_surface, struct wl_output* wl_output)
+{
+	struct window* win = data;
+	const struct output* out = wl_output_get_user_data(wl_output);
+	(void)wl_surface;
+	pthread_mutex_lock(&windows_lock);
+	win->outputs &= ~(1u << out->index);
+	if (win->group == out->index && win->outputs && !win->closed)
+		set_group(win, __builtin_ctz(win->outputs));
+	pthread_mutex_unlock(&windows_lock);
+}
+
+
+static const struct wl_surface_listener surface_listener =
+{
+	.enter = surface_enter,
+	.leave = surface_leave,
+};
+
+
 // dma buf protocol
 
 #if 0
@@ -163,13 +508,7 @@ static void dmabuf_modifier(void* data, struct zwp_linux_dmabuf_v1* zwp_linux_dm
 	(void)data;
 	(void)zwp_linux_dmabuf;
 	const uint64_t modifier = modifier_lo | ((uint64_t)modifier_hi) << 32UL;
-	if (modifier == 0)
-		fprintf
-		(
-			stderr,
-			"dmabuf listener found format %c%c%c%c\n",
-			(format>>0)&0xff, (format>>8)&0xff, (format>>16)&0xff, (format>>24)&0xff
-		);
+	dmabuf_caps_add(&dmabuf_caps, format, modifier, 0);
 }
 
 
@@ -201,8 +540,22 @@ static void global_registry_handler
 		wm_base = wl_registry_bind(registry, id, &xdg_wm_base_interface, 1);
 		xdg_wm_base_add_listener(wm_base, &xdg_wm_base_listener, NULL);
 	} else if (strcmp(interface, zwp_linux_dmabuf_v1_interface.name) == 0) {
-		dmabuf = wl_registry_bind(registry, id, &zwp_linux_dmabuf_v1_interface, 3);
-		zwp_linux_dmabuf_v1_add_listener(dmabuf, &dmabuf_listener, 0);
+		const uint32_t v = version < 4 ? 3 : 4;
+		dmabuf = wl_registry_bind(registry, id, &zwp_linux_dmabuf_v1_interface, v);
+		if (v >= ZWP_LINUX_DMABUF_V1_GET_DEFAULT_FEEDBACK_SINCE_VERSION)
+			dmabuf_feedback_init(&default_feedback, zwp_linux_dmabuf_v1_get_default_feedback(dmabuf), 0, 0);
+		else
+			zwp_linux_dmabuf_v1_add_listener(dmabuf, &dmabuf_listener, 0);
+	} else if (strcmp(interface, wl_output_interface.name) == 0 && num_outputs < MAX_OUTPUTS) {
+		// Version 2 has the done event.
+		struct output* out = outputs + num_outputs;
+		out->index = num_outputs++;
+		out->wl_output = wl_registry_bind(registry, id, &wl_output_interface, version < 2 ? version : 2);
+		wl_output_add_listener(out->wl_output, &output_listener, out);
+	} else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		viewporter = wl_registry_bind(registry, id, &wp_viewporter_interface, 1);
+	} else if (strcmp(interface, wp_fractional_scale_manager_v1_interface.name) == 0) {
+		fractional_scale_manager = wl_registry_bind(registry, id, &wp_fractional_scale_manager_v1_interface, 1);
 	}
 }
 
@@ -247,21 +600,8 @@ static EGLBoolean CreateEGLContext ()
 		return EGL_FALSE;
 	}
 
-	// Get configs
+	// Choose config: there is no need to list them all first.
 	EGLint numConfigs=0;
-	const EGLBoolean got_configs = eglGetConfigs(egl_dpy, NULL, 0, &numConfigs);
-	if (!got_configs)
-	{
-		fprintf(stderr, "eglGetConfigs() returned EGL_FALSE.\n");
-		return EGL_FALSE;
-	}
-	if (numConfigs == 0)
-	{
-		fprintf(stderr, "eglGetConfigs() yielded 0 configs.\n");
-		return EGL_FALSE;
-	}
-
-	// Choose config
 	EGLint fbAttribs[] =
 	{
 		EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
@@ -275,59 +615,198 @@ static EGLBoolean CreateEGLContext ()
 #endif
 		EGL_NONE
 	};
-	EGLConfig config = 0;
-	const int chosen = eglChooseConfig(egl_dpy, fbAttribs, &config, 1, &numConfigs);
-	if (chosen == EGL_FALSE)
-	{
-		fprintf(stderr, "eglChooseConfig() returned EGL_FALSE.\n");
-		return EGL_FALSE;
-	}
-	if (numConfigs<1)
+	// The config of an earlier run can be looked up by its ID, which is cheaper than matching all of them.
+	egl_config = gl_cache_load_config(egl_dpy, fbAttribs);
+	if (!egl_config)
 	{
-		fprintf(stderr, "eglChooseConfig() yielded %d configurations.\n", numConfigs);
-		return EGL_FALSE;
+		const int chosen = eglChooseConfig(egl_dpy, fbAttribs, &egl_config, 1, &numConfigs);
+		if (chosen == EGL_FALSE)
+		{
+			fprintf(stderr, "eglChooseConfig() returned EGL_FALSE.\n");
+			return EGL_FALSE;
+		}
+		if (numConfigs<1)
+		{
+			fprintf(stderr, "eglChooseConfig() yielded %d configurations.\n", numConfigs);
+			return EGL_FALSE;
+		}
+		gl_cache_store_config(egl_dpy, fbAttribs, egl_config);
 	}
 
-	// Create a surface
-	egl_srf = eglCreateWindowSurface(egl_dpy, config, native_win, NULL);
-	if ( egl_srf == EGL_NO_SURFACE )
-	{
-		fprintf(stderr, "eglCreateWindowSurface() returned EGL_NO_SURFACE.\n");
-		return EGL_FALSE;
-	}
-
-	// Create a GL context
+	// Create a GL context: one for all our windows, as every context costs the driver memory.
 	EGLint contextAttribs[] = { EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE, EGL_NONE };
-	egl_ctx = eglCreateContext(egl_dpy, config, EGL_NO_CONTEXT, contextAttribs );
+	egl_ctx = eglCreateContext(egl_dpy, egl_config, EGL_NO_CONTEXT, contextAttribs );
 	if ( egl_ctx == EGL_NO_CONTEXT )
 	{
 		fprintf(stderr, "eglCreateContext() returned EGL_NO_CONTEXT.\n");
 		return EGL_FALSE;
 	}
+	egl_thread_ctx = egl_ctx;
+
+	// For partial redraws: how old is the back buffer, and can we tell the compositor what changed?
+	const char* extensions = eglQueryString(egl_dpy, EGL_EXTENSIONS);
+	egl_has_buffer_age = extensions && strstr(extensions, "EGL_EXT_buffer_age") != 0;
+	if (extensions && strstr(extensions, "EGL_KHR_swap_buffers_with_damage"))
+		egl_swap_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC) eglGetProcAddress("eglSwapBuffersWithDamageKHR");
+	else if (extensions && strstr(extensions, "EGL_EXT_swap_buffers_with_damage"))
+		egl_swap_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC) eglGetProcAddress("eglSwapBuffersWithDamageEXT");
+	fprintf
+	(
+		stderr,
+		"Partial redraw: buffer age %s, swap with damage %s.\n",
+		egl_has_buffer_age ? "yes" : "no",
+		egl_swap_with_damage ? "yes" : "no"
+	);
+
+	return EGL_TRUE;
+}
+
 
-	// Make the context current
-	if ( !eglMakeCurrent(egl_dpy, egl_srf, egl_srf, egl_ctx) )
+
+// Make our context draw to the surface of this window, if it does not already.
+static EGLBoolean make_current(struct window* win)
+{
+	if (egl_current == win->egl_srf)
+		return EGL_TRUE;
+	if ( !eglMakeCurrent(egl_dpy, win->egl_srf, win->egl_srf, egl_thread_ctx) )
 	{
 		fprintf(stderr, "eglMakeCurrent() returned EGL_FALSE.\n");
 		return EGL_FALSE;
 	}
+	egl_current = win->egl_srf;
+	return EGL_TRUE;
+}
+
 
+static EGLBoolean create_window_surface(struct window* win)
+{
+	win->native_win = wl_egl_window_create(win->surface, win->allocw, win->alloch);
+	assert(win->native_win != EGL_NO_SURFACE);
+	win->egl_srf = eglCreateWindowSurface(egl_dpy, egl_config, win->native_win, NULL);
+	if ( win->egl_srf == EGL_NO_SURFACE )
+	{
+		fprintf(stderr, "eglCreateWindowSurface() returned EGL_NO_SURFACE.\n");
+		return EGL_FALSE;
+	}
+	if (!make_current(win))
+		return EGL_FALSE;
+	// The swap interval belongs to the surface. Frame callbacks pace us, or with several windows, the timer:
+	// then a blocking swap of one window would hold up the others.
+	if (use_frame_callbacks || num_windows > 1)
+		eglSwapInterval(egl_dpy, 0);
 	return EGL_TRUE;
 }
 
 
-static void draw()
+// The scene: a static background, with a few small widgets that change every frame.
+// Only the widgets get repainted, unless the back buffer is too old to know what is in it.
+
+#define TILE_SIZE	96
+#define BOX_SIZE	48
+
+static const GLfloat background[3] = { 0x20 / 255.0f, 0x70 / 255.0f, 0xa0 / 255.0f };
+
+// Each window starts its animation elsewhere, so they can be told apart.
+static void init_scene(struct window* win)
+{
+	win->tile_rgb[0] = 0x20;
+	win->tile_rgb[1] = 0x70;
+	win->tile_rgb[2] = (int16_t)(0xa0 - 0x10 * win->index);
+	win->tile_dr = 1;
+	win->tile_db = -1;
+	win->box_x = 40 * win->index;
+	win->box_y = 24 * win->index;
+	win->box_dx = 3;
+	win->box_dy = 2;
+}
+
+
+// Widget sizes are logical: in device pixels they grow with the scale.
+static int32_t scaled(const struct window* win, int32_t size)
+{
+	return (int32_t)((size * win->scale120 + 60) / 120);
+}
+
+
+// Keeps v within [lo,hi], and at lo when that range is empty.
+static int32_t clamp(int32_t v, int32_t lo, int32_t hi)
+{
+	if (v > hi) v = hi;
+	if (v < lo) v = lo;
+	return v;
+}
+
+
+static struct damage_rect tile_rect(const struct window* win)
+{
+	const struct damage_rect r = { scaled(win, 16), win->bufh - scaled(win, 16) - scaled(win, TILE_SIZE), scaled(win, TILE_SIZE), scaled(win, TILE_SIZE) };
+	return r;
+}
+
+
+static struct damage_rect box_rect(const struct window* win)
+{
+	const struct damage_rect r = { win->box_x, win->box_y, scaled(win, BOX_SIZE), scaled(win, BOX_SIZE) };
+	return r;
+}
+
+
+// Advance the animation by one frame, and collect what changed.
+static void animate(struct window* win, struct damage_region* damage)
 {
-	static int16_t red=0x20, grn=0x70, blu=0xa0;
-	static int16_t dr=1, db=-1;
+	const int32_t bufw = win->bufw;
+	const int32_t bufh = win->bufh;
+	damage_region_clear(damage);
+
+	win->tile_rgb[0] += win->tile_dr;
+	win->tile_rgb[2] += win->tile_db;
+	if (win->tile_rgb[0]<0 || win->tile_rgb[0]>0xff) win->tile_dr = -win->tile_dr;
+	if (win->tile_rgb[2]<0 || win->tile_rgb[2]>0xff) win->tile_db = -win->tile_db;
+	damage_region_add(damage, tile_rect(win), bufw, bufh);
+
+	// The box leaves its old spot, and covers a new one.
+	damage_region_add(damage, box_rect(win), bufw, bufh);
+	const int32_t box = scaled(win, BOX_SIZE);
+	win->box_x += win->box_dx;
+	win->box_y += win->box_dy;
+	if (win->box_x < 0 || win->box_x + box > bufw) { win->box_dx = -win->box_dx; win->box_x += 2*win->box_dx; }
+	if (win->box_y < 0 || win->box_y + box > bufh) { win->box_dy = -win->box_dy; win->box_y += 2*win->box_dy; }
+	// After a shrink or a rescale, the box can be left far outside: a bounce alone would not bring it back.
+	win->box_x = clamp(win->box_x, 0, bufw - box);
+	win->box_y = clamp(win->box_y, 0, bufh - box);
+	damage_region_add(damage, box_rect(win), bufw, bufh);
+}
+
 
-	glClearColor(red / 255.0f, grn / 255.0f, blu / 255.0f, 1.0f);
+// Clear the intersection of two rectangles, in the given colour.
+static void fill(struct damage_rect clip, struct damage_rect rect, GLfloat r, GLfloat g, GLfloat b)
+{
+	const int32_t x0 = clip.x > rect.x ? clip.x : rect.x;
+	const int32_t y0 = clip.y > rect.y ? clip.y : rect.y;
+	const int32_t x1 = clip.x+clip.w < rect.x+rect.w ? clip.x+clip.w : rect.x+rect.w;
+	const int32_t y1 = clip.y+clip.h < rect.y+rect.h ? clip.y+clip.h : rect.y+rect.h;
+	if (x1 <= x0 || y1 <= y0)
+		return;
+	glScissor(x0, y0, x1-x0, y1-y0);
+	glClearColor(r, g, b, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT);
+}
+
 
-	red += dr;
-	blu += db;
-	if (red<0 || red>0xff) dr = -dr;
-	if (blu<0 || blu>0xff) db = -db;
+// Repaint the scene, but only inside the given rectangles.
+static void draw(const struct window* win, const struct damage_region* repaint)
+{
+	const struct damage_rect tile = tile_rect(win);
+	const struct damage_rect box = box_rect(win);
+	glEnable(GL_SCISSOR_TEST);
+	for (int i=0; i<repaint->num_rects; ++i)
+	{
+		const struct damage_rect clip = repaint->rects[i];
+		fill(clip, clip, background[0], background[1], background[2]);
+		fill(clip, tile, win->tile_rgb[0] / 255.0f, win->tile_rgb[1] / 255.0f, win->tile_rgb[2] / 255.0f);
+		fill(clip, box, 1.0f, 0.8f, 0.2f);
+	}
+	glDisable(GL_SCISSOR_TEST);
 }
 
 
@@ -348,6 +827,8 @@ static int connect_to_wayland()
 	wl_display_dispatch(native_dpy);
 	wl_display_roundtrip(native_dpy);
 
+	dmabuf_caps_print(default_feedback.caps.num_formats ? &default_feedback.caps : &dmabuf_caps, stderr);
+
 	if (!compositor)
 		fprintf(stderr, "Wayland server did not provide us with a compositor.\n");
 	if (!wm_base)
@@ -356,27 +837,640 @@ static int connect_to_wayland()
 }
 
 
+// Create a timer that fires at the given rate, to pace our redraws.
+static int create_timer(int hz)
+{
+	const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+	{
+		fprintf(stderr, "timerfd_create() failed: %s\n", strerror(errno));
+		return -1;
+	}
+	// Periods of a second or more do not fit in tv_nsec.
+	const long long period = 1000000000LL / hz;
+	const struct timespec interval = { .tv_sec = period / 1000000000LL, .tv_nsec = period % 1000000000LL };
+	const struct itimerspec spec = { .it_interval = interval, .it_value = interval };
+	if (timerfd_settime(fd, 0, &spec, NULL) < 0)
+	{
+		fprintf(stderr, "timerfd_settime() failed: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+static void signal_fd(int fd)
+{
+	const uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) != sizeof(one))
+		fprintf(stderr, "eventfd write failed: %s\n", strerror(errno));
+}
+
+
+static void drain_fd(int fd)
+{
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "eventfd read failed: %s\n", strerror(errno));
+}
+
+
+// Block until the compositor or the timer has something for us, or with block 0, only take what is there already.
+// Wayland events are read and dispatched here, using the prepare_read/read_events protocol.
+// Returns -1 when the connection to the compositor is lost.
+static int wait_for_events(int block, int* timer_ready)
+{
+	*timer_ready = 0;
+
+	while (wl_display_prepare_read(native_dpy) != 0)
+		wl_display_dispatch_pending(native_dpy);
+
+	short wl_events = POLLIN;
+	if (wl_display_flush(native_dpy) < 0)
+	{
+		if (errno != EAGAIN)
+		{
+			wl_display_cancel_read(native_dpy);
+			return -1;
+		}
+		wl_events |= POLLOUT; // Socket is full: wake up when we can flush the rest.
+	}
+
+	struct pollfd fds[3] =
+	{
+		{ .fd = wl_display_get_fd(native_dpy), .events = wl_events },
+		{ .fd = timer_fd,                      .events = POLLIN },
+		{ .fd = main_wake_fd,                  .events = POLLIN },
+	};
+	if (poll(fds, 3, block ? -1 : 0) < 0)
+	{
+		wl_display_cancel_read(native_dpy);
+		return errno == EINTR ? 0 : -1;
+	}
+
+	if (fds[0].revents & (POLLHUP | POLLERR))
+	{
+		// The compositor went away: poll() would keep returning this.
+		wl_display_cancel_read(native_dpy);
+		fprintf(stderr, "Lost the connection to the compositor.\n");
+		return -1;
+	}
+	if (fds[0].revents & POLLIN)
+	{
+		if (wl_display_read_events(native_dpy) < 0)
+			return -1;
+	}
+	else
+		wl_display_cancel_read(native_dpy);
+
+	if (fds[1].revents & POLLIN)
+	{
+		// More than one expiration means we missed ticks.
+		uint64_t expirations;
+		if (read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+			*timer_ready = (int)expirations;
+	}
+	if (fds[2].revents & POLLIN)
+		drain_fd(main_wake_fd);
+
+	return wl_display_dispatch_pending(native_dpy) < 0 ? -1 : 0;
+}
+
+
+static void render_frame(struct window* win)
+{
+	if (!make_current(win))
+		return;
+
+	if (use_frame_callbacks && !win->frame_callback)
+	{
+		// Ask to be told when to draw the next frame: this gets committed by the swap below.
+		// An occluded window will not get its callback, so we stop drawing it altogether.
+		win->frame_callback = wl_surface_frame(win->frame_surface ? win->frame_surface : win->surface);
+		wl_callback_add_listener(win->frame_callback, &frame_listener, win);
+	}
+
+	const int32_t bufw = win->bufw;
+	const int32_t bufh = win->bufh;
+	struct damage_region damage;
+	animate(win, &damage);
+
+	// Bring the back buffer up to date: repaint what changed since it was last shown.
+	EGLint age = 0;
+	if (egl_has_buffer_age)
+		eglQuerySurface(egl_dpy, win->egl_srf, EGL_BUFFER_AGE_EXT, &age);
+	// A reset tracker means a first frame, or a rescaled one: EGL may still report a buffer age then, as the
+	// buffers survive a rescale within the bucket, but neither we nor the compositor can trust any of their contents.
+	const int fresh = win->damage_tracker.frame == 0;
+	struct damage_region repaint;
+	if (fresh || !damage_tracker_repaint(&win->damage_tracker, age, &damage, &repaint, bufw, bufh))
+	{
+		const struct damage_rect everything = { 0, 0, bufw, bufh };
+		damage_region_clear(&repaint);
+		damage_region_add(&repaint, everything, bufw, bufh);
+	}
+	if (fresh)
+		damage = repaint;
+	draw(win, &repaint);
+	damage_tracker_push(&win->damage_tracker, &damage);
+
+	// Tell the compositor only about this frame's damage. Our rects are laid out as EGL wants them: x, y, w, h.
+	if (egl_swap_with_damage)
+		egl_swap_with_damage(egl_dpy, win->egl_srf, (const EGLint*)damage.rects, damage.num_rects);
+	else
+		eglSwapBuffers(egl_dpy, win->egl_srf);
+}
+
+
+// Make a toplevel that we can draw into. Its EGL surface is made once the compositor configured it.
+static int create_window(struct window* win, int index)
+{
+	memset(win, 0, sizeof(*win));
+	win->index = index;
+	win->winw = 512;
+	win->winh = 512;
+	win->scale120 = 120;
+	win->preferred_scale120 = 120;
+	win->bufw = 512;
+	win->bufh = 512;
+	win->group = -1;
+	win->owner = -1;
+	init_scene(win);
+
+	win->surface = wl_compositor_create_surface(compositor);
+	if (!win->surface)
+	{
+		fprintf(stderr, "The compositor failed to create a surface.\n");
+		return 0;
+	}
+	wl_surface_add_listener(win->surface, &surface_listener, win);
+
+	win->xdg_surface = xdg_wm_base_get_xdg_surface(wm_base, win->surface);
+	assert(win->xdg_surface);
+	xdg_surface_add_listener(win->xdg_surface, &xdg_surface_listener, win);
+
+	win->xdg_toplevel = xdg_surface_get_toplevel(win->xdg_surface);
+	assert(win->xdg_toplevel);
+	char title[64];
+	if (num_windows > 1)
+		snprintf(title, sizeof(title), "Wayland EGL example (%d/%d)", index + 1, num_windows);
+	else
+		snprintf(title, sizeof(title), "Wayland EGL example");
+	xdg_toplevel_set_title(win->xdg_toplevel, title);
+	xdg_toplevel_add_listener(win->xdg_toplevel, &xdg_toplevel_listener, win);
+
+	wl_surface_commit(win->surface);
+
+	// Render at native resolution, if the compositor tells us its scale.
+	if (viewporter)
+		win->viewport = wp_viewporter_get_viewport(viewporter, win->surface);
+	if (win->viewport && fractional_scale_manager)
+	{
+		win->fractional_scale = wp_fractional_scale_manager_v1_get_fractional_scale(fractional_scale_manager, win->surface);
+		wp_fractional_scale_v1_add_listener(win->fractional_scale, &fractional_scale_listener, win);
+	}
+	apply_scale(win);
+	return 1;
+}
+
+
+static void destroy_window(struct window* win)
+{
+	if (!win->surface)
+		return;
+	if (win->egl_srf)
+	{
+		if (egl_current == win->egl_srf)
+		{
+			eglMakeCurrent(egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+			egl_current = 0;
+		}
+		eglDestroySurface(egl_dpy, win->egl_srf);
+	}
+	win->egl_srf = 0;
+	if (win->native_win)
+		wl_egl_window_destroy(win->native_win);
+	win->native_win = 0;
+	if (win->frame_callback)
+		wl_callback_destroy(win->frame_callback);
+	win->frame_callback = 0;
+	if (win->fractional_scale)
+		wp_fractional_scale_v1_destroy(win->fractional_scale);
+	win->fractional_scale = 0;
+	if (win->viewport)
+		wp_viewport_destroy(win->viewport);
+	win->viewport = 0;
+	if (win->region)
+		wl_region_destroy(win->region);
+	win->region = 0;
+	xdg_toplevel_destroy(win->xdg_toplevel);
+	win->xdg_toplevel = 0;
+	xdg_surface_destroy(win->xdg_surface);
+	win->xdg_surface = 0;
+	wl_surface_destroy(win->surface);
+	win->surface = 0;
+}
+
+
 static void cleanup_resources()
 {
-	eglDestroySurface(egl_dpy, egl_srf);
-	egl_srf = 0;
-	wl_egl_window_destroy(native_win);
-	native_win = 0;
-	xdg_toplevel_destroy(xdg_toplevel);
-	xdg_toplevel = 0;
-	xdg_surface_destroy(xdg_surface);
-	xdg_surface = 0;
-	wl_surface_destroy(surface);
-	surface = 0;
-	eglDestroyContext(egl_dpy, egl_ctx);
+	for (int i=0; i<num_windows; ++i)
+		destroy_window(windows + i);
+	if (egl_ctx)
+		eglDestroyContext(egl_dpy, egl_ctx);
 	egl_ctx = 0;
+	for (int i=0; i<num_outputs; ++i)
+		wl_output_destroy(outputs[i].wl_output);
+	num_outputs = 0;
+}
+
+
+// Render threads: one per output group.
+
+// Wakes a render thread, to claim or let go of windows, or to quit.
+// An eventfd, rather than a wl_display.sync on its queue: that callback could come in before it has its listener.
+static void wake_output(struct output* out)
+{
+	if (out->running)
+		signal_fd(out->wake_fd);
+}
+
+
+static void wake_main(void)
+{
+	if (main_wake_fd >= 0)
+		signal_fd(main_wake_fd);
+}
+
+
+// Call with the windows locked.
+static void wake_window(struct window* win)
+{
+	if (win->owner >= 0)
+		wake_output(outputs + win->owner);
+}
+
+
+// A render thread takes over a window: its frame callbacks now come in on our queue.
+static void claim_window(struct output* out, struct window* win)
+{
+	win->owner = out->index;
+	win->frame_surface = wl_proxy_create_wrapper(win->surface);
+	wl_proxy_set_queue((struct wl_proxy*)win->frame_surface, out->queue);
+	win->redraw_needed = 1;
+	damage_tracker_reset(&win->damage_tracker);
+	// Frame callbacks pace us, so the swap must never block.
+	if (make_current(win))
+		eglSwapInterval(egl_dpy, 0);
+}
+
+
+// And lets go of it, for the thread of another output, or for the main thread.
+static void release_window(struct window* win)
+{
+	if (egl_current == win->egl_srf)
+	{
+		eglMakeCurrent(egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		egl_current = 0;
+	}
+	if (win->frame_callback)
+		wl_callback_destroy(win->frame_callback);
+	win->frame_callback = 0;
+	wl_proxy_wrapper_destroy(win->frame_surface);
+	win->frame_surface = 0;
+	win->owner = -1;
+	if (done || threads_stop)
+		return;
+	if (win->group >= 0)
+		wake_output(outputs + win->group);
+	else
+		wake_main();
+}
+
+
+// Like wait_for_events(), for the queue of one output: frame callbacks of its windows, or a wake-up.
+static int wait_for_output_events(struct output* out)
+{
+	// Events that another thread read for us already: handle those first.
+	if (wl_display_prepare_read_queue(native_dpy, out->queue) != 0)
+		return wl_display_dispatch_queue_pending(native_dpy, out->queue) < 0 ? -1 : 0;
+
+	if (wl_display_flush(native_dpy) < 0 && errno != EAGAIN)
+	{
+		wl_display_cancel_read(native_dpy);
+		return -1;
+	}
+
+	struct pollfd fds[2] =
+	{
+		{ .fd = wl_display_get_fd(native_dpy), .events = POLLIN },
+		{ .fd = out->wake_fd,                  .events = POLLIN },
+	};
+	if (poll(fds, 2, -1) < 0)
+	{
+		wl_display_cancel_read(native_dpy);
+		return errno == EINTR ? 0 : -1;
+	}
+
+	if (fds[0].revents & (POLLHUP | POLLERR))
+	{
+		wl_display_cancel_read(native_dpy);
+		return -1;
+	}
+	if (fds[0].revents & POLLIN)
+	{
+		if (wl_display_read_events(native_dpy) < 0)
+			return -1;
+	}
+	else
+		wl_display_cancel_read(native_dpy);
+
+	if (fds[1].revents & POLLIN)
+		drain_fd(out->wake_fd);
+
+	return wl_display_dispatch_queue_pending(native_dpy, out->queue) < 0 ? -1 : 0;
+}
+
+
+static void* output_main(void* arg)
+{
+	struct output* out = arg;
+	const EGLint contextAttribs[] = { EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE };
+	egl_thread_ctx = eglCreateContext(egl_dpy, egl_config, EGL_NO_CONTEXT, contextAttribs);
+	if (egl_thread_ctx == EGL_NO_CONTEXT)
+	{
+		// The main thread hands our windows to another output.
+		fprintf(stderr, "eglCreateContext() returned EGL_NO_CONTEXT for output %d.\n", out->index);
+		pthread_mutex_lock(&windows_lock);
+		out->failed = 1;
+		wake_main();
+		pthread_mutex_unlock(&windows_lock);
+		return 0;
+	}
+
+	struct window* due[MAX_WINDOWS];
+	for (;;)
+	{
+		int num_due = 0;
+		pthread_mutex_lock(&windows_lock);
+		const int quit = done || threads_stop;
+		for (int i=0; i<num_windows; ++i)
+		{
+			struct window* win = windows + i;
+			if (win->owner == out->index && (quit || win->group != out->index))
+				release_window(win);
+			else if (win->owner < 0 && win->group == out->index && !quit)
+				claim_window(out, win);
+			if (win->owner == out->index && win->redraw_needed)
+			{
+				win->redraw_needed = 0;
+				if (resize_stress)
+					stress_resize(win, report.frames);
+				apply_configure(win);
+				due[num_due++] = win;
+			}
+		}
+		pthread_mutex_unlock(&windows_lock);
+		if (quit)
+			break;
+
+		// Each swap commits, and asks for the next frame callback.
+		for (int i=0; i<num_due; ++i)
+		{
+			render_frame(due[i]);
+			pthread_mutex_lock(&windows_lock);
+			if (report.startup_ms == 0)
+				report.startup_ms = startup_trace_mark("first frame committed");
+			if (++report.frames == bench_frames)
+			{
+				done = 1;
+				wake_main();
+			}
+			pthread_mutex_unlock(&windows_lock);
+		}
+
+		// Sleep until a frame callback, or a wake-up, comes in for this output.
+		if (wait_for_output_events(out) < 0)
+		{
+			pthread_mutex_lock(&windows_lock);
+			done = 1;
+			wake_main();
+			pthread_mutex_unlock(&windows_lock);
+		}
+	}
+
+	eglMakeCurrent(egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(egl_dpy, egl_thread_ctx);
+	egl_thread_ctx = 0;
+	return 0;
+}
+
+
+static void end_output(struct output* out)
+{
+	wl_event_queue_destroy(out->queue);
+	out->queue = 0;
+	close(out->wake_fd);
+	out->wake_fd = -1;
+}
+
+
+static int start_output(struct output* out)
+{
+	out->queue = wl_display_create_queue(native_dpy);
+	out->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (out->wake_fd < 0 || pthread_create(&out->thread, 0, output_main, out) != 0)
+	{
+		fprintf(stderr, "Cannot start a render thread for output %d.\n", out->index);
+		end_output(out);
+		out->failed = 1;
+		return 0;
+	}
+	out->running = 1;
+	fprintf(stderr, "Output %d has a render thread.\n", out->index);
+	return 1;
+}
+
+
+// The output whose thread can render for the given one: itself, or else any other that works. -1 if none does.
+static int usable_output(int group)
+{
+	if (!outputs[group].failed && (outputs[group].running || start_output(outputs + group)))
+		return group;
+	for (int i=0; i<num_outputs; ++i)
+		if (!outputs[i].failed && (outputs[i].running || start_output(outputs + i)))
+			return i;
+	return -1;
+}
+
+
+// Hand a window to the thread of another output (or to none, with -1). Call with the windows locked.
+static void set_group(struct window* win, int group)
+{
+	if (use_output_threads && group >= 0)
+	{
+		group = usable_output(group);
+		if (group < 0)
+		{
+			threads_failed = 1;
+			return;
+		}
+	}
+	if (group == win->group)
+		return;
+	win->group = group;
+	if (!use_output_threads)
+		return;
+	if (group >= 0)
+		fprintf(stderr, "Window %d is rendered for output %d.\n", win->index, group);
+	// The current owner lets go first; it then wakes the new one.
+	if (win->owner >= 0)
+		wake_output(outputs + win->owner);
+	else if (group >= 0)
+		wake_output(outputs + group);
+}
+
+
+// Join the threads whose EGL context failed, and give their windows to another output. Call with the windows locked.
+static void reap_failed_outputs(void)
+{
+	for (int i=0; i<num_outputs; ++i)
+	{
+		struct output* out = outputs + i;
+		if (!out->failed || !out->running)
+			continue;
+		pthread_join(out->thread, 0);
+		out->running = 0;
+		end_output(out);
+		for (int w=0; w<num_windows; ++w)
+			if (windows[w].group == i && !windows[w].closed)
+			{
+				windows[w].group = -1;
+				set_group(windows + w, i);
+			}
+	}
+}
+
+
+static void stop_outputs(void)
+{
+	pthread_mutex_lock(&windows_lock);
+	threads_stop = 1;
+	for (int i=0; i<num_outputs; ++i)
+		wake_output(outputs + i);
+	pthread_mutex_unlock(&windows_lock);
+	for (int i=0; i<num_outputs; ++i)
+	{
+		struct output* out = outputs + i;
+		if (!out->running)
+			continue;
+		pthread_join(out->thread, 0);
+		out->running = 0;
+		end_output(out);
+	}
+}
+
+
+// With -o, the main thread only dispatches the events of the compositor, and destroys the windows that were closed.
+// If no output gets a working render thread, it stops the others, and goes back to rendering all windows itself.
+static void run_output_threads(void)
+{
+	for (;;)
+	{
+		int open = 0;
+		pthread_mutex_lock(&windows_lock);
+		reap_failed_outputs();
+		for (int i=0; i<num_windows; ++i)
+		{
+			struct window* win = windows + i;
+			if (win->closed)
+				set_group(win, -1);
+			if (win->closed && win->owner < 0)
+				destroy_window(win);
+			if (win->surface)
+				open++;
+		}
+		if (!open)
+			done = 1;
+		const int quit = done || threads_failed;
+		pthread_mutex_unlock(&windows_lock);
+		if (quit)
+			break;
+		int timer_ready;
+		if (wait_for_events(1, &timer_ready) < 0)
+			break;
+	}
+	stop_outputs();
+	close(main_wake_fd);
+	main_wake_fd = -1;
+	if (done || !threads_failed)
+	{
+		done = 1;
+		return;
+	}
+
+	fprintf(stderr, "No output has a render thread: rendering on the main thread.\n");
+	const EGLint contextAttribs[] = { EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE };
+	egl_ctx = eglCreateContext(egl_dpy, egl_config, EGL_NO_CONTEXT, contextAttribs);
+	if (egl_ctx == EGL_NO_CONTEXT)
+	{
+		fprintf(stderr, "eglCreateContext() returned EGL_NO_CONTEXT.\n");
+		egl_ctx = 0;
+		done = 1;
+		return;
+	}
+	egl_thread_ctx = egl_ctx;
+	use_output_threads = 0;
+	for (int i=0; i<num_windows; ++i)
+	{
+		windows[i].redraw_needed = 1;
+		damage_tracker_reset(&windows[i].damage_tracker);
+	}
 }
 
 
 int main(int argc, char* argv[])
 {
-	(void)argc;
-	(void)argv;
+	startup_trace_begin();
+	int opt;
+	while ((opt = getopt(argc, argv, "froc:w:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'f':
+				use_frame_callbacks = 1;
+				break;
+			case 'r':
+				resize_stress = 1;
+				break;
+			case 'o':
+				use_output_threads = 1;
+				use_frame_callbacks = 1;
+				break;
+			case 'c':
+				bench_frames = atoi(optarg);
+				break;
+			case 'w':
+				num_windows = atoi(optarg);
+				if (num_windows < 1 || num_windows > MAX_WINDOWS)
+				{
+					fprintf(stderr, "The nr of windows must be 1..%d.\n", MAX_WINDOWS);
+					exit(1);
+				}
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-f] [-r] [-o] [-c frames] [-w windows]\n", argv[0]);
+				fprintf(stderr, "  -f  Pace rendering by frame callbacks instead of a blocking eglSwapBuffers().\n");
+				fprintf(stderr, "  -r  Resize stress: resize the window a few times per frame.\n");
+				fprintf(stderr, "  -o  Render the windows of each output on a thread of its own, paced by frame callbacks.\n");
+				fprintf(stderr, "  -c  Benchmark: quit after this many frames, and print the results as JSON on stdout.\n");
+				fprintf(stderr, "  -w  Open this many windows (up to %d), that share one GL context.\n", MAX_WINDOWS);
+				exit(1);
+		}
+	}
+	fprintf(stderr, "Rendering is paced by %s.\n", use_frame_callbacks ? "frame callbacks" : "a timer and eglSwapBuffers()");
+
 	// First order of business:
 	// Make sure we have a display, a compositor and a WM Base.
 	const int connected = connect_to_wayland();
@@ -385,45 +1479,130 @@ int main(int argc, char* argv[])
 		fprintf(stderr, "Giving up.\n");
 		exit(2);
 	}
-
-	// Make a surface that we can draw into.
-	surface = wl_compositor_create_surface(compositor);
-	if (!surface)
+	startup_trace_mark("connected to compositor");
+	if (use_output_threads && !num_outputs)
 	{
-		fprintf(stderr, "The compositor failed to create a surface.\n");
-		exit(3);
+		fprintf(stderr, "The compositor lists no outputs: rendering on the main thread.\n");
+		use_output_threads = 0;
 	}
 
-	xdg_surface = xdg_wm_base_get_xdg_surface(wm_base, surface);
-	assert(xdg_surface);
-	xdg_surface_add_listener(xdg_surface, &xdg_surface_listener, NULL);
+	// Make surfaces that we can draw into.
+	for (int i=0; i<num_windows; ++i)
+		if (!create_window(windows + i, i))
+			exit(3);
 
-	xdg_toplevel = xdg_surface_get_toplevel(xdg_surface);
-	assert(xdg_toplevel);
-	xdg_toplevel_set_title(xdg_toplevel, "Wayland EGL example");
-	xdg_toplevel_add_listener(xdg_toplevel, &xdg_toplevel_listener, NULL);
+	// We cannot attach buffers before the first configure event was acked.
+	for (int i=0; i<num_windows; ++i)
+	{
+		while (!windows[i].configure_pending)
+			wl_display_dispatch(native_dpy);
+		apply_configure(windows + i);
+	}
+	startup_trace_mark("window configured");
 
-	wl_surface_commit(surface);
+	// To do the drawing, we need an OpenGLES context. Each window gets a surface for it, and is made opaque.
+	CreateEGLContext();
+	for (int i=0; i<num_windows; ++i)
+	{
+		set_opaque_region(windows + i);
+		if (!create_window_surface(windows + i))
+			exit(3);
+	}
+	startup_trace_mark("EGL initialized");
 
-	// Create a native window, and make it opaque.
-	region = wl_compositor_create_region(compositor);
-	wl_region_add(region, 0, 0, winw, winh);
-	wl_surface_set_opaque_region(surface, region);
-	native_win = wl_egl_window_create(surface, winw, winh);
-	assert(native_win != EGL_NO_SURFACE);
+	if (use_frame_callbacks)
+	{
+		// Frame callbacks pace us, so the swap must never block.
+		for (int i=0; i<num_windows; ++i)
+			windows[i].redraw_needed = 1;
+	}
+	else
+	{
+		// Redraws are paced by a timer, so that we sleep in between frames.
+		timer_fd = create_timer(60);
+		if (timer_fd < 0)
+			exit(4);
+	}
 
-	// To do the drawing, we need an OpenGLES context.
-	CreateEGLContext();
+	bench_report_start
+	(
+		&report,
+		"minimal_wayland_client",
+		resize_stress ? "resize" : use_output_threads ? "output_threads" : use_frame_callbacks ? "frame_callbacks" : "timer"
+	);
 
-	// Main loop.
-	while (!done)
+	if (use_output_threads)
 	{
-		wl_display_dispatch_pending(native_dpy);
-		draw();
-		eglSwapBuffers(egl_dpy, egl_srf);
+		// Our context is no longer needed: the surfaces go to the threads of their outputs, which have their own.
+		// Until the compositor tells us where a window is shown, the first output renders it.
+		eglMakeCurrent(egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		egl_current = 0;
+		eglDestroyContext(egl_dpy, egl_ctx);
+		egl_ctx = 0;
+		main_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		pthread_mutex_lock(&windows_lock);
+		for (int i=0; i<num_windows; ++i)
+			set_group(windows + i, windows[i].outputs ? __builtin_ctz(windows[i].outputs) : 0);
+		pthread_mutex_unlock(&windows_lock);
+		run_output_threads();
 	}
 
+	// Main loop: only wake up when the compositor or the timer has something for us.
+	// All windows that are due get drawn in the same iteration, one after the other, with the same context.
+	while (!use_output_threads && !done)
+	{
+		// Frame callbacks only come after a commit: a window that is due gets drawn without waiting for one.
+		int due = 0;
+		for (int i=0; i<num_windows; ++i)
+			due |= windows[i].surface && windows[i].redraw_needed;
+		int timer_ready;
+		if (wait_for_events(!due, &timer_ready) < 0)
+			break;
+		if (timer_ready > 1)
+			report.dropped += timer_ready - 1;
+		int rendered = 0;
+		int open = 0;
+		for (int i=0; i<num_windows; ++i)
+		{
+			struct window* win = windows + i;
+			if (win->closed)
+				destroy_window(win);
+			if (!win->surface)
+				continue;
+			open++;
+			if (!timer_ready && !win->redraw_needed)
+				continue;
+			win->redraw_needed = 0;
+			if (resize_stress)
+				stress_resize(win, report.frames);
+			apply_configure(win);
+			render_frame(win);
+			rendered = 1;
+		}
+		if (!open)
+			done = 1;
+		if (rendered)
+		{
+			if (report.startup_ms == 0)
+				report.startup_ms = startup_trace_mark("first frame committed");
+			if (++report.frames == bench_frames)
+				done = 1;
+		}
+	}
+
+	if (bench_frames)
+		bench_report_print(&report, stdout);
+
 	cleanup_resources();
+	if (timer_fd >= 0)
+		close(timer_fd);
+
+	dmabuf_caps_clear(&dmabuf_caps);
+	dmabuf_feedback_fini(&default_feedback);
+	if (fractional_scale_manager)
+		wp_fractional_scale_manager_v1_destroy(fractional_scale_manager);
+	if (viewporter)
+		wp_viewporter_destroy(viewporter);
 
 	wl_display_disconnect(native_dpy);
 	native_dpy = 0;
@@ -431,4 +1610,3 @@ int main(int argc, char* argv[])
 
 	exit(0);
 }
-
@@ -0,0 +1,165 @@
+//
+// Micro-benchmark for the CPU colour conversion kernels.
+// Runs each kernel, with each set of SIMD code this CPU has, on frames of 720p, 1080p and 4K,
+// and prints one JSON object per run: the throughput in GB/s counts the bytes read plus the bytes written.
+// Every result is checked against the plain C kernels.
+//
+// Usage: pixel_bench [seconds per run]
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pixel_convert.h"
+
+enum kernel
+{
+	KERNEL_COPY,		// A YUYV frame, as-is.
+	KERNEL_YUYV_TO_XRGB,
+	KERNEL_NV12_TO_XRGB,
+	KERNEL_YUYV_TO_NV12,
+	KERNEL_COUNT
+};
+
+static const char* kernel_names[KERNEL_COUNT] =
+{
+	"copy",
+	"yuyv_to_xrgb",
+	"nv12_to_xrgb",
+	"yuyv_to_nv12",
+};
+
+static const struct
+{
+	const char*	name;
+	int		width;
+	int		height;
+} sizes[] =
+{
+	{ "720p", 1280, 720 },
+	{ "1080p", 1920, 1080 },
+	{ "4k", 3840, 2160 },
+};
+
+static const char* impls[] = { "avx2", "sse2", "neon", "scalar" };
+
+
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// The size of a converted frame.
+static size_t dst_size(enum kernel k, int w, int h)
+{
+	switch (k)
+	{
+		case KERNEL_COPY:		return (size_t)w * h * 2;
+		case KERNEL_YUYV_TO_NV12:	return (size_t)w * h * 3 / 2;
+		default:			return (size_t)w * h * 4;
+	}
+}
+
+
+// Converts one frame. Sources are tightly packed, XRGB rows too. NV12 is luma followed by chroma, in src or dst.
+// Returns the nr of bytes read plus written.
+static size_t run_kernel(enum kernel k, int w, int h, const uint8_t* src, uint8_t* dst)
+{
+	switch (k)
+	{
+		case KERNEL_COPY:
+			pixel_convert_copy_plane(src, w*2, dst, w*2, w*2, h);
+			return (size_t)w * h * 4;
+		case KERNEL_YUYV_TO_XRGB:
+			pixel_convert_yuyv_to_xrgb(src, w*2, dst, w*4, w, h);
+			return (size_t)w * h * 6;
+		case KERNEL_NV12_TO_XRGB:
+			pixel_convert_nv12_to_xrgb(src, w, src + (size_t)w * h, w, dst, w*4, w, h);
+			return (size_t)w * h * 3 / 2 + (size_t)w * h * 4;
+		case KERNEL_YUYV_TO_NV12:
+			pixel_convert_yuyv_to_nv12(src, w*2, dst, w, dst + (size_t)w * h, w, w, h);
+			return (size_t)w * h * 2 + (size_t)w * h * 3 / 2;
+		default:
+			return 0;
+	}
+}
+
+
+int main(int argc, char* argv[])
+{
+	const double run_seconds = argc > 1 ? atof(argv[1]) : 0.25;
+
+	// Big enough for the largest source (YUYV) and destination (XRGB).
+	const size_t max_pixels = (size_t)3840 * 2160;
+	uint8_t* src = aligned_alloc(64, max_pixels * 2);
+	uint8_t* dst = aligned_alloc(64, max_pixels * 4);
+	uint8_t* ref = aligned_alloc(64, max_pixels * 4);
+	if (!src || !dst || !ref)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+	srand(1);
+	for (size_t i=0; i<max_pixels * 2; ++i)
+		src[i] = rand();
+
+	int failed = 0;
+	for (size_t s=0; s<sizeof(sizes)/sizeof(sizes[0]); ++s)
+	{
+		const int w = sizes[s].width;
+		const int h = sizes[s].height;
+		for (int k=0; k<KERNEL_COUNT; ++k)
+		{
+			const size_t size = dst_size(k, w, h);
+			pixel_convert_use("scalar");
+			run_kernel(k, w, h, src, ref);
+			for (size_t i=0; i<sizeof(impls)/sizeof(impls[0]); ++i)
+			{
+				if (pixel_convert_use(impls[i]) < 0)
+					continue;
+				memset(dst, 0, size);
+				run_kernel(k, w, h, src, dst);
+				if (memcmp(dst, ref, size))
+				{
+					fprintf(stderr, "%s with %s differs from the scalar result at %s.\n", kernel_names[k], impls[i], sizes[s].name);
+					failed = 1;
+				}
+
+				// Run for a while, in whole frames.
+				int frames = 0;
+				size_t bytes = 0;
+				const double start = now_s();
+				double elapsed;
+				do
+				{
+					bytes += run_kernel(k, w, h, src, dst);
+					frames++;
+					elapsed = now_s() - start;
+				} while (elapsed < run_seconds);
+
+				printf
+				(
+					"{\"program\":\"pixel_bench\",\"kernel\":\"%s\",\"impl\":\"%s\",\"size\":\"%s\",\"frames\":%d,\"ms_per_frame\":%.3f,\"gbps\":%.2f}\n",
+					kernel_names[k],
+					impls[i],
+					sizes[s].name,
+					frames,
+					elapsed * 1e3 / frames,
+					bytes / elapsed / 1e9
+				);
+				fflush(stdout);
+			}
+		}
+	}
+	free(src);
+	free(dst);
+	free(ref);
+	return failed;
+}
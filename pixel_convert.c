@@ -0,0 +1,498 @@
+//
+// Copying and converting video frames on the CPU, for when the compositor cannot take our dmabufs.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#include <string.h>
+
+#include "pixel_convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#	define PIXEL_X86
+#	include <immintrin.h>
+#elif defined(__ARM_NEON)
+#	define PIXEL_NEON
+#	include <arm_neon.h>
+#endif
+
+
+// YUV to RGB, BT.601 limited range, in 16 bit fixed point:
+// luma and chroma are scaled by 64, and multiplied by coefficients in 2.14 (keeping the high 16 bits),
+// which leaves RGB scaled by 16. The SIMD kernels do exactly the same sums, so their results match ours.
+#define CY	19071	// 1.164
+#define CRV	26149	// 1.596
+#define CGU	6416	// 0.392
+#define CGV	13320	// 0.813
+#define CBU	16663	// 2.017, minus 1 (which fits no int16).
+
+static inline int mulhi(int a, int b)
+{
+	return (a * b) >> 16;
+}
+
+static inline uint8_t clamp8(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : (uint8_t)v;
+}
+
+static inline uint32_t yuv_to_xrgb(int y, int u, int v)
+{
+	const int c = mulhi((y - 16) * 64, CY);
+	const int d = (u - 128) * 64;
+	const int e = (v - 128) * 64;
+	const int r = c + mulhi(e, CRV);
+	const int g = c - mulhi(d, CGU) - mulhi(e, CGV);
+	const int b = c + mulhi(d, CBU) + (d >> 2);
+	return 0xff000000u | (uint32_t)clamp8((r + 8) >> 4) << 16 | (uint32_t)clamp8((g + 8) >> 4) << 8 | clamp8((b + 8) >> 4);
+}
+
+
+static void yuyv_row_scalar(const uint8_t* src, uint32_t* dst, int width)
+{
+	for (int x=0; x<width; x+=2, src+=4, dst+=2)
+	{
+		dst[0] = yuv_to_xrgb(src[0], src[1], src[3]);
+		dst[1] = yuv_to_xrgb(src[2], src[1], src[3]);
+	}
+}
+
+
+static void nv12_row_scalar(const uint8_t* y, const uint8_t* uv, uint32_t* dst, int width)
+{
+	for (int x=0; x<width; x+=2, dst+=2)
+	{
+		dst[0] = yuv_to_xrgb(y[x+0], uv[x], uv[x+1]);
+		dst[1] = yuv_to_xrgb(y[x+1], uv[x], uv[x+1]);
+	}
+}
+
+
+// Two rows of YUYV to two rows of luma and one of (averaged) chroma.
+static void yuyv_nv12_row_scalar(const uint8_t* src0, const uint8_t* src1, uint8_t* y0, uint8_t* y1, uint8_t* uv, int width)
+{
+	for (int x=0; x<width; ++x)
+	{
+		y0[x] = src0[2*x];
+		y1[x] = src1[2*x];
+		uv[x] = (src0[2*x+1] + src1[2*x+1] + 1) >> 1;
+	}
+}
+
+
+static void copy_row_scalar(const uint8_t* src, uint8_t* dst, int row_bytes)
+{
+	memcpy(dst, src, row_bytes);
+}
+
+
+#if defined(PIXEL_X86)
+
+// 8 pixels: 8 luma and 4 chroma pairs, as 16 bit lanes, to XRGB.
+static inline void yuyv8_to_xrgb_sse2(__m128i yuyv, __m128i* out)
+{
+	const __m128i y = _mm_and_si128(yuyv, _mm_set1_epi16(0x00ff));
+	const __m128i uv = _mm_srli_epi16(yuyv, 8);
+	const __m128i u = _mm_shufflehi_epi16(_mm_shufflelo_epi16(uv, _MM_SHUFFLE(2,2,0,0)), _MM_SHUFFLE(2,2,0,0));
+	const __m128i v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(uv, _MM_SHUFFLE(3,3,1,1)), _MM_SHUFFLE(3,3,1,1));
+
+	const __m128i c = _mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(y, _mm_set1_epi16(16)), 6), _mm_set1_epi16(CY));
+	const __m128i d = _mm_slli_epi16(_mm_sub_epi16(u, _mm_set1_epi16(128)), 6);
+	const __m128i e = _mm_slli_epi16(_mm_sub_epi16(v, _mm_set1_epi16(128)), 6);
+	const __m128i half = _mm_set1_epi16(8);
+	__m128i r = _mm_add_epi16(c, _mm_mulhi_epi16(e, _mm_set1_epi16(CRV)));
+	__m128i g = _mm_sub_epi16(_mm_sub_epi16(c, _mm_mulhi_epi16(d, _mm_set1_epi16(CGU))), _mm_mulhi_epi16(e, _mm_set1_epi16(CGV)));
+	__m128i b = _mm_add_epi16(_mm_add_epi16(c, _mm_mulhi_epi16(d, _mm_set1_epi16(CBU))), _mm_srai_epi16(d, 2));
+	r = _mm_srai_epi16(_mm_add_epi16(r, half), 4);
+	g = _mm_srai_epi16(_mm_add_epi16(g, half), 4);
+	b = _mm_srai_epi16(_mm_add_epi16(b, half), 4);
+
+	// Saturate to bytes, and interleave to B, G, R, X in memory.
+	const __m128i r8 = _mm_packus_epi16(r, r);
+	const __m128i g8 = _mm_packus_epi16(g, g);
+	const __m128i b8 = _mm_packus_epi16(b, b);
+	const __m128i bg = _mm_unpacklo_epi8(b8, g8);
+	const __m128i rx = _mm_unpacklo_epi8(r8, _mm_set1_epi8((char)0xff));
+	out[0] = _mm_unpacklo_epi16(bg, rx);
+	out[1] = _mm_unpackhi_epi16(bg, rx);
+}
+
+
+static void yuyv_row_sse2(const uint8_t* src, uint32_t* dst, int width)
+{
+	int x = 0;
+	for (; x+8 <= width; x+=8, src+=16, dst+=8)
+	{
+		__m128i out[2];
+		yuyv8_to_xrgb_sse2(_mm_loadu_si128((const __m128i*)src), out);
+		_mm_storeu_si128((__m128i*)dst + 0, out[0]);
+		_mm_storeu_si128((__m128i*)dst + 1, out[1]);
+	}
+	yuyv_row_scalar(src, dst, width - x);
+}
+
+
+static void nv12_row_sse2(const uint8_t* y, const uint8_t* uv, uint32_t* dst, int width)
+{
+	int x = 0;
+	for (; x+16 <= width; x+=16, dst+=16)
+	{
+		// Interleaving luma with the chroma pairs gives YUYV.
+		const __m128i luma = _mm_loadu_si128((const __m128i*)(y + x));
+		const __m128i chroma = _mm_loadu_si128((const __m128i*)(uv + x));
+		__m128i out[2];
+		yuyv8_to_xrgb_sse2(_mm_unpacklo_epi8(luma, chroma), out);
+		_mm_storeu_si128((__m128i*)dst + 0, out[0]);
+		_mm_storeu_si128((__m128i*)dst + 1, out[1]);
+		yuyv8_to_xrgb_sse2(_mm_unpackhi_epi8(luma, chroma), out);
+		_mm_storeu_si128((__m128i*)dst + 2, out[0]);
+		_mm_storeu_si128((__m128i*)dst + 3, out[1]);
+	}
+	nv12_row_scalar(y + x, uv + x, dst, width - x);
+}
+
+
+static void yuyv_nv12_row_sse2(const uint8_t* src0, const uint8_t* src1, uint8_t* y0, uint8_t* y1, uint8_t* uv, int width)
+{
+	const __m128i mask = _mm_set1_epi16(0x00ff);
+	int x = 0;
+	for (; x+16 <= width; x+=16)
+	{
+		const __m128i a0 = _mm_loadu_si128((const __m128i*)(src0 + 2*x) + 0);
+		const __m128i a1 = _mm_loadu_si128((const __m128i*)(src0 + 2*x) + 1);
+		const __m128i b0 = _mm_loadu_si128((const __m128i*)(src1 + 2*x) + 0);
+		const __m128i b1 = _mm_loadu_si128((const __m128i*)(src1 + 2*x) + 1);
+		_mm_storeu_si128((__m128i*)(y0 + x), _mm_packus_epi16(_mm_and_si128(a0, mask), _mm_and_si128(a1, mask)));
+		_mm_storeu_si128((__m128i*)(y1 + x), _mm_packus_epi16(_mm_and_si128(b0, mask), _mm_and_si128(b1, mask)));
+		const __m128i ca = _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(a1, 8));
+		const __m128i cb = _mm_packus_epi16(_mm_srli_epi16(b0, 8), _mm_srli_epi16(b1, 8));
+		_mm_storeu_si128((__m128i*)(uv + x), _mm_avg_epu8(ca, cb));
+	}
+	yuyv_nv12_row_scalar(src0 + 2*x, src1 + 2*x, y0 + x, y1 + x, uv + x, width - x);
+}
+
+
+static void copy_row_sse2(const uint8_t* src, uint8_t* dst, int row_bytes)
+{
+	int x = 0;
+	if (((uintptr_t)dst & 15) == 0)
+		for (; x+64 <= row_bytes; x+=64)
+		{
+			const __m128i a = _mm_loadu_si128((const __m128i*)(src + x) + 0);
+			const __m128i b = _mm_loadu_si128((const __m128i*)(src + x) + 1);
+			const __m128i c = _mm_loadu_si128((const __m128i*)(src + x) + 2);
+			const __m128i d = _mm_loadu_si128((const __m128i*)(src + x) + 3);
+			_mm_stream_si128((__m128i*)(dst + x) + 0, a);
+			_mm_stream_si128((__m128i*)(dst + x) + 1, b);
+			_mm_stream_si128((__m128i*)(dst + x) + 2, c);
+			_mm_stream_si128((__m128i*)(dst + x) + 3, d);
+		}
+	memcpy(dst + x, src + x, row_bytes - x);
+}
+
+
+// The same as for SSE2, in two 128 bit lanes of 8 pixels each.
+__attribute__((target("avx2")))
+static inline void yuyv16_to_xrgb_avx2(__m256i yuyv, uint32_t* dst)
+{
+	const __m256i y = _mm256_and_si256(yuyv, _mm256_set1_epi16(0x00ff));
+	const __m256i uv = _mm256_srli_epi16(yuyv, 8);
+	const __m256i u = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(uv, _MM_SHUFFLE(2,2,0,0)), _MM_SHUFFLE(2,2,0,0));
+	const __m256i v = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(uv, _MM_SHUFFLE(3,3,1,1)), _MM_SHUFFLE(3,3,1,1));
+
+	const __m256i c = _mm256_mulhi_epi16(_mm256_slli_epi16(_mm256_sub_epi16(y, _mm256_set1_epi16(16)), 6), _mm256_set1_epi16(CY));
+	const __m256i d = _mm256_slli_epi16(_mm256_sub_epi16(u, _mm256_set1_epi16(128)), 6);
+	const __m256i e = _mm256_slli_epi16(_mm256_sub_epi16(v, _mm256_set1_epi16(128)), 6);
+	const __m256i half = _mm256_set1_epi16(8);
+	__m256i r = _mm256_add_epi16(c, _mm256_mulhi_epi16(e, _mm256_set1_epi16(CRV)));
+	__m256i g = _mm256_sub_epi16(_mm256_sub_epi16(c, _mm256_mulhi_epi16(d, _mm256_set1_epi16(CGU))), _mm256_mulhi_epi16(e, _mm256_set1_epi16(CGV)));
+	__m256i b = _mm256_add_epi16(_mm256_add_epi16(c, _mm256_mulhi_epi16(d, _mm256_set1_epi16(CBU))), _mm256_srai_epi16(d, 2));
+	r = _mm256_srai_epi16(_mm256_add_epi16(r, half), 4);
+	g = _mm256_srai_epi16(_mm256_add_epi16(g, half), 4);
+	b = _mm256_srai_epi16(_mm256_add_epi16(b, half), 4);
+
+	const __m256i r8 = _mm256_packus_epi16(r, r);
+	const __m256i g8 = _mm256_packus_epi16(g, g);
+	const __m256i b8 = _mm256_packus_epi16(b, b);
+	const __m256i bg = _mm256_unpacklo_epi8(b8, g8);
+	const __m256i rx = _mm256_unpacklo_epi8(r8, _mm256_set1_epi8((char)0xff));
+	const __m256i lo = _mm256_unpacklo_epi16(bg, rx);	// Pixels 0-3 and 8-11.
+	const __m256i hi = _mm256_unpackhi_epi16(bg, rx);	// Pixels 4-7 and 12-15.
+	_mm256_storeu_si256((__m256i*)dst + 0, _mm256_permute2x128_si256(lo, hi, 0x20));
+	_mm256_storeu_si256((__m256i*)dst + 1, _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+
+__attribute__((target("avx2")))
+static void yuyv_row_avx2(const uint8_t* src, uint32_t* dst, int width)
+{
+	int x = 0;
+	for (; x+16 <= width; x+=16, src+=32, dst+=16)
+		yuyv16_to_xrgb_avx2(_mm256_loadu_si256((const __m256i*)src), dst);
+	yuyv_row_sse2(src, dst, width - x);
+}
+
+
+__attribute__((target("avx2")))
+static void nv12_row_avx2(const uint8_t* y, const uint8_t* uv, uint32_t* dst, int width)
+{
+	int x = 0;
+	for (; x+16 <= width; x+=16, dst+=16)
+	{
+		const __m128i luma = _mm_loadu_si128((const __m128i*)(y + x));
+		const __m128i chroma = _mm_loadu_si128((const __m128i*)(uv + x));
+		const __m256i yuyv = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi8(luma, chroma)), _mm_unpackhi_epi8(luma, chroma), 1);
+		yuyv16_to_xrgb_avx2(yuyv, dst);
+	}
+	nv12_row_scalar(y + x, uv + x, dst, width - x);
+}
+
+
+__attribute__((target("avx2")))
+static void yuyv_nv12_row_avx2(const uint8_t* src0, const uint8_t* src1, uint8_t* y0, uint8_t* y1, uint8_t* uv, int width)
+{
+	const __m256i mask = _mm256_set1_epi16(0x00ff);
+	int x = 0;
+	for (; x+32 <= width; x+=32)
+	{
+		// Packing works per 128 bit lane, which leaves the 64 bit quarters in the order 0, 2, 1, 3.
+		const __m256i a0 = _mm256_loadu_si256((const __m256i*)(src0 + 2*x) + 0);
+		const __m256i a1 = _mm256_loadu_si256((const __m256i*)(src0 + 2*x) + 1);
+		const __m256i b0 = _mm256_loadu_si256((const __m256i*)(src1 + 2*x) + 0);
+		const __m256i b1 = _mm256_loadu_si256((const __m256i*)(src1 + 2*x) + 1);
+		const __m256i ya = _mm256_packus_epi16(_mm256_and_si256(a0, mask), _mm256_and_si256(a1, mask));
+		const __m256i yb = _mm256_packus_epi16(_mm256_and_si256(b0, mask), _mm256_and_si256(b1, mask));
+		const __m256i ca = _mm256_packus_epi16(_mm256_srli_epi16(a0, 8), _mm256_srli_epi16(a1, 8));
+		const __m256i cb = _mm256_packus_epi16(_mm256_srli_epi16(b0, 8), _mm256_srli_epi16(b1, 8));
+		_mm256_storeu_si256((__m256i*)(y0 + x), _mm256_permute4x64_epi64(ya, _MM_SHUFFLE(3,1,2,0)));
+		_mm256_storeu_si256((__m256i*)(y1 + x), _mm256_permute4x64_epi64(yb, _MM_SHUFFLE(3,1,2,0)));
+		_mm256_storeu_si256((__m256i*)(uv + x), _mm256_permute4x64_epi64(_mm256_avg_epu8(ca, cb), _MM_SHUFFLE(3,1,2,0)));
+	}
+	yuyv_nv12_row_sse2(src0 + 2*x, src1 + 2*x, y0 + x, y1 + x, uv + x, width - x);
+}
+
+
+__attribute__((target("avx2")))
+static void copy_row_avx2(const uint8_t* src, uint8_t* dst, int row_bytes)
+{
+	int x = 0;
+	if (((uintptr_t)dst & 31) == 0)
+		for (; x+128 <= row_bytes; x+=128)
+		{
+			const __m256i a = _mm256_loadu_si256((const __m256i*)(src + x) + 0);
+			const __m256i b = _mm256_loadu_si256((const __m256i*)(src + x) + 1);
+			const __m256i c = _mm256_loadu_si256((const __m256i*)(src + x) + 2);
+			const __m256i d = _mm256_loadu_si256((const __m256i*)(src + x) + 3);
+			_mm256_stream_si256((__m256i*)(dst + x) + 0, a);
+			_mm256_stream_si256((__m256i*)(dst + x) + 1, b);
+			_mm256_stream_si256((__m256i*)(dst + x) + 2, c);
+			_mm256_stream_si256((__m256i*)(dst + x) + 3, d);
+		}
+	copy_row_sse2(src + x, dst + x, row_bytes - x);
+}
+
+#elif defined(PIXEL_NEON)
+
+// (a * b) >> 16, as _mm_mulhi_epi16 does it.
+static inline int16x8_t mulhi_neon(int16x8_t a, int16_t b)
+{
+	const int16x4_t k = vdup_n_s16(b);
+	return vcombine_s16(vshrn_n_s32(vmull_s16(vget_low_s16(a), k), 16), vshrn_n_s32(vmull_s16(vget_high_s16(a), k), 16));
+}
+
+
+// 16 pixels, de-interleaved: even luma, U, odd luma, V. To XRGB.
+static inline void yuyv16_to_xrgb_neon(uint8x8x4_t yuyv, uint32_t* dst)
+{
+	const int16x8_t d = vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(yuyv.val[1])), vdupq_n_s16(128)), 6);
+	const int16x8_t e = vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(yuyv.val[3])), vdupq_n_s16(128)), 6);
+	const int16x8_t rv = mulhi_neon(e, CRV);
+	const int16x8_t guv = vaddq_s16(mulhi_neon(d, CGU), mulhi_neon(e, CGV));
+	const int16x8_t bu = vaddq_s16(mulhi_neon(d, CBU), vshrq_n_s16(d, 2));
+
+	uint8x8_t b[2], g[2], r[2];
+	for (int i=0; i<2; ++i)
+	{
+		const int16x8_t y = vreinterpretq_s16_u16(vmovl_u8(yuyv.val[i*2]));
+		const int16x8_t c = mulhi_neon(vshlq_n_s16(vsubq_s16(y, vdupq_n_s16(16)), 6), CY);
+		b[i] = vqmovun_s16(vshrq_n_s16(vaddq_s16(vaddq_s16(c, bu), vdupq_n_s16(8)), 4));
+		g[i] = vqmovun_s16(vshrq_n_s16(vaddq_s16(vsubq_s16(c, guv), vdupq_n_s16(8)), 4));
+		r[i] = vqmovun_s16(vshrq_n_s16(vaddq_s16(vaddq_s16(c, rv), vdupq_n_s16(8)), 4));
+	}
+	// Even and odd pixels back in order, and interleaved to B, G, R, X in memory.
+	const uint8x8x2_t bz = vzip_u8(b[0], b[1]);
+	const uint8x8x2_t gz = vzip_u8(g[0], g[1]);
+	const uint8x8x2_t rz = vzip_u8(r[0], r[1]);
+	const uint8x16x4_t bgrx =
+	{ {
+		vcombine_u8(bz.val[0], bz.val[1]),
+		vcombine_u8(gz.val[0], gz.val[1]),
+		vcombine_u8(rz.val[0], rz.val[1]),
+		vdupq_n_u8(0xff),
+	} };
+	vst4q_u8((uint8_t*)dst, bgrx);
+}
+
+
+static void yuyv_row_neon(const uint8_t* src, uint32_t* dst, int width)
+{
+	int x = 0;
+	for (; x+16 <= width; x+=16, src+=32, dst+=16)
+		yuyv16_to_xrgb_neon(vld4_u8(src), dst);
+	yuyv_row_scalar(src, dst, width - x);
+}
+
+
+static void nv12_row_neon(const uint8_t* y, const uint8_t* uv, uint32_t* dst, int width)
+{
+	int x = 0;
+	for (; x+16 <= width; x+=16, dst+=16)
+	{
+		const uint8x8x2_t luma = vld2_u8(y + x);
+		const uint8x8x2_t chroma = vld2_u8(uv + x);
+		const uint8x8x4_t yuyv = { { luma.val[0], chroma.val[0], luma.val[1], chroma.val[1] } };
+		yuyv16_to_xrgb_neon(yuyv, dst);
+	}
+	nv12_row_scalar(y + x, uv + x, dst, width - x);
+}
+
+
+static void yuyv_nv12_row_neon(const uint8_t* src0, const uint8_t* src1, uint8_t* y0, uint8_t* y1, uint8_t* uv, int width)
+{
+	int x = 0;
+	for (; x+16 <= width; x+=16)
+	{
+		const uint8x16x2_t a = vld2q_u8(src0 + 2*x);
+		const uint8x16x2_t b = vld2q_u8(src1 + 2*x);
+		vst1q_u8(y0 + x, a.val[0]);
+		vst1q_u8(y1 + x, b.val[0]);
+		vst1q_u8(uv + x, vrhaddq_u8(a.val[1], b.val[1]));
+	}
+	yuyv_nv12_row_scalar(src0 + 2*x, src1 + 2*x, y0 + x, y1 + x, uv + x, width - x);
+}
+
+#endif
+
+
+struct pixel_kernels
+{
+	const char*	name;
+	void		(*copy_row)(const uint8_t* src, uint8_t* dst, int row_bytes);
+	void		(*yuyv_row)(const uint8_t* src, uint32_t* dst, int width);
+	void		(*nv12_row)(const uint8_t* y, const uint8_t* uv, uint32_t* dst, int width);
+	void		(*yuyv_nv12_row)(const uint8_t* src0, const uint8_t* src1, uint8_t* y0, uint8_t* y1, uint8_t* uv, int width);
+};
+
+// Best first.
+static const struct pixel_kernels all_kernels[] =
+{
+#if defined(PIXEL_X86)
+	{ "avx2", copy_row_avx2, yuyv_row_avx2, nv12_row_avx2, yuyv_nv12_row_avx2 },
+	{ "sse2", copy_row_sse2, yuyv_row_sse2, nv12_row_sse2, yuyv_nv12_row_sse2 },
+#elif defined(PIXEL_NEON)
+	// For plain copies, memcpy() is as good as it gets on ARM.
+	{ "neon", copy_row_scalar, yuyv_row_neon, nv12_row_neon, yuyv_nv12_row_neon },
+#endif
+	{ "scalar", copy_row_scalar, yuyv_row_scalar, nv12_row_scalar, yuyv_nv12_row_scalar },
+};
+
+static const struct pixel_kernels* kernels;
+
+
+static int cpu_has(const char* impl)
+{
+#if defined(PIXEL_X86)
+	__builtin_cpu_init();
+	if (!strcmp(impl, "avx2"))
+		return __builtin_cpu_supports("avx2");
+	if (!strcmp(impl, "sse2"))
+		return __builtin_cpu_supports("sse2");
+#endif
+	(void)impl;
+	return 1;
+}
+
+
+static void pick_kernels(void)
+{
+	const int count = sizeof(all_kernels) / sizeof(all_kernels[0]);
+	for (int i=count-1; i>=0; --i)
+		if (cpu_has(all_kernels[i].name))
+			kernels = all_kernels + i;
+}
+
+
+const char* pixel_convert_impl(void)
+{
+	if (!kernels)
+		pick_kernels();
+	return kernels->name;
+}
+
+
+int pixel_convert_use(const char* impl)
+{
+	const int count = sizeof(all_kernels) / sizeof(all_kernels[0]);
+	for (int i=0; i<count; ++i)
+		if (!strcmp(all_kernels[i].name, impl) && cpu_has(impl))
+		{
+			kernels = all_kernels + i;
+			return 0;
+		}
+	return -1;
+}
+
+
+void pixel_convert_copy_plane(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride, int row_bytes, int height)
+{
+	if (!kernels)
+		pick_kernels();
+	if (src_stride == row_bytes && dst_stride == row_bytes)
+	{
+		// No padding on either side: one long row.
+		row_bytes *= height;
+		height = 1;
+	}
+	for (int y=0; y<height; ++y)
+		kernels->copy_row(src + (size_t)y * src_stride, dst + (size_t)y * dst_stride, row_bytes);
+#if defined(PIXEL_X86)
+	_mm_sfence();	// Streaming stores are weakly ordered: finish them before the compositor gets the buffer.
+#endif
+}
+
+
+void pixel_convert_yuyv_to_xrgb(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride, int width, int height)
+{
+	if (!kernels)
+		pick_kernels();
+	for (int y=0; y<height; ++y)
+		kernels->yuyv_row(src + (size_t)y * src_stride, (uint32_t*)(dst + (size_t)y * dst_stride), width);
+}
+
+
+void pixel_convert_nv12_to_xrgb(const uint8_t* src_y, int y_stride, const uint8_t* src_uv, int uv_stride, uint8_t* dst, int dst_stride, int width, int height)
+{
+	if (!kernels)
+		pick_kernels();
+	for (int y=0; y<height; ++y)
+		kernels->nv12_row(src_y + (size_t)y * y_stride, src_uv + (size_t)(y / 2) * uv_stride, (uint32_t*)(dst + (size_t)y * dst_stride), width);
+}
+
+
+void pixel_convert_yuyv_to_nv12(const uint8_t* src, int src_stride, uint8_t* dst_y, int y_stride, uint8_t* dst_uv, int uv_stride, int width, int height)
+{
+	if (!kernels)
+		pick_kernels();
+	for (int y=0; y<height; y+=2)
+	{
+		// With an odd height, the last row pairs up with itself.
+		const int y1 = y+1 < height ? y+1 : y;
+		kernels->yuyv_nv12_row
+		(
+			src + (size_t)y * src_stride, src + (size_t)y1 * src_stride,
+			dst_y + (size_t)y * y_stride, dst_y + (size_t)y1 * y_stride,
+			dst_uv + (size_t)(y / 2) * uv_stride,
+			width
+		);
+	}
+}
@@ -0,0 +1,35 @@
+//
+// Copying and converting video frames on the CPU, for when the compositor cannot take our dmabufs.
+// Kernels are picked at run time: AVX2 or SSE2 on x86, NEON on ARM, or plain C.
+// All of them give the same result, to the bit.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#ifndef PIXEL_CONVERT_H
+#define PIXEL_CONVERT_H
+
+#include <stdint.h>
+
+// Name of the kernels in use: "avx2", "sse2", "neon" or "scalar".
+extern const char* pixel_convert_impl(void);
+
+// Use the kernels with the given name from now on, for benchmarks and comparisons.
+// Returns -1 if this build or CPU does not have them.
+extern int pixel_convert_use(const char* impl);
+
+// Copy height rows of row_bytes each, between buffers with their own strides.
+// Rows that are aligned in the destination are written around the cache: it goes to the compositor, not to us.
+extern void pixel_convert_copy_plane(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride, int row_bytes, int height);
+
+// Packed 4:2:2 (YUYV), BT.601 limited range, to XRGB8888. The width must be even.
+extern void pixel_convert_yuyv_to_xrgb(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride, int width, int height);
+
+// Semi-planar 4:2:0 (NV12), BT.601 limited range, to XRGB8888. The width must be even.
+extern void pixel_convert_nv12_to_xrgb(const uint8_t* src_y, int y_stride, const uint8_t* src_uv, int uv_stride, uint8_t* dst, int dst_stride, int width, int height);
+
+// Repack YUYV to NV12: half the bytes of XRGB, for compositors that take NV12 but not YUYV.
+// Chroma is the rounded average of each pair of rows. The width must be even.
+extern void pixel_convert_yuyv_to_nv12(const uint8_t* src, int src_stride, uint8_t* dst_y, int y_stride, uint8_t* dst_uv, int uv_stride, int width, int height);
+
+#endif
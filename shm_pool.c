@@ -0,0 +1,93 @@
+//
+// A pool of wl_shm buffers: one memfd, mapped once and shared with the compositor, cut into equal buffers.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#define _GNU_SOURCE	// For memfd_create()
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "shm_pool.h"
+
+
+static void buffer_release(void* data, struct wl_buffer* buffer)
+{
+	(void)buffer;
+	struct shm_pool_buffer* b = data;
+	b->busy = 0;
+}
+
+static const struct wl_buffer_listener buffer_listener =
+{
+	.release = buffer_release,
+};
+
+
+int shm_pool_init(struct shm_pool* pool, struct wl_shm* shm, int count, int32_t width, int32_t height, int32_t stride, size_t buffer_size, uint32_t format)
+{
+	memset(pool, 0, sizeof(*pool));
+	if (count > SHM_POOL_MAX_BUFFERS)
+		count = SHM_POOL_MAX_BUFFERS;
+	const size_t page = sysconf(_SC_PAGESIZE);
+	pool->buffer_size = (buffer_size + page - 1) / page * page;
+	pool->size = pool->buffer_size * count;
+
+	const int fd = memfd_create("shm_pool", MFD_CLOEXEC);
+	if (fd < 0 || ftruncate(fd, pool->size) < 0)
+	{
+		fprintf(stderr, "Cannot make a memfd of %zu bytes: %s\n", pool->size, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	pool->data = mmap(0, pool->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (pool->data == MAP_FAILED)
+	{
+		fprintf(stderr, "Cannot map the shm pool: %s\n", strerror(errno));
+		pool->data = 0;
+		close(fd);
+		return -1;
+	}
+
+	// The compositor maps the same pages: the fd is not needed after this.
+	struct wl_shm_pool* shm_pool = wl_shm_create_pool(shm, fd, pool->size);
+	close(fd);
+	for (int b=0; b<count; ++b)
+	{
+		struct shm_pool_buffer* buffer = pool->buffers + b;
+		const size_t offset = pool->buffer_size * b;
+		buffer->data = pool->data + offset;
+		buffer->wl_buffer = wl_shm_pool_create_buffer(shm_pool, offset, width, height, stride, format);
+		wl_buffer_add_listener(buffer->wl_buffer, &buffer_listener, buffer);
+	}
+	wl_shm_pool_destroy(shm_pool);
+	pool->num_buffers = count;
+	return 0;
+}
+
+
+struct shm_pool_buffer* shm_pool_acquire(struct shm_pool* pool)
+{
+	for (int b=0; b<pool->num_buffers; ++b)
+		if (!pool->buffers[b].busy)
+		{
+			pool->buffers[b].busy = 1;
+			return pool->buffers + b;
+		}
+	return 0;
+}
+
+
+void shm_pool_fini(struct shm_pool* pool)
+{
+	for (int b=0; b<pool->num_buffers; ++b)
+		wl_buffer_destroy(pool->buffers[b].wl_buffer);
+	if (pool->data)
+		munmap(pool->data, pool->size);
+	memset(pool, 0, sizeof(*pool));
+}
@@ -0,0 +1,43 @@
+//
+// A pool of wl_shm buffers: one memfd, mapped once and shared with the compositor, cut into equal buffers.
+// Buffers are made once, and recycled when the compositor releases them.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#ifndef SHM_POOL_H
+#define SHM_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <wayland-client.h>
+
+#define SHM_POOL_MAX_BUFFERS	4
+
+struct shm_pool_buffer
+{
+	struct wl_buffer*	wl_buffer;
+	uint8_t*		data;
+	int			busy;		// Attached, and not yet released by the compositor.
+};
+
+struct shm_pool
+{
+	uint8_t*		data;		// The whole memfd.
+	size_t			size;
+	size_t			buffer_size;	// Rounded up to whole pages.
+	int			num_buffers;
+	struct shm_pool_buffer	buffers[SHM_POOL_MAX_BUFFERS];
+};
+
+// Make count buffers, each holding buffer_size bytes, of which the first plane is width x height at stride.
+// The format is a wl_shm format. Returns -1 on failure.
+extern int shm_pool_init(struct shm_pool* pool, struct wl_shm* shm, int count, int32_t width, int32_t height, int32_t stride, size_t buffer_size, uint32_t format);
+
+// A buffer that the compositor is not using, marked busy, or 0 if it holds them all.
+extern struct shm_pool_buffer* shm_pool_acquire(struct shm_pool* pool);
+
+extern void shm_pool_fini(struct shm_pool* pool);
+
+#endif
@@ -0,0 +1,56 @@
+//
+// Time to first picture: when each startup step finished, counted from the start of the process.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "startup_trace.h"
+
+static uint64_t start_ns;	// CLOCK_MONOTONIC, at the start of the process.
+
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+// How long ago the process was started, from its start time in clock ticks since boot. Returns 0 if unknown.
+static uint64_t process_age_ns(void)
+{
+	FILE* f = fopen("/proc/self/stat", "r");
+	if (!f)
+		return 0;
+	// The start time is field 22. The command name (field 2) is ours: it holds no ')'.
+	unsigned long long ticks = 0;
+	const int found = fscanf(f, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu", &ticks);
+	fclose(f);
+	const long hz = sysconf(_SC_CLK_TCK);
+	if (found != 1 || hz <= 0)
+		return 0;
+	const uint64_t started = ticks * (1000000000ull / hz);
+	const uint64_t now = clock_ns(CLOCK_BOOTTIME);
+	return now > started ? now - started : 0;
+}
+
+
+void startup_trace_begin(void)
+{
+	start_ns = clock_ns(CLOCK_MONOTONIC) - process_age_ns();
+	startup_trace_mark("process started, libraries loaded");
+}
+
+
+double startup_trace_mark(const char* step)
+{
+	const double ms = (clock_ns(CLOCK_MONOTONIC) - start_ns) / 1e6;
+	fprintf(stderr, "startup: %8.2f ms  %s\n", ms, step);
+	return ms;
+}
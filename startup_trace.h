@@ -0,0 +1,17 @@
+//
+// Time to first picture: when each startup step finished, counted from the start of the process (not of main()),
+// so that loading the shared libraries is included (to within a clock tick). One line per step, on stderr.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#ifndef STARTUP_TRACE_H
+#define STARTUP_TRACE_H
+
+// Call first thing in main().
+extern void startup_trace_begin(void);
+
+// Log a step that just finished, and return the ms since the process started. Can be called from any thread.
+extern double startup_trace_mark(const char* step);
+
+#endif
@@ -0,0 +1,514 @@
+//
+// A V4L2 capture device whose buffers are dmabufs, exported by the driver or of our own, with all its state in one object.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "v4l2_stream.h"
+
+#define EXTRA_BUFFERS	2	// On top of the driver minimum: one on screen, one pending in the compositor.
+
+
+static int xioctl(int fd, unsigned long request, void *arg)
+{
+	int r;
+	do {
+		r = ioctl(fd, request, arg);
+	} while (r == -1 && errno == EINTR);
+	return r;
+}
+
+
+// The format of the device that we can present, and that the caller ranks highest. The first of those, on a tie.
+static uint32_t negotiate_format(struct v4l2_stream* s, int (*accept)(uint32_t drm_fourcc))
+{
+	uint32_t best = 0;
+	int best_rank = 0;
+	for (uint32_t i=0; ; ++i)
+	{
+		struct v4l2_fmtdesc fmtdesc;
+		memset(&fmtdesc, 0, sizeof(fmtdesc));
+		fmtdesc.index = i;
+		fmtdesc.type = s->type;
+		if (xioctl(s->fd, VIDIOC_ENUM_FMT, &fmtdesc) < 0)
+			return best;
+		const struct vid_format_desc* desc = vid_format_find(fmtdesc.pixelformat);
+		const int rank = !desc ? 0 : accept ? accept(desc->drm_fourcc) : 1;
+		if (rank > best_rank)
+		{
+			best = fmtdesc.pixelformat;
+			best_rank = rank;
+		}
+	}
+}
+
+
+int v4l2_stream_read_format(struct v4l2_stream* s)
+{
+	const int mplane = V4L2_TYPE_IS_MULTIPLANAR(s->type);
+	memset(&s->format, 0, sizeof(s->format));
+	s->format.type = s->type;
+	if (xioctl(s->fd, VIDIOC_G_FMT, &s->format) < 0)
+	{
+		fprintf(stderr, "%s: VIDIOC_G_FMT failed: %s\n", s->devname, strerror(errno));
+		return -1;
+	}
+	const uint32_t fourcc = mplane ? s->format.fmt.pix_mp.pixelformat : s->format.fmt.pix.pixelformat;
+	s->width = mplane ? s->format.fmt.pix_mp.width : s->format.fmt.pix.width;
+	s->height = mplane ? s->format.fmt.pix_mp.height : s->format.fmt.pix.height;
+	s->num_mem_planes = mplane ? s->format.fmt.pix_mp.num_planes : 1;
+	s->desc = vid_format_find(fourcc);
+	if (!s->desc || s->desc->mem_planes != s->num_mem_planes)
+	{
+		fprintf(stderr, "%s: pixelformat %c%c%c%c is not supported.\n", s->devname, (fourcc>>0)&0xff, (fourcc>>8)&0xff, (fourcc>>16)&0xff, (fourcc>>24)&0xff);
+		s->desc = 0;
+		return -1;
+	}
+	vid_format_layout(s->desc, &s->format, s->layout);
+	fprintf(stderr, "%s captures %c%c%c%c at %ux%u.\n", s->devname, (fourcc>>0)&0xff, (fourcc>>8)&0xff, (fourcc>>16)&0xff, (fourcc>>24)&0xff, s->width, s->height);
+	return 0;
+}
+
+
+// Lock on to the timings of the source, on devices that have them (such as HDMI inputs),
+// and set the pixelformat (0 for the current one) at the resolution that gives.
+static int apply_format(struct v4l2_stream* s, uint32_t pixelformat)
+{
+	const int mplane = V4L2_TYPE_IS_MULTIPLANAR(s->type);
+	uint32_t width = 0;
+	uint32_t height = 0;
+	struct v4l2_dv_timings timings;
+	memset(&timings, 0, sizeof(timings));
+	if (xioctl(s->fd, VIDIOC_QUERY_DV_TIMINGS, &timings) == 0)
+	{
+		if (xioctl(s->fd, VIDIOC_S_DV_TIMINGS, &timings) < 0)
+			fprintf(stderr, "%s: VIDIOC_S_DV_TIMINGS failed: %s\n", s->devname, strerror(errno));
+		else
+		{
+			width = timings.bt.width;
+			height = timings.bt.height;
+			fprintf(stderr, "%s: source timings are %ux%u.\n", s->devname, width, height);
+		}
+	}
+	else if (errno != ENOTTY && errno != ENODATA)
+		fprintf(stderr, "%s: no stable source timings: %s\n", s->devname, strerror(errno));
+
+	memset(&s->format, 0, sizeof(s->format));
+	s->format.type = s->type;
+	if (xioctl(s->fd, VIDIOC_G_FMT, &s->format) < 0)
+	{
+		fprintf(stderr, "%s: VIDIOC_G_FMT failed: %s\n", s->devname, strerror(errno));
+		return -1;
+	}
+	// The driver works out the pitch and size again, for the new resolution.
+	if (mplane)
+	{
+		if (pixelformat)
+			s->format.fmt.pix_mp.pixelformat = pixelformat;
+		if (width)
+		{
+			s->format.fmt.pix_mp.width = width;
+			s->format.fmt.pix_mp.height = height;
+		}
+		for (int p=0; p<VIDEO_MAX_PLANES; ++p)
+		{
+			s->format.fmt.pix_mp.plane_fmt[p].bytesperline = 0;
+			s->format.fmt.pix_mp.plane_fmt[p].sizeimage = 0;
+		}
+	}
+	else
+	{
+		if (pixelformat)
+			s->format.fmt.pix.pixelformat = pixelformat;
+		if (width)
+		{
+			s->format.fmt.pix.width = width;
+			s->format.fmt.pix.height = height;
+		}
+		s->format.fmt.pix.bytesperline = 0;
+		s->format.fmt.pix.sizeimage = 0;
+	}
+	if (xioctl(s->fd, VIDIOC_S_FMT, &s->format) < 0)
+		fprintf(stderr, "%s: VIDIOC_S_FMT failed: %s\n", s->devname, strerror(errno));
+
+	// Whatever the driver made of that, it is what we get.
+	return v4l2_stream_read_format(s);
+}
+
+
+int v4l2_stream_reset_format(struct v4l2_stream* s, uint32_t pixelformat)
+{
+	return apply_format(s, pixelformat);
+}
+
+
+uint32_t v4l2_stream_best_format(struct v4l2_stream* s, int (*accept)(uint32_t drm_fourcc))
+{
+	return negotiate_format(s, accept);
+}
+
+
+int v4l2_stream_open(struct v4l2_stream* s, const char* devname, uint32_t required_format, int (*accept)(uint32_t drm_fourcc))
+{
+	memset(s, 0, sizeof(*s));
+	s->devname = devname;
+	s->last_sequence = -1;
+	s->fd = open(devname, O_RDWR | O_NONBLOCK);
+	if (s->fd < 0)
+	{
+		fprintf(stderr, "Cannot open %s: %s\n", devname, strerror(errno));
+		return -1;
+	}
+
+	struct v4l2_capability cap;
+	if (xioctl(s->fd, VIDIOC_QUERYCAP, &cap) < 0)
+	{
+		fprintf(stderr, "%s: QUERYCAP failed: %s\n", devname, strerror(errno));
+		goto fail;
+	}
+	const uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+	if (!(caps & V4L2_CAP_STREAMING) || !(caps & (V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_CAPTURE_MPLANE)))
+	{
+		fprintf(stderr, "%s cannot stream video.\n", devname);
+		goto fail;
+	}
+	s->type = (caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE) ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if (!required_format)
+		required_format = negotiate_format(s, accept);
+	if (apply_format(s, required_format) < 0)
+		goto fail;
+	if (accept && !accept(s->desc->drm_fourcc))
+	{
+		fprintf(stderr, "%s: its pixelformat cannot be presented.\n", devname);
+		goto fail;
+	}
+
+	// Have the device tell us when the source changes resolution, e.g. on an HDMI input.
+	struct v4l2_event_subscription sub;
+	memset(&sub, 0, sizeof(sub));
+	sub.type = V4L2_EVENT_SOURCE_CHANGE;
+	if (xioctl(s->fd, VIDIOC_SUBSCRIBE_EVENT, &sub) < 0)
+		fprintf(stderr, "%s does not report source changes.\n", devname);
+	return 0;
+
+fail:
+	close(s->fd);
+	s->fd = -1;
+	return -1;
+}
+
+
+// Make the device capture into dmabufs of our own, if it can import them.
+static void use_own_buffers(struct v4l2_stream* s)
+{
+	struct v4l2_requestbuffers request;
+	memset(&request, 0, sizeof(request));
+	request.type = s->type;
+	request.memory = V4L2_MEMORY_DMABUF;
+	if (xioctl(s->fd, VIDIOC_REQBUFS, &request) < 0)
+	{
+		fprintf(stderr, "%s cannot import dmabufs, using its own buffers: %s\n", s->devname, strerror(errno));
+		return;
+	}
+	s->memory = V4L2_MEMORY_DMABUF;
+
+	// The pitch is up to the driver: we lay out and size our buffers for whatever bytesperline it gives back.
+	struct v4l2_format format = s->format;
+	if (V4L2_TYPE_IS_MULTIPLANAR(format.type))
+		for (int p=0; p<format.fmt.pix_mp.num_planes; ++p)
+			format.fmt.pix_mp.plane_fmt[p].bytesperline = format.fmt.pix_mp.plane_fmt[p].sizeimage = 0;
+	else
+		format.fmt.pix.bytesperline = format.fmt.pix.sizeimage = 0;
+	if (xioctl(s->fd, VIDIOC_S_FMT, &format) < 0)
+	{
+		fprintf(stderr, "%s: VIDIOC_S_FMT failed: %s\n", s->devname, strerror(errno));
+		return;
+	}
+	s->format = format;
+	vid_format_layout(s->desc, &s->format, s->layout);
+}
+
+
+// Query, export (or allocate) and queue buffer b, after the driver made it.
+// Only a buffer that made it all the way is counted. If it fails partway, its fds are closed again.
+static int add_buffer(struct v4l2_stream* s, int b)
+{
+	struct v4l2_stream_buffer* buffer = s->buffers + b;
+	memset(buffer, 0, sizeof(*buffer));
+	for (int p=0; p<VIDEO_MAX_PLANES; ++p)
+		buffer->dma_fds[p] = -1;
+
+	buffer->buf.type = s->type;
+	buffer->buf.memory = s->memory;
+	buffer->buf.index = b;
+	const int mplane = V4L2_TYPE_IS_MULTIPLANAR(s->type);
+	if (mplane)
+	{
+		buffer->buf.length = VIDEO_MAX_PLANES;
+		buffer->buf.m.planes = buffer->planes;
+	}
+	if (xioctl(s->fd, VIDIOC_QUERYBUF, &buffer->buf) < 0)
+	{
+		fprintf(stderr, "%s: VIDIOC_QUERYBUF failed: %s\n", s->devname, strerror(errno));
+		goto fail;
+	}
+	for (int p=0; p<s->num_mem_planes; ++p)
+	{
+		if (s->memory == V4L2_MEMORY_DMABUF)
+		{
+			// At least the size the driver asks for, and what its rows take at the pitch it gave us.
+			uint32_t size = mplane ? buffer->planes[p].length : buffer->buf.length;
+			const uint32_t sizeimage = mplane ? s->format.fmt.pix_mp.plane_fmt[p].sizeimage : s->format.fmt.pix.sizeimage;
+			const uint32_t rows = vid_format_mem_plane_size(s->desc, &s->format, s->layout, p);
+			if (sizeimage > size)
+				size = sizeimage;
+			if (rows > size)
+				size = rows;
+			buffer->dma_fds[p] = dma_alloc_buffer(s->alloc, size);
+			if (buffer->dma_fds[p] < 0)
+				goto fail;
+			if (mplane)
+			{
+				buffer->planes[p].m.fd = buffer->dma_fds[p];
+				buffer->planes[p].length = size;
+			}
+			else
+			{
+				buffer->buf.m.fd = buffer->dma_fds[p];
+				buffer->buf.length = size;
+			}
+			continue;
+		}
+		struct v4l2_exportbuffer exp;
+		memset(&exp, 0, sizeof(exp));
+		exp.type = s->type;
+		exp.index = b;
+		exp.plane = p;
+		if (xioctl(s->fd, VIDIOC_EXPBUF, &exp) < 0)
+		{
+			fprintf(stderr, "%s: VIDIOC_EXPBUF failed for buffer %d, plane %d: %s\n", s->devname, b, p, strerror(errno));
+			goto fail;
+		}
+		buffer->dma_fds[p] = exp.fd;
+	}
+	if (v4l2_stream_queue(s, b) < 0)
+		goto fail;
+	s->num_buffers = b+1;
+	return 0;
+
+fail:
+	for (int p=0; p<VIDEO_MAX_PLANES; ++p)
+		if (buffer->dma_fds[p] >= 0)
+			close(buffer->dma_fds[p]);
+	memset(buffer, 0, sizeof(*buffer));
+	return -1;
+}
+
+
+// Have the driver make depth buffers, and add them all.
+static int add_buffers(struct v4l2_stream* s, int depth)
+{
+	struct v4l2_requestbuffers request;
+	memset(&request, 0, sizeof(request));
+	request.type = s->type;
+	request.memory = s->memory;
+	request.count = depth;
+	if (xioctl(s->fd, VIDIOC_REQBUFS, &request) < 0 || request.count < 2)
+	{
+		fprintf(stderr, "%s: VIDIOC_REQBUFS failed: %s\n", s->devname, strerror(errno));
+		return -1;
+	}
+	if (request.count > VIDEO_MAX_FRAME)
+		request.count = VIDEO_MAX_FRAME;
+
+	for (uint32_t b=0; b<request.count; ++b)
+		if (add_buffer(s, b) < 0)
+			return -1;
+	return 0;
+}
+
+
+// Close the dmabuf fds, and have the driver free its buffers.
+static void free_buffers(struct v4l2_stream* s)
+{
+	for (int b=0; b<s->num_buffers; ++b)
+		for (int p=0; p<s->num_mem_planes; ++p)
+			if (s->buffers[b].dma_fds[p] >= 0)
+				close(s->buffers[b].dma_fds[p]);
+	s->num_buffers = 0;
+	s->in_driver = 0;
+
+	struct v4l2_requestbuffers request;
+	memset(&request, 0, sizeof(request));
+	request.type = s->type;
+	request.memory = s->memory;
+	if (xioctl(s->fd, VIDIOC_REQBUFS, &request) < 0)
+		fprintf(stderr, "%s: VIDIOC_REQBUFS failed to free the buffers: %s\n", s->devname, strerror(errno));
+}
+
+
+int v4l2_stream_start(struct v4l2_stream* s, int depth, struct dma_alloc* alloc)
+{
+	s->memory = V4L2_MEMORY_MMAP;
+	s->alloc = alloc;
+	s->last_sequence = -1;
+	if (alloc)
+		use_own_buffers(s);
+
+	if (depth <= 0)
+	{
+		struct v4l2_control ctrl;
+		memset(&ctrl, 0, sizeof(ctrl));
+		ctrl.id = V4L2_CID_MIN_BUFFERS_FOR_CAPTURE;
+		depth = (xioctl(s->fd, VIDIOC_G_CTRL, &ctrl) < 0 || ctrl.value < 1) ? 1 : ctrl.value;
+		depth += EXTRA_BUFFERS;
+	}
+	if (depth > VIDEO_MAX_FRAME)
+		depth = VIDEO_MAX_FRAME;
+
+	if (add_buffers(s, depth) < 0)
+	{
+		if (s->memory != V4L2_MEMORY_DMABUF)
+			return -1;
+		// It said it could import dmabufs, but it will not take ours after all.
+		fprintf(stderr, "%s cannot capture into our dmabufs, using its own buffers.\n", s->devname);
+		free_buffers(s);
+		s->memory = V4L2_MEMORY_MMAP;
+		if (add_buffers(s, depth) < 0)
+			return -1;
+	}
+
+	enum v4l2_buf_type type = s->type;
+	if (xioctl(s->fd, VIDIOC_STREAMON, &type) < 0)
+	{
+		fprintf(stderr, "%s: VIDIOC_STREAMON failed: %s\n", s->devname, strerror(errno));
+		return -1;
+	}
+	fprintf(stderr, "%s streams into %d dma buffers%s.\n", s->devname, s->num_buffers, s->memory == V4L2_MEMORY_DMABUF ? " of our own" : "");
+	return 0;
+}
+
+
+int v4l2_stream_grow(struct v4l2_stream* s)
+{
+	if (s->num_buffers >= VIDEO_MAX_FRAME)
+		return -1;
+	struct v4l2_create_buffers create;
+	memset(&create, 0, sizeof(create));
+	create.count = 1;
+	create.memory = s->memory;
+	create.format = s->format;
+	if (xioctl(s->fd, VIDIOC_CREATE_BUFS, &create) < 0)
+	{
+		fprintf(stderr, "%s: VIDIOC_CREATE_BUFS failed: %s\n", s->devname, strerror(errno));
+		return -1;
+	}
+	// A buffer we cannot use stays with the driver, unqueued, until the stream stops: it cannot be freed on its own.
+	if (create.count < 1 || (int)create.index != s->num_buffers || add_buffer(s, create.index) < 0)
+		return -1;
+	return create.index;
+}
+
+
+int v4l2_stream_next(struct v4l2_stream* s)
+{
+	struct v4l2_buffer buf;
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	memset(&buf, 0, sizeof(buf));
+	buf.type = s->type;
+	buf.memory = s->memory;
+	if (V4L2_TYPE_IS_MULTIPLANAR(s->type))
+	{
+		memset(planes, 0, sizeof(planes));
+		buf.length = VIDEO_MAX_PLANES;
+		buf.m.planes = planes;
+	}
+	if (xioctl(s->fd, VIDIOC_DQBUF, &buf) < 0)
+	{
+		if (errno != EAGAIN)
+			fprintf(stderr, "%s: VIDIOC_DQBUF failed: %s\n", s->devname, strerror(errno));
+		return -1;
+	}
+	struct v4l2_stream_buffer* buffer = s->buffers + buf.index;
+	buffer->in_driver = 0;
+	buffer->buf.timestamp = buf.timestamp;
+	buffer->buf.sequence = buf.sequence;
+	buffer->buf.flags = buf.flags;
+	s->in_driver--;
+	// Gaps in the sequence are frames the driver had no buffer for.
+	if (s->last_sequence >= 0 && buf.sequence > s->last_sequence + 1)
+		s->dropped += buf.sequence - s->last_sequence - 1;
+	s->last_sequence = buf.sequence;
+	return buf.index;
+}
+
+
+int v4l2_stream_dequeue(struct v4l2_stream* s)
+{
+	int newest = -1;
+	int index;
+	while ((index = v4l2_stream_next(s)) >= 0)
+	{
+		if (newest >= 0)
+			v4l2_stream_queue(s, newest);
+		newest = index;
+	}
+	return newest;
+}
+
+
+int v4l2_stream_queue(struct v4l2_stream* s, int index)
+{
+	struct v4l2_stream_buffer* buffer = s->buffers + index;
+	if (buffer->in_driver)
+		return 0;
+	if (xioctl(s->fd, VIDIOC_QBUF, &buffer->buf) < 0)
+	{
+		fprintf(stderr, "%s: VIDIOC_QBUF failed for buffer %d: %s\n", s->devname, index, strerror(errno));
+		return -1;
+	}
+	buffer->in_driver = 1;
+	s->in_driver++;
+	return 0;
+}
+
+
+int v4l2_stream_source_changed(struct v4l2_stream* s)
+{
+	int changed = 0;
+	struct v4l2_event ev;
+	memset(&ev, 0, sizeof(ev));
+	while (xioctl(s->fd, VIDIOC_DQEVENT, &ev) == 0)
+		if (ev.type == V4L2_EVENT_SOURCE_CHANGE && (ev.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION))
+			changed = 1;
+	return changed;
+}
+
+
+void v4l2_stream_stop(struct v4l2_stream* s)
+{
+	if (s->fd < 0 || !s->num_buffers)
+		return;
+	enum v4l2_buf_type type = s->type;
+	if (xioctl(s->fd, VIDIOC_STREAMOFF, &type) < 0)
+		fprintf(stderr, "%s: VIDIOC_STREAMOFF failed: %s\n", s->devname, strerror(errno));
+	free_buffers(s);
+}
+
+
+void v4l2_stream_close(struct v4l2_stream* s)
+{
+	if (s->fd < 0)
+		return;
+	v4l2_stream_stop(s);
+	close(s->fd);
+	s->fd = -1;
+}
@@ -0,0 +1,87 @@
+//
+// A V4L2 capture device whose buffers are dmabufs, exported by the driver or of our own, with all its state in one object.
+// Used for the single capture device of minimal_nv12, and for each device of its video wall.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#ifndef V4L2_STREAM_H
+#define V4L2_STREAM_H
+
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+#include "vid_format.h"
+#include "dma_alloc.h"
+
+struct v4l2_stream_buffer
+{
+	struct v4l2_buffer	buf;
+	struct v4l2_plane	planes[VIDEO_MAX_PLANES];
+	int			dma_fds[VIDEO_MAX_PLANES];
+	int			in_driver;
+};
+
+struct v4l2_stream
+{
+	const char*			devname;
+	int				fd;		// Readable when a frame is ready.
+	enum v4l2_buf_type		type;
+	enum v4l2_memory		memory;		// V4L2_MEMORY_DMABUF for buffers of our own.
+	struct dma_alloc*		alloc;		// Where buffers of our own come from, or 0.
+	struct v4l2_format		format;
+	const struct vid_format_desc*	desc;
+	uint32_t			width;
+	uint32_t			height;
+	int				num_mem_planes;	// Nr of dmabuf fds per buffer.
+	struct vid_plane_layout		layout[4];	// Per colour plane.
+	int				num_buffers;
+	struct v4l2_stream_buffer	buffers[VIDEO_MAX_FRAME];
+	int				in_driver;	// Nr of buffers queued to the driver.
+	int64_t				last_sequence;
+	int				dropped;	// Frames the driver captured, that we never got.
+};
+
+// Open the device, and set it to the given V4L2 pixelformat, or else to the format that accept() ranks highest.
+// accept() returns 0 for formats we cannot present, and more for the ones we prefer. Without it, any known format goes.
+// Returns -1 on failure, or when the device ends up in a format we cannot present.
+extern int v4l2_stream_open(struct v4l2_stream* s, const char* devname, uint32_t required_format, int (*accept)(uint32_t drm_fourcc));
+
+// Read back the format the device captures in. Returns -1 if we do not know it.
+extern int v4l2_stream_read_format(struct v4l2_stream* s);
+
+// With the stream stopped, after a source change: lock on to the new timings (VIDIOC_QUERY_DV_TIMINGS and
+// VIDIOC_S_DV_TIMINGS), and set the pixelformat (0 for the current one) at the new resolution, as v4l2_stream_open() does.
+extern int v4l2_stream_reset_format(struct v4l2_stream* s, uint32_t pixelformat);
+
+// The V4L2 pixelformat of the device that accept() ranks highest, e.g. after the compositor changed its preferences.
+extern uint32_t v4l2_stream_best_format(struct v4l2_stream* s, int (*accept)(uint32_t drm_fourcc));
+
+// Allocate depth buffers (0 for the driver minimum plus two), export and queue them, and start capturing.
+// With an allocator, the buffers come from there instead, if the device can import them.
+extern int v4l2_stream_start(struct v4l2_stream* s, int depth, struct dma_alloc* alloc);
+
+// Add one buffer while capturing, queued. Returns its index, or -1.
+extern int v4l2_stream_grow(struct v4l2_stream* s);
+
+// Take the oldest captured frame. Returns its buffer index, or -1 if none is ready.
+// The timestamp, sequence nr and flags of the frame are then in the buf of that buffer.
+extern int v4l2_stream_next(struct v4l2_stream* s);
+
+// Take the newest captured frame, and hand older ones straight back. Returns its buffer index, or -1 if none is ready.
+extern int v4l2_stream_dequeue(struct v4l2_stream* s);
+
+// Returns -1 if the driver does not take the buffer.
+extern int v4l2_stream_queue(struct v4l2_stream* s, int index);
+
+// Did the source change resolution, since we last looked?
+extern int v4l2_stream_source_changed(struct v4l2_stream* s);
+
+// Stop capturing, and free the buffers and their dmabuf fds. The device stays open, to start again.
+extern void v4l2_stream_stop(struct v4l2_stream* s);
+
+// Stop capturing, and close the device.
+extern void v4l2_stream_close(struct v4l2_stream* s);
+
+#endif
@@ -0,0 +1,90 @@
+//
+// The V4L2 pixel formats we can present: how they map onto DRM formats, and how their planes are laid out in memory.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#include <stdio.h>
+
+#include "vid_format.h"
+
+
+static const struct vid_format_desc vid_format_descs[] =
+{
+	//  V4L2 format             DRM format          planes  mem_planes  vsub  chroma_stride_div
+	{ V4L2_PIX_FMT_NV12,     DRM_FORMAT_NV12,    2,      1,          2,    1 },
+	{ V4L2_PIX_FMT_NV12M,    DRM_FORMAT_NV12,    2,      2,          2,    1 },
+	{ V4L2_PIX_FMT_NV16,     DRM_FORMAT_NV16,    2,      1,          1,    1 },
+	{ V4L2_PIX_FMT_NV16M,    DRM_FORMAT_NV16,    2,      2,          1,    1 },
+	{ V4L2_PIX_FMT_YUV420,   DRM_FORMAT_YUV420,  3,      1,          2,    2 },
+	{ V4L2_PIX_FMT_YUV420M,  DRM_FORMAT_YUV420,  3,      3,          2,    2 },
+	{ V4L2_PIX_FMT_YUYV,     DRM_FORMAT_YUYV,    1,      1,          1,    1 },
+	{ V4L2_PIX_FMT_UYVY,     DRM_FORMAT_UYVY,    1,      1,          1,    1 },
+};
+
+
+const struct vid_format_desc* vid_format_find(uint32_t v4l2_fourcc)
+{
+	for (size_t i=0; i<sizeof(vid_format_descs)/sizeof(vid_format_descs[0]); ++i)
+		if (vid_format_descs[i].v4l2_fourcc == v4l2_fourcc)
+			return vid_format_descs + i;
+	return 0;
+}
+
+
+// Work out in which fd, at which offset and with which stride each colour plane of a frame lives.
+// Formats with a single memory plane have their chroma plane(s) directly following the luma plane.
+uint32_t vid_format_layout(const struct vid_format_desc* desc, const struct v4l2_format* format, struct vid_plane_layout* layout)
+{
+	const int mplane = V4L2_TYPE_IS_MULTIPLANAR(format->type);
+	const struct v4l2_pix_format_mplane* pix_mp = &format->fmt.pix_mp;
+	const struct v4l2_pix_format* pix = &format->fmt.pix;
+	const uint32_t height = mplane ? pix_mp->height : pix->height;
+
+	uint32_t offset = 0;
+	for (int i=0; i<desc->num_planes; ++i)
+	{
+		struct vid_plane_layout* plane = layout + i;
+		const uint32_t plane_height = i == 0 ? height : height / desc->vsub;
+		if (desc->mem_planes > 1)
+		{
+			// Every colour plane has its own memory plane, with its own fd and stride.
+			plane->mem_plane = i;
+			plane->offset = 0;
+			plane->stride = pix_mp->plane_fmt[i].bytesperline;
+		}
+		else
+		{
+			// All colour planes share one memory plane: chroma follows luma.
+			const uint32_t luma_stride = mplane ? pix_mp->plane_fmt[0].bytesperline : pix->bytesperline;
+			plane->mem_plane = 0;
+			plane->offset = offset;
+			plane->stride = i == 0 ? luma_stride : luma_stride / desc->chroma_stride_div;
+			offset += plane->stride * plane_height;
+		}
+		fprintf
+		(
+			stderr,
+			"Colour plane %d lives in memory plane %d at offset %u with stride %u\n",
+			i, plane->mem_plane, plane->offset, plane->stride
+		);
+	}
+	return offset;
+}
+
+
+uint32_t vid_format_mem_plane_size(const struct vid_format_desc* desc, const struct v4l2_format* format, const struct vid_plane_layout* layout, int mem_plane)
+{
+	const uint32_t height = V4L2_TYPE_IS_MULTIPLANAR(format->type) ? format->fmt.pix_mp.height : format->fmt.pix.height;
+	uint32_t size = 0;
+	for (int i=0; i<desc->num_planes; ++i)
+	{
+		if (layout[i].mem_plane != mem_plane)
+			continue;
+		const uint32_t plane_height = i == 0 ? height : height / desc->vsub;
+		const uint32_t end = layout[i].offset + layout[i].stride * plane_height;
+		if (end > size)
+			size = end;
+	}
+	return size;
+}
@@ -0,0 +1,54 @@
+//
+// The V4L2 pixel formats we can present: how they map onto DRM formats, and how their planes are laid out in memory.
+//
+// (c)2023 by Bram Stolk (b.stolk@gmail.com)
+//
+
+#ifndef VID_FORMAT_H
+#define VID_FORMAT_H
+
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+// DRM fourcc codes, as used by the linux-dmabuf protocol (see drm_fourcc.h)
+#define DRM_FOURCC(a, b, c, d)	((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+#define DRM_FORMAT_NV12		DRM_FOURCC('N', 'V', '1', '2')
+#define DRM_FORMAT_NV16		DRM_FOURCC('N', 'V', '1', '6')
+#define DRM_FORMAT_YUV420	DRM_FOURCC('Y', 'U', '1', '2')
+#define DRM_FORMAT_YUYV		DRM_FOURCC('Y', 'U', 'Y', 'V')
+#define DRM_FORMAT_UYVY		DRM_FOURCC('U', 'Y', 'V', 'Y')
+#define DRM_FORMAT_R8		DRM_FOURCC('R', '8', ' ', ' ')
+#define DRM_FORMAT_GR88		DRM_FOURCC('G', 'R', '8', '8')
+#define DRM_FORMAT_ABGR8888	DRM_FOURCC('A', 'B', '2', '4')
+#define DRM_FORMAT_ARGB8888	DRM_FOURCC('A', 'R', '2', '4')
+#define DRM_FORMAT_XRGB8888	DRM_FOURCC('X', 'R', '2', '4')
+
+struct vid_format_desc
+{
+	uint32_t	v4l2_fourcc;
+	uint32_t	drm_fourcc;
+	int		num_planes;		// Nr of colour planes.
+	int		mem_planes;		// Nr of memory planes V4L2 uses for it.
+	int		vsub;			// Vertical chroma subsampling.
+	int		chroma_stride_div;	// Chroma stride, relative to luma stride.
+};
+
+struct vid_plane_layout
+{
+	int		mem_plane;
+	uint32_t	offset;
+	uint32_t	stride;
+};
+
+// Returns 0 for a format we cannot present.
+extern const struct vid_format_desc* vid_format_find(uint32_t v4l2_fourcc);
+
+// Fills in the layout of each colour plane (desc->num_planes of them), for frames in the given V4L2 format.
+// Returns the size of a frame with a single memory plane (0 for multi-planar formats).
+extern uint32_t vid_format_layout(const struct vid_format_desc* desc, const struct v4l2_format* format, struct vid_plane_layout* layout);
+
+// The bytes a memory plane takes, at the strides of the layout.
+extern uint32_t vid_format_mem_plane_size(const struct vid_format_desc* desc, const struct v4l2_format* format, const struct vid_plane_layout* layout, int mem_plane);
+
+#endif